@@ -0,0 +1,554 @@
+#include <stdio.h>
+
+#include "bench.hh"
+
+// Each case runs for at least this long, in ms, unless -min-time says otherwise
+static const int defaultMinTime = 200;
+// Nodes in the synthetic ring the routing cases run against
+static const int defaultRingNodes = 64;
+// Distinct lookup keys, search queries and stored blocks the cases cycle through
+static const int lookupKeyCount = 1024;
+static const int blockCount = 4096;
+// Same as blockSize in main.cc
+static const int storeBlockSize = 32768;
+// Datagrams sent over loopback before the receiving side reads them
+static const int udpBurst = 64;
+// Protocol timers armed at once in the timer cases
+static const int timerCount = 100000;
+
+// File names in the search catalogs are made of these words
+static const char *catalogWords[] = {
+	"lab", "report", "final", "draft", "notes", "chord", "ring", "finger", "table", "peer",
+	"gossip", "rumor", "block", "file", "search", "music", "video", "photo", "backup", "thesis",
+	"paper", "slides", "homework", "project", "data", "results", "summary", "budget", "invoice", "poster"
+};
+static const int catalogWordCount = sizeof(catalogWords) / sizeof(catalogWords[0]);
+
+
+ServeJob::ServeJob(QByteArray block, QByteArray blockHash)
+{
+	this->block = block;
+	this->blockHash = blockHash;
+}
+
+
+void ServeJob::run()
+{
+	int dataBytes = 0;
+	MessageSender::serialize(MessageSender::buildBlockReply("peer", "bench", blockHash, QVariantList() << block,
+		QStringList() << "qz", QVariantMap(), dataBytes));
+}
+
+
+NullTransport::NullTransport() : Transport()
+{
+	bytesSent = 0;
+}
+
+
+void NullTransport::send(QByteArray data, QHostAddress, quint16)
+{
+	bytesSent += data.size();
+}
+
+
+void NullTransport::sendDatagram(QByteArray data, QHostAddress address, quint16 port)
+{
+	send(data, address, port);
+}
+
+
+// Benchmark constructor. Reads the options and makes a node with no window or socket
+Benchmark::Benchmark(QStringList args) : out(stdout)
+{
+	minTime = defaultMinTime;
+	ringNodes = defaultRingNodes;
+	rngState = 0x9e3779b97f4a7c15ULL;
+	sink = 0;
+
+	for (int i = 1; i < args.size() - 1; i++) {
+		// Tag for every result line, e.g. a commit or machine name
+		if (args[i] == "-label") label = args[i + 1];
+		// Only run cases whose "bench/case" name contains this
+		if (args[i] == "-filter") filter = args[i + 1];
+		if (args[i] == "-min-time") minTime = qMax(1, args[i + 1].toInt());
+		if (args[i] == "-ring-nodes") ringNodes = qBound(2, args[i + 1].toInt(), RING_SIZE);
+	}
+
+	node = new MessageSender(0, &transport);
+	servePool = new QThreadPool();
+}
+
+
+Benchmark::~Benchmark()
+{
+	delete servePool;
+	delete node;
+}
+
+
+// Run every selected case and print one JSON line for each
+int Benchmark::run()
+{
+	benchMessages();
+	benchRouting();
+	benchSha1();
+	benchLocalSearch();
+	benchBlockStore();
+	benchBlockServe();
+	benchUdp();
+	benchTimers();
+	out.flush();
+
+	// Keeps sink alive without cluttering stdout
+	fprintf(stderr, "checksum %llu\n", (unsigned long long)sink);
+	return 0;
+}
+
+
+bool Benchmark::selected(QString bench, QString caseName)
+{
+	return filter.isEmpty() || (bench + "/" + caseName).contains(filter);
+}
+
+
+// Time op in growing batches until one batch takes at least minTime, then report that
+// batch. bytesPerOp adds a throughput figure for cases that process data
+void Benchmark::measure(QString bench, QString caseName, qint64 bytesPerOp, Operation op)
+{
+	// Warm up caches and lazily built state
+	(this->*op)(1);
+
+	qint64 target = minTime * 1000000;
+	qint64 iterations = 1;
+	qint64 elapsed = 0;
+	while (true) {
+		QElapsedTimer timer;
+		timer.start();
+		(this->*op)(iterations);
+		elapsed = qMax((qint64)1, timer.nsecsElapsed());
+		if (elapsed >= target || iterations >= (1 << 30)) break;
+
+		// Aim a little past the target, growing at most 100x per step
+		qint64 estimate = iterations * target / elapsed * 6 / 5 + 1;
+		iterations = qBound(iterations + 1, estimate, qMin(iterations * 100, (qint64)(1 << 30)));
+	}
+
+	double nsPerOp = (double)elapsed / iterations;
+	out << "{\"label\":\"" << label << "\",\"bench\":\"" << bench << "\",\"case\":\"" << caseName
+		<< "\",\"ring_bits\":" << RING_BITS << ",\"iterations\":" << iterations
+		<< ",\"ns_per_op\":" << QString::number(nsPerOp, 'f', 1)
+		<< ",\"ops_per_s\":" << QString::number(1e9 / nsPerOp, 'f', 0);
+	if (bytesPerOp > 0) {
+		out << ",\"bytes_per_op\":" << bytesPerOp
+			<< ",\"mb_per_s\":" << QString::number(bytesPerOp * 1e3 / nsPerOp, 'f', 1);
+	}
+	out << "}" << endl;
+}
+
+
+// xorshift64*, same as the node's gossip RNG. Fixed seed so runs see the same inputs
+quint32 Benchmark::nextRandom()
+{
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return (quint32)((rngState * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+
+// Place the node in a ring of ringNodes random IDs and fill its successor, predecessor and
+// every finger the way stabilization would
+void Benchmark::buildRing(int ringNodes)
+{
+	QSet<quint32> idSet;
+	idSet.insert(node->nodeID);
+	while (idSet.size() < ringNodes) {
+		idSet.insert(nextRandom() % RING_SIZE);
+	}
+	QList<quint32> ring = idSet.toList();
+	qSort(ring);
+
+	// Each member gets a made up address in 10.x.x.x
+	int self = ring.indexOf(node->nodeID);
+	QHostAddress succAddress(0x0a000001 + (self + 1) % ring.size());
+	QHostAddress predAddress(0x0a000001 + (self + ring.size() - 1) % ring.size());
+	node->successor = qMakePair((int)ring[(self + 1) % ring.size()], qMakePair(succAddress, (quint16)5000));
+	node->predecessor = qMakePair((int)ring[(self + ring.size() - 1) % ring.size()], qMakePair(predAddress, (quint16)5000));
+
+	node->fingerTable->clear();
+	node->createFingerTable();
+	for (auto i = node->fingerTable->begin(); i != node->fingerTable->end(); i++) {
+		quint32 start = i.value()[0].toUInt();
+		QList<quint32>::iterator succ = qLowerBound(ring.begin(), ring.end(), start);
+		int index = succ == ring.end() ? 0 : succ - ring.begin();
+		i.value()[2] = QByteArray::number(ring[index]);
+		i.value()[3] = QByteArray::number(0x0a000001 + index);
+		i.value()[4] = QByteArray::number(5000);
+	}
+
+	lookupKeys.clear();
+	for (int i = 0; i < lookupKeyCount; i++) {
+		lookupKeys.append(nextRandom() % RING_SIZE);
+	}
+}
+
+
+// Replace the node's shared files with a catalog of generated names and pick queries for it
+void Benchmark::buildCatalog(int files)
+{
+	node->fileMetadata.clear();
+	node->keywordIndex.clear();
+	for (int i = 0; i < files; i++) {
+		QString fileName = QString("%1_%2_%3.txt").arg(catalogWords[nextRandom() % catalogWordCount])
+			.arg(catalogWords[nextRandom() % catalogWordCount]).arg(i);
+		QByteArray metaHash = QCA::Hash("sha1").hash(fileName.toLatin1()).toByteArray();
+
+		QVariantMap metadataMap;
+		metadataMap.insert("fileName", fileName);
+		metadataMap.insert("fileSize", storeBlockSize);
+		metadataMap.insert("metaFile", metaHash);
+		node->fileMetadata.insert(metaHash, metadataMap);
+		node->indexFile(metaHash, fileName);
+	}
+
+	// One word, two words, a prefix, an exact file and a miss
+	queries.clear();
+	for (int i = 0; i < 16; i++) {
+		QString first = catalogWords[nextRandom() % catalogWordCount];
+		QString second = catalogWords[nextRandom() % catalogWordCount];
+		queries << first << first + " " + second << second.left(3)
+			<< QString("%1 %2").arg(first).arg(nextRandom() % files) << "zzz";
+	}
+}
+
+
+// One message of each kind that goes over the wire often, paired with its name
+QList<QPair<QString, QVariantMap>> Benchmark::sampleMessages()
+{
+	QList<QPair<QString, QVariantMap>> messages;
+
+	QVariantMap rumor;
+	rumor.insert("Origin", node->originID);
+	rumor.insert("SeqNo", 42);
+	rumor.insert("ChatText", QString("See you at the lab meeting tomorrow"));
+	messages.append(qMakePair(QString("rumor"), rumor));
+
+	QVariantMap want;
+	for (int i = 0; i < 8; i++) {
+		want.insert(QString("host%1").arg(nextRandom()), i + 1);
+	}
+	QVariantMap status;
+	status.insert("Want", want);
+	messages.append(qMakePair(QString("status"), status));
+
+	QVariantMap fileSearch;
+	fileSearch.insert("fileSearch", node->nodeID);
+	fileSearch.insert("updateNode", nextRandom() % RING_SIZE);
+	fileSearch.insert("originAddress", 0x0a000001);
+	fileSearch.insert("originPort", 5000);
+	fileSearch.insert("TTL", 2 * RING_BITS - 3);
+	fileSearch.insert("Hops", 3);
+	fileSearch.insert("pathAddresses", QVariantList() << 0x0a00000c << 0x0a00004d << 0x0a00008c);
+	fileSearch.insert("pathPorts", QVariantList() << 5000 << 5000 << 5000);
+	messages.append(qMakePair(QString("fileSearch"), fileSearch));
+
+	QVariantMap findSuccessor;
+	findSuccessor.insert("updateNode", nextRandom() % RING_SIZE);
+	findSuccessor.insert("findSuccessor", 1);
+	findSuccessor.insert("originAddress", 0x0a000001);
+	findSuccessor.insert("originPort", 5000);
+	messages.append(qMakePair(QString("findSuccessor"), findSuccessor));
+
+	QByteArray block(storeBlockSize, 'x');
+	QByteArray blockHash = QCA::Hash("sha1").hash(block).toByteArray();
+	messages.append(qMakePair(QString("blockRequest"), node->createBlockRequest("peer", node->originID, blockHash)));
+	messages.append(qMakePair(QString("blockReply"), node->createBlockReply("peer", node->originID, blockHash, block, QStringList())));
+
+	return messages;
+}
+
+
+// getSerialized and the QVariantMap decode in DatagramIo::readPending, per message type
+void Benchmark::benchMessages()
+{
+	QList<QPair<QString, QVariantMap>> messages = sampleMessages();
+	for (auto message: messages) {
+		currentMap = message.second;
+		currentBytes = node->getSerialized(currentMap);
+		if (selected("serialize", message.first)) measure("serialize", message.first, currentBytes.size(), &Benchmark::opSerialize);
+		if (selected("decode", message.first)) measure("decode", message.first, currentBytes.size(), &Benchmark::opDecode);
+	}
+}
+
+
+// Finger table walks run for every lookup a node forwards
+void Benchmark::benchRouting()
+{
+	buildRing(ringNodes);
+	QString ringCase = QString("ring%1").arg(ringNodes);
+	if (selected("findSuccessor", ringCase)) measure("findSuccessor", ringCase, 0, &Benchmark::opFindSuccessor);
+	if (selected("findClosestPredecessor", ringCase)) measure("findClosestPredecessor", ringCase, 0, &Benchmark::opClosestPredecessor);
+	if (selected("findSearchInterval", ringCase)) measure("findSearchInterval", ringCase, 0, &Benchmark::opSearchInterval);
+}
+
+
+// Block and metafile hashing, the way uploads and block replies do it
+void Benchmark::benchSha1()
+{
+	QList<int> sizes = QList<int>() << 64 << 1024 << 8192 << storeBlockSize << (1 << 20);
+	for (auto size: sizes) {
+		currentBlock = QByteArray(size, 0);
+		for (int i = 0; i < size; i++) {
+			currentBlock[i] = (char)nextRandom();
+		}
+		QString sizeCase = QString("%1B").arg(size);
+		if (selected("sha1", sizeCase)) measure("sha1", sizeCase, size, &Benchmark::opSha1);
+	}
+}
+
+
+// Keyword search against the node's own catalog
+void Benchmark::benchLocalSearch()
+{
+	QList<int> catalogs = QList<int>() << 10000 << 100000;
+	for (auto files: catalogs) {
+		QString catalogCase = QString("files%1").arg(files);
+		if (!selected("localFileSearch", catalogCase)) continue;
+		buildCatalog(files);
+		measure("localFileSearch", catalogCase, 0, &Benchmark::opLocalSearch);
+	}
+	node->fileMetadata.clear();
+	node->keywordIndex.clear();
+}
+
+
+// fileHash inserts and lookups of full size blocks
+void Benchmark::benchBlockStore()
+{
+	if (!selected("blockStore", "put") && !selected("blockStore", "get")) return;
+
+	// Few distinct buffers, many keys, so memory stays small while the map gets big
+	blocks.clear();
+	blockHashes.clear();
+	for (int i = 0; i < 16; i++) {
+		blocks.append(QByteArray(storeBlockSize, (char)nextRandom()));
+	}
+	for (int i = 0; i < blockCount; i++) {
+		QByteArray seed = QByteArray::number(i);
+		blockHashes.append(QCA::Hash("sha1").hash(seed).toByteArray());
+	}
+
+	node->fileHash.clear();
+	if (selected("blockStore", "put")) measure("blockStore", "put", storeBlockSize, &Benchmark::opBlockPut);
+	opBlockPut(blockCount);
+	if (selected("blockStore", "get")) measure("blockStore", "get", storeBlockSize, &Benchmark::opBlockGet);
+	node->fileHash.clear();
+}
+
+
+// Block replies served by 1, 2, 4... worker threads up to the core count, to see how
+// serving scales. Blocks are text-like so compression does real work
+void Benchmark::benchBlockServe()
+{
+	QByteArray text;
+	while (text.size() < storeBlockSize) {
+		text.append(catalogWords[nextRandom() % catalogWordCount]).append(' ');
+		if (nextRandom() % 8 == 0) text.append(QByteArray::number(nextRandom()));
+	}
+	currentBlock = text.left(storeBlockSize);
+
+	int cores = qMax(1, QThread::idealThreadCount());
+	for (int threads = 1; ; threads = qMin(threads * 2, cores)) {
+		QString threadCase = QString("threads%1").arg(threads);
+		if (selected("blockServe", threadCase)) {
+			servePool->setMaxThreadCount(threads);
+			measure("blockServe", threadCase, storeBlockSize, &Benchmark::opBlockServe);
+		}
+		if (threads == cores) break;
+	}
+}
+
+
+// Datagrams per second through a node's socket code over loopback, with recvmmsg/sendmmsg
+// and with one QUdpSocket call per datagram. Each op is one fileSearch sent and received
+void Benchmark::benchUdp()
+{
+	QUdpSocket sendSocket;
+	QUdpSocket receiveSocket;
+	if (!sendSocket.bind(QHostAddress::LocalHost, 0) || !receiveSocket.bind(QHostAddress::LocalHost, 0)) {
+		fprintf(stderr, "udp: could not bind loopback sockets\n");
+		return;
+	}
+	receivePort = receiveSocket.localPort();
+	DatagramIo sender(&sendSocket);
+	DatagramIo receiver(&receiveSocket);
+	sendIo = &sender;
+	receiveIo = &receiver;
+
+	for (auto message: sampleMessages()) {
+		if (message.first == "fileSearch") currentBytes = node->getSerialized(message.second);
+	}
+
+	QList<bool> modes = QList<bool>() << true << false;
+	for (auto batched: modes) {
+		QString caseName = batched ? "mmsg" : "qt";
+		if (!selected("udp", caseName)) continue;
+		sender.setBatchedSyscalls(batched);
+		receiver.setBatchedSyscalls(batched);
+		measure("udp", caseName, currentBytes.size(), &Benchmark::opUdp);
+	}
+}
+
+
+// Restarting and stopping protocol timers while timerCount of them are armed, with
+// deadlines from a tick to ten minutes out
+void Benchmark::benchTimers()
+{
+	if (!selected("timers", "restart") && !selected("timers", "stop")) return;
+	for (int i = 0; i < timerCount; i++) {
+		timers.append(new ProtocolTimer());
+		timers[i]->start(1 + nextRandom() % 600000);
+	}
+	if (selected("timers", "restart")) measure("timers", "restart", 0, &Benchmark::opTimerRestart);
+	if (selected("timers", "stop")) measure("timers", "stop", 0, &Benchmark::opTimerStop);
+	qDeleteAll(timers);
+	timers.clear();
+}
+
+
+void Benchmark::opSerialize(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		sink += node->getSerialized(currentMap).size();
+	}
+}
+
+
+void Benchmark::opDecode(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		QVariantMap receivedMap;
+		QDataStream stream(&currentBytes, QIODevice::ReadOnly);
+		stream >> receivedMap;
+		sink += receivedMap.size();
+	}
+}
+
+
+void Benchmark::opFindSuccessor(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		sink += node->findSuccessor(lookupKeys[i % lookupKeyCount]);
+	}
+}
+
+
+void Benchmark::opClosestPredecessor(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		sink += node->findClosestPredecessor(lookupKeys[i % lookupKeyCount]).size();
+	}
+}
+
+
+void Benchmark::opSearchInterval(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		sink += node->findSearchInterval(lookupKeys[i % lookupKeyCount]).size();
+	}
+}
+
+
+void Benchmark::opSha1(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		sink += (uchar)QCA::Hash("sha1").hash(currentBlock).toByteArray()[0];
+	}
+}
+
+
+// No route to "bench" is known, so the reply is built but never sent
+void Benchmark::opLocalSearch(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		node->localFileSearch(queries[i % queries.size()], "bench");
+	}
+	sink += iterations;
+}
+
+
+void Benchmark::opBlockPut(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		node->fileHash.insert(blockHashes[i % blockCount], blocks[i % blocks.size()]);
+	}
+	sink += node->fileHash.size();
+}
+
+
+void Benchmark::opBlockServe(int iterations)
+{
+	QByteArray blockHash = QCA::Hash("sha1").hash(currentBlock).toByteArray();
+	for (int i = 0; i < iterations; i++) {
+		servePool->start(new ServeJob(currentBlock, blockHash));
+	}
+	servePool->waitForDone();
+	sink += iterations;
+}
+
+
+// Sends go out when the event loop runs the DatagramIo's queued flush, as in a node
+void Benchmark::opUdp(int iterations)
+{
+	uint address = QHostAddress(QHostAddress::LocalHost).toIPv4Address();
+	qint64 before = receiveIo->datagramsRead;
+	for (int sent = 0; sent < iterations; sent += udpBurst) {
+		int burst = qMin(udpBurst, iterations - sent);
+		for (int i = 0; i < burst; i++) {
+			sendIo->write(currentBytes, address, receivePort);
+		}
+		QCoreApplication::processEvents();
+		receiveIo->readPending();
+	}
+	sink += receiveIo->datagramsRead - before;
+}
+
+
+void Benchmark::opTimerRestart(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		timers[nextRandom() % timerCount]->start(1 + nextRandom() % 600000);
+	}
+}
+
+
+// Each stop is paired with a start so the number armed stays the same
+void Benchmark::opTimerStop(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		ProtocolTimer *timer = timers[nextRandom() % timerCount];
+		timer->stop();
+		timer->start(1 + nextRandom() % 600000);
+	}
+}
+
+
+void Benchmark::opBlockGet(int iterations)
+{
+	for (int i = 0; i < iterations; i++) {
+		sink += node->fileHash.value(blockHashes[i % blockCount]).toByteArray().size();
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+
+	// Init Crypto
+	QCA::Initializer qcainit;
+
+	Benchmark bench(app.arguments());
+	return bench.run();
+}
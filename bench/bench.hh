@@ -0,0 +1,108 @@
+#ifndef PEERSTER_BENCH_HH
+#define PEERSTER_BENCH_HH
+
+#include <QTextStream>
+
+#include "main.hh"
+
+
+// Swallows everything a benchmarked node sends
+class NullTransport : public Transport
+{
+public:
+	NullTransport();
+	void send(QByteArray data, QHostAddress address, quint16 port);
+	void sendDatagram(QByteArray data, QHostAddress address, quint16 port);
+
+	qint64 bytesSent;
+};
+
+
+// One block reply built and serialized the way a worker serves it
+class ServeJob : public QRunnable
+{
+public:
+	ServeJob(QByteArray block, QByteArray blockHash);
+	void run();
+
+private:
+	QByteArray block;
+	QByteArray blockHash;
+};
+
+
+// Microbenchmarks for the per message hot paths of one node. Each case runs until it has
+// taken at least minTime ms and prints one JSON line with its cost per operation
+class Benchmark
+{
+public:
+	Benchmark(QStringList args);
+	~Benchmark();
+
+	int run();
+
+private:
+	typedef void (Benchmark::*Operation)(int iterations);
+
+	bool selected(QString bench, QString caseName);
+	void measure(QString bench, QString caseName, qint64 bytesPerOp, Operation op);
+	quint32 nextRandom();
+
+	void buildRing(int ringNodes);
+	void buildCatalog(int files);
+	QList<QPair<QString, QVariantMap>> sampleMessages();
+
+	void benchMessages();
+	void benchRouting();
+	void benchSha1();
+	void benchLocalSearch();
+	void benchBlockStore();
+	void benchBlockServe();
+	void benchUdp();
+	void benchTimers();
+
+	// Operations. Each runs its step the given number of times on the current inputs
+	void opSerialize(int iterations);
+	void opDecode(int iterations);
+	void opFindSuccessor(int iterations);
+	void opClosestPredecessor(int iterations);
+	void opSearchInterval(int iterations);
+	void opSha1(int iterations);
+	void opLocalSearch(int iterations);
+	void opBlockPut(int iterations);
+	void opBlockGet(int iterations);
+	void opBlockServe(int iterations);
+	void opUdp(int iterations);
+	void opTimerRestart(int iterations);
+	void opTimerStop(int iterations);
+
+	NullTransport transport;
+	MessageSender *node;
+	QTextStream out;
+	quint64 rngState;
+
+	// Command line
+	QString label;
+	QString filter;
+	qint64 minTime;
+	int ringNodes;
+
+	// Inputs of the case being measured
+	QVariantMap currentMap;
+	QByteArray currentBytes;
+	QByteArray currentBlock;
+	QList<quint32> lookupKeys;
+	QStringList queries;
+	QList<QByteArray> blocks;
+	QList<QByteArray> blockHashes;
+	QThreadPool *servePool;
+	DatagramIo *sendIo;
+	DatagramIo *receiveIo;
+	quint16 receivePort;
+	QList<ProtocolTimer *> timers;
+
+	// Results are folded in here so the compiler cannot drop the work
+	quint64 sink;
+};
+
+#endif // PEERSTER_BENCH_HH
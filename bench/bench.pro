@@ -0,0 +1,15 @@
+######################################################################
+# Microbenchmarks for the per message hot paths
+######################################################################
+
+TEMPLATE = app
+TARGET = peersterbench
+DEPENDPATH += . ..
+INCLUDEPATH += . ..
+QT += network
+CONFIG += crypto console
+DEFINES += PEERSTER_NO_MAIN QT_NO_DEBUG_OUTPUT
+
+# Input
+HEADERS += ../main.hh bench.hh
+SOURCES += ../main.cc bench.cc
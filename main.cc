@@ -7,6 +7,162 @@
 
 #include "main.hh"
 
+// Header of the node snapshot file written by saveState
+static const quint32 stateMagic = 0x43484f52;
+static const quint32 stateVersion = 4;
+
+// Size of the blocks shared files are split into. Block replies are fragmented by the
+// block transport, so this is not limited by the MTU
+static const int blockSize = 32768;
+
+// Outgoing datagrams are packed up to this many bytes, and wait at most maxBatchDelay ms
+static const int batchBudget = 1400;
+static const int maxBatchDelay = 2;
+// QDataStream cost of the batch map itself and of each message in it
+static const int batchHeaderBytes = 32;
+static const int batchMessageOverhead = 12;
+// Datagrams moved per recvmmsg or sendmmsg call, and the receive buffer for each
+static const int ioBatchSize = 16;
+static const int maxDatagramBytes = 65536;
+
+// Protocol timers go off on the first TimerWheel tick at or after their deadline
+static const int timerTickMs = 10;
+
+// Reliable block transport limits. Retransmission timeouts are kept within
+// [minRto, maxRto] ms and at most maxOutOfOrder segments are buffered per peer
+static const qint64 initialRto = 1000;
+static const qint64 minRto = 200;
+static const qint64 maxRto = 10000;
+static const int maxOutOfOrder = 256;
+static const int maxSackEntries = 32;
+// A peer that ignores maxTransmissions tries of a segment is given up on
+static const int maxTransmissions = 8;
+// Messages are cut into fragments of fragmentBytes so that no datagram exceeds the path
+// MTU. Reassembly keeps at most maxMessageBytes per peer and forgets partial messages
+// that made no progress for reassemblyTimeout ms. That is well past the longest a sender
+// keeps retrying, so a live sender gives up first and its new session tells both sides
+// the message was lost
+static const int fragmentBytes = 1200;
+static const int maxMessageBytes = 1 << 20;
+static const qint64 reassemblyTimeout = 2 * maxTransmissions * maxRto;
+
+// Rumors accepted out of order this far beyond an origin's contiguous SeqNo, and the
+// number of rumor bodies kept for resending
+static const quint32 rumorWindow = 64;
+static const int rumorBodyCacheSize = 1024;
+
+// Anti-entropy round interval in ms, default number of neighbors per round, and the most
+// rumors pushed to a neighbor in answer to one status message
+static const int gossipInterval = 2000;
+static const int defaultGossipFanout = 2;
+static const int maxRumorPush = 16;
+
+// Cap on ring positions per process. The default ring only has 256 IDs
+static const int maxVirtualNodes = 32;
+
+// Load-aware join: how long to wait for load reports, and the window in ms over which
+// handled requests count towards a node's request load. The joiner scores each owner by
+// its keys and its request rate, each relative to the largest reported, weighted by
+// joinKeyWeight and joinRequestWeight
+static const int joinProbeTimeout = 2000;
+static const double requestRateWindow = 60000.0;
+static const double joinKeyWeight = 0.5;
+static const double joinRequestWeight = 0.5;
+
+// Phi accrual failure detection. Neighbors are pinged every heartbeatInterval ms and dropped
+// once phi passes the threshold (-phi-threshold). The detector keeps heartbeatWindow gaps per
+// neighbor, never assumes a deviation below minHeartbeatDeviation and allows an extra
+// acceptableHeartbeatPause on top of the mean gap before suspicion grows
+static const int heartbeatInterval = 2000;
+static const double defaultPhiThreshold = 8.0;
+static const int heartbeatWindow = 100;
+static const double minHeartbeatDeviation = 200.0;
+static const double acceptableHeartbeatPause = 3000.0;
+
+// Hot key caching: a key asked for more than hotKeyThreshold times within about hotKeyWindow
+// ms is pushed to the last hotKeyPushDepth nodes of its lookup path, who answer for it for
+// lookupCacheTtl ms. Counts that decayed below coldKeyRate are forgotten
+static const double hotKeyThreshold = 8.0;
+static const double hotKeyWindow = 10000.0;
+static const double coldKeyRate = 0.5;
+static const int hotKeyPushDepth = 3;
+static const qint64 lookupCacheTtl = 30000;
+
+// Read-through block cache on relaying nodes: total bytes kept, how many recently relayed
+// requests for a block make it worth keeping, and how many block hashes we count requests for
+static const int blockCacheBytes = 16 << 20;
+static const int popularBlockRequests = 2;
+static const int blockRequestHistory = 4096;
+
+// How long a learned route stays usable without being refreshed by traffic, in ms
+static const qint64 routeLifetime = 120000;
+
+// Block replies smaller than this are never worth compressing
+static const int minCompressBytes = 128;
+
+// Routed messages that have not reached their owner after this many hops are dropped
+static const int maxRouteHops = 32;
+
+// A bulk lookup still missing owners after this long, in ms, is given up on. Its lost replies
+// would otherwise keep it pending forever
+static const qint64 bulkLookupTimeout = 30000;
+
+// File lookups give up after this many forwards. Correct fingers need at most RING_BITS
+static const int lookupTtl = 2 * RING_BITS;
+
+// Successors a node keeps in its successor list (rNearest), its own successor included
+static const int successorListSize = 2;
+// Traced lookups whose hop reports we keep at once
+static const int maxTracedLookups = 256;
+
+// Histogram bucket bounds for lookup hop counts and for latencies in ms
+static const double hopBuckets[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32};
+static const double latencyBuckets[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+static const int hopBucketCount = sizeof(hopBuckets) / sizeof(hopBuckets[0]);
+static const int latencyBucketCount = sizeof(latencyBuckets) / sizeof(latencyBuckets[0]);
+
+// Keys that identify a message's type for the metrics, most specific first. Checked in
+// the same order handleMessage dispatches; anything else with an Origin is a rumor
+static const char *messageTypeKeys[] = {
+	"Batch", "RelSeq", "RelAck", "collision", "fileSearch", "lookupHop", "store", "fileNode", "updateFinger",
+	"findSuccessor", "findClosestPredecessor", "successorID", "updateNode",
+	"predecessorStatusRequest", "predecessorStatusReply", "keywordPublish", "hotKey",
+	"loadProbe", "loadReport", "keywordQuery", "bulkLookup", "bulkLookupReply", "bulkStore",
+	"keywordResults", "statePing", "statePong", "predecessorRequest", "predecessorReply",
+	"predecessorTest", "BlockRequest", "BlockReply", "SearchReply",
+	"Want", "Search", "Dest"
+};
+static const int messageTypeKeyCount = sizeof(messageTypeKeys) / sizeof(messageTypeKeys[0]);
+static const int messageTypeCount = messageTypeKeyCount + 2;
+
+// Header of the binary trace dump read by tracedump
+static const quint32 traceMagic = 0x43545243;
+static const quint32 traceVersion = 1;
+
+// Names of the TraceEventId values and of their arguments, in enum order
+static const char *traceEventNames[TraceEventCount] = {
+	"receive", "message", "send", "blockReply", "blockRequest", "closestPredecessor",
+	"findSuccessor", "lookupDone", "successorFailover", "stabilizeRound", "keyMigration",
+	"lookupHop", "neighborSuspected", "blockCacheHit", "lookupCacheHit", "blockReplyDropped",
+	"retransmitTimeout"
+};
+static const char *traceEventArgs[TraceEventCount] = {
+	"bytes,address,port", "type,address,port", "type,bytes", "bytes,wireBytes,valid",
+	"kind,bytes", "target,finger,steps", "target,successor,found", "key,hops,latencyMs",
+	"oldSuccessor,newSuccessor", "successor,ms", "key,predecessor,keyword", "lookup,hop,node",
+	"neighbor,role,phi", "hash,bytes", "key,owner", "hash,transfer,currentTransfer",
+	"port,seq,rto"
+};
+
+// First four bytes of a block hash, enough to tell blocks apart in a trace
+static qint64 traceHash(const QByteArray &hash) {
+	quint32 prefix = 0;
+	for (int i = 0; i < 4 && i < hash.size(); i++) {
+		prefix = (prefix << 8) | (uchar)hash[i];
+	}
+	return prefix;
+}
+
 ChatDialog::ChatDialog()
 {
 	setWindowTitle("Peerster");
@@ -82,8 +238,8 @@ ChatDialog::ChatDialog()
 	fileLayout->addWidget(downloadFileLine);
 	fileLayout->addWidget(fileSearchLabel);
 	fileLayout->addWidget(fileSearchLine);
-	// fileLayout->addWidget(fileSearchResultsLabel);
-	// fileLayout->addWidget(fileSearchResultsList);
+	fileLayout->addWidget(fileSearchResultsLabel);
+	fileLayout->addWidget(fileSearchResultsList);
 	fileLayout->addWidget(chordFileStoreLabel);
 	fileLayout->addWidget(chordFileStore);
 
@@ -197,6 +353,19 @@ bool NetSocket::bind()
 }
 
 
+// Bind socket to a free port chosen by the OS
+bool NetSocket::bindAny()
+{
+	if (QUdpSocket::bind(0)) {
+		myPortVal = localPort();
+		qDebug() << "bound virtual node to UDP port " << myPortVal;
+		return true;
+	}
+	qDebug() << "Oops, no free UDP port for a virtual node";
+	return false;
+}
+
+
 // Return the min port
 int NetSocket::getMyPortMin() {
 	return myPortMin;
@@ -214,967 +383,3983 @@ int NetSocket::getMyPortVal() {
 }
 
 
-Peer::Peer() {
-
+// DatagramBatcher constructor
+DatagramBatcher::DatagramBatcher(QUdpSocket *socket, QObject *parent) : Transport(parent)
+{
+	this->socket = socket;
+	io = 0;
+	firstPendingSince = 0;
+	flushTimer = new QTimer(this);
+	flushTimer->setSingleShot(true);
+	connect(flushTimer, SIGNAL(timeout()), this, SLOT(flush()));
 }
 
-Peer::Peer(QHostAddress ipAddress, quint16 port)
+
+// Queue data for address:port. It goes out when control returns to the event loop, together
+// with everything else queued for the same destination
+void DatagramBatcher::send(QByteArray data, QHostAddress address, quint16 port)
 {
-	this->ipAddress = ipAddress;
-	this->port = port;
+	QPair<quint32, quint16> dest(address.toIPv4Address(), port);
+	qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+	// The event loop is busy and has not run the flush timer, and something has waited
+	// maxBatchDelay. Send everything queued, for every destination, before this one
+	if (!pending.isEmpty() && now - firstPendingSince >= maxBatchDelay) {
+		flush();
+	}
+
+	// Too big to share a datagram. Keep the order by sending what is queued first
+	int messageBytes = data.size() + batchMessageOverhead;
+	if (messageBytes + batchHeaderBytes > batchBudget) {
+		flushDestination(dest);
+		write(data, address, port);
+		return;
+	}
+
+	if (pending.contains(dest) && pendingBytes[dest] + messageBytes > batchBudget) {
+		flushDestination(dest);
+	}
+
+	if (pending.isEmpty()) {
+		firstPendingSince = now;
+	}
+	if (!pending.contains(dest)) {
+		pendingBytes.insert(dest, batchHeaderBytes);
+	}
+	pending[dest].append(data);
+	pendingBytes[dest] += messageBytes;
+
+	if (!flushTimer->isActive()) {
+		flushTimer->start(0);
+	}
 }
 
 
-// Functions for peer
-Peer::Peer(QString hostName, QHostAddress ipAddress, quint16 port)
+// Send data now, after whatever is queued for the same destination, and after everything
+// queued that is past maxBatchDelay
+void DatagramBatcher::sendDatagram(QByteArray data, QHostAddress address, quint16 port)
 {
-	this->hostName = hostName;
-	this->ipAddress = ipAddress;
-	this->port = port;
+	if (!pending.isEmpty() && QDateTime::currentMSecsSinceEpoch() - firstPendingSince >= maxBatchDelay) {
+		flush();
+	}
+	flushDestination(QPair<quint32, quint16>(address.toIPv4Address(), port));
+	write(data, address, port);
 }
 
 
-QString Peer::getHostName() {
-	return hostName;
+// Send everything that is queued
+void DatagramBatcher::flush()
+{
+	for (auto dest: pending.keys()) {
+		flushDestination(dest);
+	}
 }
 
 
-void Peer::setHostName(QString name) {
-	hostName = name;
-}
+// Send the messages queued for dest. A single message goes out as is
+void DatagramBatcher::flushDestination(QPair<quint32, quint16> dest)
+{
+	if (!pending.contains(dest)) return;
+	QList<QByteArray> messages = pending.take(dest);
+	pendingBytes.remove(dest);
 
+	if (messages.size() == 1) {
+		write(messages[0], QHostAddress(dest.first), dest.second);
+		return;
+	}
 
-QHostAddress Peer::getAddress() {
-	return ipAddress;
+	QVariantList batch;
+	for (auto message: messages) {
+		batch.append(message);
+	}
+	QVariantMap batchMap;
+	batchMap.insert("Batch", batch);
+
+	QByteArray out;
+	QDataStream stream(&out, QIODevice::WriteOnly);
+	stream << batchMap;
+	write(out, QHostAddress(dest.first), dest.second);
 }
 
 
-void Peer::setAddress(QHostAddress address) {
-	ipAddress = address;
+// Put one datagram on the wire and count it. With a DatagramIo the write happens on its
+// thread
+void DatagramBatcher::write(QByteArray data, QHostAddress address, quint16 port)
+{
+	datagramsSent++;
+	datagramBytesSent += data.size();
+	if (io) {
+		QMetaObject::invokeMethod(io, "write", Qt::AutoConnection, Q_ARG(QByteArray, data),
+			Q_ARG(uint, address.toIPv4Address()), Q_ARG(int, port));
+	}
+	else {
+		socket->writeDatagram(data, address, port);
+	}
 }
 
 
-quint16 Peer::getPort() {
-	return port;
+// Send through io from now on
+void DatagramBatcher::setIo(DatagramIo *io)
+{
+	this->io = io;
 }
 
 
-void Peer::setPort(quint16 portNum) {
-	port = portNum;
+// DatagramIo constructor. Moved to the I/O thread together with its socket by the node
+DatagramIo::DatagramIo(QUdpSocket *socket) : QObject()
+{
+	this->socket = socket;
+	datagramsRead = 0;
+	flushPosted = false;
+#ifdef PEERSTER_MMSG
+	batchedSyscalls = true;
+#else
+	batchedSyscalls = false;
+#endif
 }
 
 
-// Constructor for MessageSender class
-MessageSender::MessageSender()
+// Use recvmmsg and sendmmsg, or one QUdpSocket call per datagram. Only takes effect where
+// the batched calls were compiled in
+void DatagramIo::setBatchedSyscalls(bool enabled)
 {
+#ifdef PEERSTER_MMSG
+	batchedSyscalls = enabled;
+#else
+	Q_UNUSED(enabled);
+#endif
+}
 
-	// Create instance of ChatDialog and show it
-	chat = new ChatDialog();
-	chat->show();
 
-	// Create instance of TableDialog and hide it
-	tableDialog = new TableDialog();
-	tableDialog->hide();
+// Slot for readyRead. Read every datagram that is waiting, not just the one that triggered
+// readyRead, decode it and pass each message in it on
+void DatagramIo::readPending()
+{
+	// Vars to hold port & address of sender's host
+	quint16 senderPort;
+	QHostAddress senderAddress;
+
+	if (batchedSyscalls && socket->hasPendingDatagrams()) {
+		// Take the first datagram through Qt: readDatagram is what re-enables Qt's read
+		// notifier for the socket. Something is queued, so it can't fail and set an error
+		QByteArray first;
+		first.resize(socket->pendingDatagramSize());
+		socket->readDatagram(first.data(), first.size(), &senderAddress, &senderPort);
+		deliver(first, senderAddress.toIPv4Address(), senderPort);
+
+		// Then drain the rest a batch per call
+		while (readBatch() == ioBatchSize) {}
+		if (batchedSyscalls) return;
+	}
 
-	// Create instance of NetSocket and bind it to UDP port
-	socket = new NetSocket();
-	if (!socket->bind())
-		exit(1);
+	while (socket->hasPendingDatagrams()) {
+		// Initialize byte array to store incoming msg & resize to required length of msg
+		QByteArray serializedMsg;
+		serializedMsg.resize(socket->pendingDatagramSize());
 
-	// File Dialog Window
-	fileDialog = new QFileDialog();
-	fileDialog->setFileMode(QFileDialog::ExistingFiles);
+		// Read in msg to serializedMsg
+		socket->readDatagram(serializedMsg.data(), serializedMsg.size(), &senderAddress, &senderPort);
+		deliver(serializedMsg, senderAddress.toIPv4Address(), senderPort);
+	}
+}
 
-	// Add local peers
-	int portMin = socket->getMyPortMin();
-	int portMax = socket->getMyPortMax();
-	int myPort = socket->getMyPortVal();
-	for(int i=portMin; i<=portMax; i++) {
-		if(i != myPort) {
-			Peer* newPeer = new Peer(QHostInfo::localHostName(), QHostAddress::LocalHost, i);
-			newPeer->setHostName(QHostInfo::localHostName());
-			newPeer->setAddress(QHostAddress::LocalHost);
-			newPeer->setPort(i);
-			peerLst.push_back(*newPeer);
 
-			QHostAddress address = QHostAddress::LocalHost;
-			QString peerKey = address.toString() + ":" + QString::number(i);
-			peerCheck.insert(peerKey);
-		}
+// Read up to ioBatchSize datagrams with one recvmmsg call and deliver them. Returns how many
+// were read. Turns batching off if the kernel does not have the call
+int DatagramIo::readBatch()
+{
+#ifdef PEERSTER_MMSG
+	struct mmsghdr headers[ioBatchSize];
+	struct iovec vectors[ioBatchSize];
+	struct sockaddr_in senders[ioBatchSize];
+
+	// One buffer, cut into a slot per datagram. Allocated on first use
+	if (readBuffer.size() < ioBatchSize * maxDatagramBytes) {
+		readBuffer.resize(ioBatchSize * maxDatagramBytes);
+	}
+	memset(headers, 0, sizeof(headers));
+	for (int i = 0; i < ioBatchSize; i++) {
+		vectors[i].iov_base = readBuffer.data() + i * maxDatagramBytes;
+		vectors[i].iov_len = maxDatagramBytes;
+		headers[i].msg_hdr.msg_iov = &vectors[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+		headers[i].msg_hdr.msg_name = &senders[i];
+		headers[i].msg_hdr.msg_namelen = sizeof(senders[i]);
 	}
 
-	//Create a chord fingerTable - id maps to size 3 list (start, end, successor)
-	fingerTable = new QHash<QByteArray, QList<QByteArray>>();
+	int count = recvmmsg(socket->socketDescriptor(), headers, ioBatchSize, MSG_DONTWAIT, 0);
+	if (count < 0) {
+		if (errno == ENOSYS) batchedSyscalls = false;
+		return 0;
+	}
 
-	//Create a chord fileTable - id maps to all the blocks of a file
-	fileTable = new QHash<QByteArray, QList<QByteArray>>();
+	// The slots are reused by the next call, so the datagrams are only borrowed while they
+	// are decoded
+	for (int i = 0; i < count; i++) {
+		if (headers[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+		deliver(QByteArray::fromRawData((const char *)vectors[i].iov_base, headers[i].msg_len),
+			ntohl(senders[i].sin_addr.s_addr), ntohs(senders[i].sin_port));
+	}
+	return count;
+#else
+	return 0;
+#endif
+}
 
-	// Create a unique ID for this instance of MessageSender
-	qint64 seedVal = QDateTime::currentMSecsSinceEpoch();
-	qsrand(seedVal);
-	QString idVal = QString::number(qrand());
-	QString hostName = QHostInfo::localHostName();
-	originID = hostName + idVal;
-	QCA::Initializer qcainit;
 
-	QByteArray nodeHash = QCA::Hash("sha1").hash(originID.toLatin1()).toByteArray();
-	QDataStream in(nodeHash.right(2));
-	in.setByteOrder(QDataStream::BigEndian);
-	quint16 result;
-	in >> result;
-	nodeID = result % 256;
-	updateNum = (nodeID + 1) % 256;
-	entryNum = 1;
-	chat->setWindowTitle("Node " + QString::number(nodeID));
+// Decode one datagram and pass each message in it on
+void DatagramIo::deliver(QByteArray datagram, quint32 address, quint16 port)
+{
+	datagramsRead++;
 
+	// Deserialize msg and store in receivedMap
+	QVariantMap receivedMap;
+	QDataStream stream(&datagram, QIODevice::ReadOnly);
+	stream >> receivedMap;
 
+	// Several small messages the sender's DatagramBatcher packed into one datagram
+	if (receivedMap.contains("Batch")) {
+		int datagramBytes = datagram.size();
+		for (auto message: receivedMap["Batch"].toList()) {
+			QByteArray innerMsg = message.toByteArray();
+			QVariantMap innerMap;
+			QDataStream innerStream(&innerMsg, QIODevice::ReadOnly);
+			innerStream >> innerMap;
+			emit received(innerMap, address, port, innerMsg.size(), datagramBytes);
+			datagramBytes = 0;
+		}
+	}
+	else {
+		emit received(receivedMap, address, port, datagram.size(), datagram.size());
+	}
+}
 
-	qDebug() << "My OriginID is " << originID << endl;
-	qDebug() << "My nodeID TEST is " << QString::number(nodeID) << endl;
 
-	// Add command line peers
-	QStringList args = QCoreApplication::arguments();
-	createFingerTable();
+// Slot for a datagram the node's DatagramBatcher wants sent. With batching it is queued
+// until the writes posted during this pass of the event loop have all arrived
+void DatagramIo::write(QByteArray data, uint address, int port)
+{
+	if (!batchedSyscalls) {
+		socket->writeDatagram(data, QHostAddress(address), port);
+		return;
+	}
 
-	// Create a timer for chord stabilization
-	stabilizeTimer = new QTimer(this);
+	outData.append(data);
+	outDest.append(QPair<quint32, quint16>(address, port));
+	if (!flushPosted) {
+		flushPosted = true;
+		QMetaObject::invokeMethod(this, "flushWrites", Qt::QueuedConnection);
+	}
+}
 
-	// Timer to check the status of this node's predecessor
-	checkPredTimer = new QTimer(this);
 
-	// Timer waiting for a response from predecessor
-	predResponseTimer = new QTimer(this);
+// Send the queued datagrams, ioBatchSize per sendmmsg call
+void DatagramIo::flushWrites()
+{
+	flushPosted = false;
+	int sent = 0;
+	while (sent < outData.size()) {
+		int count = writeBatch(sent);
+		if (count <= 0) break;
+		sent += count;
+	}
 
-	// Timer to update fingerTable
-	fingerTableTimer = new QTimer(this);
-
-	// Timer to detect a failed successor
-	successorFailTimer = new QTimer(this);
-
-	// Get references to private members of ChatDialog
-	MultiLineEdit* downloadFileLine = chat->getDownloadFileLine();
-	MultiLineEdit* fileSearchLine = chat->getFileSearchLine();
-	MultiLineEdit* joinChordLine = chat->getJoinChordLine();
-	MultiLineEdit* searchFileLine = chat->getSearchFileLine();
-	QListWidget *fileSearchResultsList = chat->getFileSearchResultsList();
-	QPushButton *shareFileButton = chat->getShareFileButton();
-	QPushButton *displayTableButton = chat->getDisplayTableButton();
-	successor.first = 257;
-	predecessor.first = 257;
-	rNearest.append(successor);
-	chat->getSuccessorGui()->append(QString::number(257));
-	chat->getPredecessorGui()->append(QString::number(257));
+	// Whatever sendmmsg did not take goes through QUdpSocket, which reports the error
+	for (int i = sent; i < outData.size(); i++) {
+		socket->writeDatagram(outData[i], QHostAddress(outDest[i].first), outDest[i].second);
+	}
+	outData.clear();
+	outDest.clear();
+}
 
-	// ******** Signal->Slot connections ***********************************************
 
-	// User presses return after entering a "host:port" to join a peer's chord
-	connect(joinChordLine, SIGNAL(returnPressed()), this, SLOT(joinGuiChord()));
+// Send up to ioBatchSize queued datagrams from first on with one sendmmsg call. Returns how
+// many the kernel took
+int DatagramIo::writeBatch(int first)
+{
+#ifdef PEERSTER_MMSG
+	struct mmsghdr headers[ioBatchSize];
+	struct iovec vectors[ioBatchSize];
+	struct sockaddr_in dests[ioBatchSize];
+
+	int count = qMin(ioBatchSize, outData.size() - first);
+	memset(headers, 0, sizeof(headers));
+	memset(dests, 0, sizeof(dests));
+	for (int i = 0; i < count; i++) {
+		dests[i].sin_family = AF_INET;
+		dests[i].sin_addr.s_addr = htonl(outDest[first + i].first);
+		dests[i].sin_port = htons(outDest[first + i].second);
+		vectors[i].iov_base = (void *)outData[first + i].constData();
+		vectors[i].iov_len = outData[first + i].size();
+		headers[i].msg_hdr.msg_iov = &vectors[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+		headers[i].msg_hdr.msg_name = &dests[i];
+		headers[i].msg_hdr.msg_namelen = sizeof(dests[i]);
+	}
 
-	// User enters a file ID to search for
-	connect(searchFileLine, SIGNAL(returnPressed()), this, SLOT(searchChordFile()));
+	int sent = sendmmsg(socket->socketDescriptor(), headers, count, MSG_DONTWAIT);
+	if (sent < 0 && errno == ENOSYS) batchedSyscalls = false;
+	return sent;
+#else
+	Q_UNUSED(first);
+	return 0;
+#endif
+}
 
-	// User presses return after entering a "targetNodeID:hexDataHash" to download a file
-	connect(downloadFileLine, SIGNAL(returnPressed()), this, SLOT(downloadFile()));
 
-	// User double clicks a file to start a download
-	connect(fileSearchResultsList, SIGNAL(itemActivated(QListWidgetItem *)), this, SLOT(startFileDownload(QListWidgetItem *)));
+TimerScheduler *ProtocolTimer::scheduler = 0;
+quint64 ProtocolTimer::nextToken = 0;
 
-	// node receives a message
-	connect(socket, SIGNAL(readyRead()), this, SLOT(onReceive()));
 
-	// User clicks the share file button
-	connect(shareFileButton, SIGNAL(clicked()), this, SLOT(openFileDialog()));
+// ProtocolTimer constructor. The first timer made without a scheduler set starts the
+// TimerWheel every later one shares
+ProtocolTimer::ProtocolTimer(QObject *parent) : QObject(parent)
+{
+	singleShot = false;
+	active = false;
+	interval = 0;
+	deadline = 0;
+	token = 0;
+	if (!scheduler) {
+		scheduler = new TimerWheel();
+	}
+}
 
-	// User clicks the display table button
-	connect(displayTableButton, SIGNAL(clicked()), this, SLOT(displayTable()));
 
-	// User selects a file(s) to share
-	connect(fileDialog, SIGNAL(filesSelected(const QStringList &)), this, SLOT(getFileMetadata(const QStringList &)));
+ProtocolTimer::~ProtocolTimer()
+{
+	if (scheduler) scheduler->timerDestroyed(this);
+}
 
-	// Run chord stabilization protocol
-	connect(stabilizeTimer, SIGNAL(timeout()), this, SLOT(stabilizeNode()));
 
-	// Check the state of this node's predecessor
-	connect(checkPredTimer, SIGNAL(timeout()), this, SLOT(checkPredecessor()));
+// (Re)start the timer to go off in msec ms
+void ProtocolTimer::start(int msec)
+{
+	interval = msec;
+	active = true;
+	token = ++nextToken;
+	deadline = scheduler->now() + msec;
+	scheduler->schedule(this, deadline, token);
+}
 
-	// Node predecessor did not respond in time. Remove it.
-	connect(predResponseTimer, SIGNAL(timeout()), this, SLOT(deadPredecessor()));
 
-	// Update the successor for every interval in our table
-	connect(fingerTableTimer, SIGNAL(timeout()), this, SLOT(updateTable()));
+// Restart with the last interval
+void ProtocolTimer::start()
+{
+	start(interval);
+}
 
-	// Connect the successor failure timer to the update protocol
-	connect(successorFailTimer, SIGNAL(timeout()), this, SLOT(failureProtocol()));
 
-	fingerTableTimer->start(5000);
+void ProtocolTimer::stop()
+{
+	active = false;
+	scheduler->cancel(this);
+}
 
-	stabilizeTimer->start(10000);
 
-	checkPredTimer->start(10000);
-	// ********************************************************************************
+bool ProtocolTimer::isActive()
+{
+	return active;
 }
 
 
-QString MessageSender::getOriginID() {
-	return originID;
+void ProtocolTimer::setSingleShot(bool singleShot)
+{
+	this->singleShot = singleShot;
 }
 
-bool MessageSender::createFingerTable() {
-	qDebug() << "My Node ID is "<< QString::number(nodeID);
-	int start = 1;
-	for (int i = 0; i < 8; i++) {
-		fingerTable->insert(QByteArray::number((nodeID + start) % 256), QList<QByteArray>() << QByteArray::number((nodeID + start) % 256)
-		<< QByteArray::number((nodeID + start * 2) % 256) << QByteArray::number(257) << QByteArray::number(257) << QByteArray::number(257));
-		start *= 2;
+
+// Called by the scheduler when a timeout it was given comes due. Tokens of restarted or
+// stopped timers are stale and ignored. A periodic timer's next deadline counts from the
+// one just reached, not from when it fired, so lateness doesn't add up. If it fell a whole
+// interval behind it skips ahead rather than firing in a burst
+void ProtocolTimer::fire(quint64 token)
+{
+	if (!active || token != this->token) return;
+	if (!singleShot) {
+		qint64 now = scheduler->now();
+		deadline += interval;
+		if (deadline <= now) deadline = now + interval;
+		this->token = ++nextToken;
+		scheduler->schedule(this, deadline, this->token);
 	}
-	for (auto i = fingerTable->begin(); i != fingerTable->end(); i++) {
-		qDebug() << i.key() << i.value() << endl;
+	else {
+		active = false;
 	}
-	return true;
+	emit timeout();
 }
 
 
-// Run chord stabilization protocol
-void MessageSender::stabilizeNode() {
-	// Return if we aren't even in a chord network
-	if (successor.first == 257 && predecessor.first == 257) {
-		qDebug() << "Not in a chord network. Returning" << endl;
-		return;
-	}
-	QPair<QHostAddress, quint16> succInfo = this->successor.second;
-	qDebug() << "Stabilizing: checking if my successor is " << QString::number(this->successor.first);
-	// Request the predecessor of our successor
-	QVariantMap predRequestMap;
-	predRequestMap.insert("predecessorRequest", 1);
-	successorFailTimer->start(5000);
-	qDebug() << succInfo;
-	socket->writeDatagram(getSerialized(predRequestMap), succInfo.first, succInfo.second);
+qint64 ProtocolTimer::now()
+{
+	return scheduler ? scheduler->now() : QDateTime::currentMSecsSinceEpoch();
 }
 
 
-// Got our successor's predecessor. Continue stabilization
-void MessageSender::stabilizePredecessor(QVariantMap map) {
+// Put every timer created from now on under scheduler. Set before creating any node
+void ProtocolTimer::setScheduler(TimerScheduler *scheduler)
+{
+	ProtocolTimer::scheduler = scheduler;
+}
 
-	int tempNodeID = map["nodeID"].toInt();
-	int succID = this->successor.first;
 
-	qDebug() << "Got our successor's predecessor!" << endl;
-	qDebug() << "Checking if it our new successor is " << QString::number(tempNodeID) << endl;
+// TimerWheel constructor. The tick timer is single shot, armed for the next tick that has
+// work, and stopped while no timer is armed
+TimerWheel::TimerWheel() : QObject()
+{
+	current = 0;
+	wakeTick = 0;
+	memset(wheel, 0, sizeof(wheel));
+	clock.start();
+	tickTimer = new QTimer(this);
+	tickTimer->setSingleShot(true);
+	connect(tickTimer, SIGNAL(timeout()), this, SLOT(tick()));
+}
 
-	QPair<QHostAddress, quint16> tempNodeInfo;
-	tempNodeInfo.first = QHostAddress(map["nodeAddress"].toInt());
-	tempNodeInfo.second = map["nodePort"].toInt();
 
-	QPair<int, QPair<QHostAddress, quint16>> tempNode(tempNodeID, tempNodeInfo);
+TimerWheel::~TimerWheel()
+{
+	for (auto entry: entries) {
+		delete entry;
+	}
+}
 
-	// new node has been inserted between us and our old successor. Make this node new successor, make our old successor the secondSucessor
-	if((this->nodeID < tempNodeID && tempNodeID < succID) || (this->nodeID > tempNodeID && tempNodeID < succID && succID < nodeID)
-	|| (this->nodeID < tempNodeID && tempNodeID > succID && succID < nodeID)) {
-		chat->getSuccessorGui()->clear();
-		chat->getSuccessorGui()->append(QString::number(tempNodeID));
-		QPair<int, QPair<QHostAddress, quint16>> oldSuccessor = this->successor;
-		this->successor = tempNode;
-		rNearest.clear();
-		rNearest.append(this->successor);
-		rNearest.append(oldSuccessor);
-		successorFailTimer->stop();
+
+qint64 TimerWheel::now()
+{
+	return QDateTime::currentMSecsSinceEpoch();
+}
+
+
+// Arm timer for due, replacing any deadline it already had
+void TimerWheel::schedule(ProtocolTimer *timer, qint64 due, quint64 token)
+{
+	quint64 ticks = clock.elapsed() / timerTickMs;
+	if (entries.isEmpty()) {
+		current = ticks;
 	}
 
-	// new node is not within us and our old successor. Update our secondSuccessor to be our successor's successor
+	// Round up to whole ticks, never into the tick being processed and never past what the
+	// top level can hold
+	qint64 wait = qMax((qint64)1, (due - now() + timerTickMs - 1) / timerTickMs);
+	quint64 dueTick = qMax(ticks + wait, current + 1);
+	dueTick = qMin(dueTick, current + ((quint64)1 << (levelBits * levels)) - 1);
+
+	TimerWheelEntry *entry = entries.value(timer);
+	if (entry) {
+		unlink(entry);
+	}
 	else {
-		int nextSuccessorID = map["nextSuccessorID"].toInt();
-		QPair<QHostAddress, quint16> nextSuccessorInfo;
-		nextSuccessorInfo.first = QHostAddress(map["nextSuccessorAddress"].toInt());
-		nextSuccessorInfo.second = map["nextSuccessorPort"].toInt();
-		QPair<int, QPair<QHostAddress, quint16>> nextSuccessorNode(nextSuccessorID, nextSuccessorInfo);
-		rNearest.clear();
-		rNearest.append(this->successor);
-		rNearest.append(nextSuccessorNode);
+		entry = new TimerWheelEntry();
+		entry->timer = timer;
+		entries.insert(timer, entry);
 	}
-	qDebug() << "My successor List";
-	for (auto k: rNearest) {
-		qDebug() << k;
+	entry->token = token;
+	entry->due = dueTick;
+	insert(entry);
+
+	// Wake up sooner if this is now the first thing due. While tick runs it re-arms at the end
+	if (!tickTimer->isActive() || dueTick < wakeTick) {
+		arm();
 	}
 }
 
 
-// Check the status of this node's predecessor
-void MessageSender::checkPredecessor() {
+void TimerWheel::cancel(ProtocolTimer *timer)
+{
+	TimerWheelEntry *entry = entries.take(timer);
+	if (!entry) return;
+	unlink(entry);
+	delete entry;
+}
 
-	qDebug() << "send msg to pred to see if still alive" << endl;
 
-	// If predecessor exists check if it is alive
-	if(predecessor.first != 257) {
-		QPair<QHostAddress, quint16> predInfo = this->predecessor.second;
+void TimerWheel::timerDestroyed(ProtocolTimer *timer)
+{
+	cancel(timer);
+}
 
-		QVariantMap checkMap;
-		checkMap.insert("predecessorStatusRequest", 1);
 
-		socket->writeDatagram(getSerialized(checkMap), predInfo.first, predInfo.second);
+int TimerWheel::armed()
+{
+	return entries.size();
+}
+
 
-		// Wait 5 seconds for a response
-		predResponseTimer->start(5000);
+// Put entry in the slot for its due tick on the lowest level whose span reaches it
+void TimerWheel::insert(TimerWheelEntry *entry)
+{
+	quint64 delta = entry->due - current;
+	int level = 0;
+	while (level < levels - 1 && delta >= ((quint64)1 << (levelBits * (level + 1)))) {
+		level++;
 	}
+	int slot = (entry->due >> (levelBits * level)) & (levelSlots - 1);
+
+	entry->head = &wheel[level][slot];
+	entry->prev = 0;
+	entry->next = *entry->head;
+	if (entry->next) entry->next->prev = entry;
+	*entry->head = entry;
 }
 
 
-// No response from predecessor. Assume dead.
-void MessageSender::deadPredecessor() {
-	qDebug() << "My predecessor "<< QString::number(this->predecessor.first) << " is dead";
-	this->predecessor.first = 257;
-	chat->getPredecessorGui()->clear();
-	chat->getPredecessorGui()->append(QString::number(predecessor.first));
-	// Restart timer to check status of predecessor
-	checkPredTimer->start(10000);
+void TimerWheel::unlink(TimerWheelEntry *entry)
+{
+	if (entry->prev) entry->prev->next = entry->next;
+	else *entry->head = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
 }
 
 
-// Slot method to update fingerTable
-void MessageSender::updateTable() {
-	// May have to stop all the other timers right quick
-	qDebug() << QString::number(entryNum) << "  " << QString::number(updateNum);
-	// Don't do anything if we don't have a successor/predecessor
-	if (entryNum != 1 && (nodeID + entryNum) % 256 > updateNum) return;
-	if (successor.first == 257 && predecessor.first == 257) return;
-	entryNum *= 2;
-	QVariantMap updateFingerMap;
-	updateFingerMap.insert("updateFinger", nodeID);
-	updateFingerMap.insert("updateNode", updateNum);
-	qDebug() << "Trying to update " << updateNum;
-	QByteArray updateFingerMsg = getSerialized(updateFingerMap);
-	socket->writeDatagram(updateFingerMsg, this->successor.second.first, this->successor.second.second);
-	// for (auto k: fingerTable->keys()) {
-	// 	QVariantMap updateFingerMap;
-	// 	updateFingerMap.insert("updateFinger", nodeID);
-	// 	updateFingerMap.insert("updateNode", k.toInt());
-	// 	qDebug() << "Trying to update " << k.toInt();
-	// 	QByteArray updateFingerMsg = getSerialized(updateFingerMap);
-	// 	socket->writeDatagram(updateFingerMsg, this->successor.second.first, this->successor.second.second);
-	// }
+// The next tick with work: the first occupied slot of the lowest level, or the next time
+// the lowest level wraps if that comes first. Entries on higher levels are never due before
+// their slot comes down at such a wrap
+quint64 TimerWheel::nextWork()
+{
+	quint64 wrap = ((current >> levelBits) + 1) << levelBits;
+	for (quint64 tick = current + 1; tick < wrap; tick++) {
+		if (wheel[0][tick & (levelSlots - 1)]) return tick;
+	}
+	return wrap;
+}
+
+
+// Start the tick timer for the next tick with work, or stop it if nothing is armed
+void TimerWheel::arm()
+{
+	if (entries.isEmpty()) {
+		tickTimer->stop();
+		return;
+	}
+	wakeTick = nextWork();
+	qint64 wait = (qint64)(wakeTick * timerTickMs) - clock.elapsed();
+	tickTimer->start(qMax((qint64)0, wait));
+}
+
+
+// Move the entries of a slot on a higher level down to the levels below
+void TimerWheel::cascade(int level, int slot)
+{
+	TimerWheelEntry *entry = wheel[level][slot];
+	wheel[level][slot] = 0;
+	while (entry) {
+		TimerWheelEntry *next = entry->next;
+		insert(entry);
+		entry = next;
+	}
+}
+
+
+// Slot for the tick timer. Process every tick up to now, firing the timers due in each, then
+// sleep until the next tick with work
+void TimerWheel::tick()
+{
+	quint64 target = clock.elapsed() / timerTickMs;
+	while (current < target && !entries.isEmpty()) {
+		current++;
+
+		// Each time a level wraps, the next slot of the level above comes down
+		for (int level = 1; level < levels; level++) {
+			if (current & (((quint64)1 << (levelBits * level)) - 1)) break;
+			cascade(level, (current >> (levelBits * level)) & (levelSlots - 1));
+		}
+
+		// Everything left in this slot is due now. A fired timer that restarts lands in a
+		// later slot, and one it deletes is unlinked from here
+		TimerWheelEntry **head = &wheel[0][current & (levelSlots - 1)];
+		while (*head) {
+			TimerWheelEntry *entry = *head;
+			unlink(entry);
+			entries.remove(entry->timer);
+			ProtocolTimer *timer = entry->timer;
+			quint64 token = entry->token;
+			delete entry;
+			timer->fire(token);
+		}
+	}
+
+	if (entries.isEmpty()) {
+		current = target;
+	}
+	arm();
+}
+
+
+HeartbeatHistory::HeartbeatHistory() {
+	last = 0;
+	sum = 0;
+	squares = 0;
+}
+
+
+// Start watching node as if it had just sent a heartbeat. Its history is seeded with gaps
+// around expectedInterval, so a node that never answers is suspected in time too
+void FailureDetector::watch(QPair<quint32, quint16> node, qint64 now, qint64 expectedInterval)
+{
+	if (nodes.contains(node)) return;
+	HeartbeatHistory &history = nodes[node];
+	history.last = now;
+	addInterval(history, expectedInterval - expectedInterval / 4);
+	addInterval(history, expectedInterval + expectedInterval / 4);
+}
+
+
+// A heartbeat or reply arrived from node. Ignored unless node is watched
+void FailureDetector::heartbeat(QPair<quint32, quint16> node, qint64 now)
+{
+	auto i = nodes.find(node);
+	if (i == nodes.end()) return;
+	addInterval(i.value(), now - i.value().last);
+	i.value().last = now;
+}
+
+
+// Suspicion level of node. 0 for nodes that are not watched
+double FailureDetector::phi(QPair<quint32, quint16> node, qint64 now)
+{
+	auto i = nodes.find(node);
+	if (i == nodes.end()) return 0;
+	const HeartbeatHistory &history = i.value();
+
+	double count = history.intervals.size();
+	double average = history.sum / count;
+	double deviation = qMax(minHeartbeatDeviation, qSqrt(qMax(0.0, history.squares / count - average * average)));
+	double mean = average + acceptableHeartbeatPause;
+
+	// Logistic approximation of the normal distribution's tail beyond the elapsed time
+	double elapsed = now - history.last;
+	double y = (elapsed - mean) / deviation;
+	double e = qExp(-y * (1.5976 + 0.070566 * y * y));
+	double tail = elapsed > mean ? e / (1.0 + e) : 1.0 - 1.0 / (1.0 + e);
+	return -qLn(tail) / qLn(10.0);
+}
+
+
+void FailureDetector::forget(QPair<quint32, quint16> node)
+{
+	nodes.remove(node);
+}
+
+
+// Forget every node not in watched
+void FailureDetector::retain(QSet<QPair<quint32, quint16>> watched)
+{
+	for (auto node: nodes.keys()) {
+		if (!watched.contains(node)) nodes.remove(node);
+	}
+}
+
+
+void FailureDetector::addInterval(HeartbeatHistory &history, qint64 interval)
+{
+	history.intervals.enqueue(interval);
+	history.sum += interval;
+	history.squares += (double)interval * interval;
+	if (history.intervals.size() > heartbeatWindow) {
+		qint64 oldest = history.intervals.dequeue();
+		history.sum -= oldest;
+		history.squares -= (double)oldest * oldest;
+	}
+}
+
+
+ReliableSegment::ReliableSegment() {
+	more = false;
+	sentAt = 0;
+	transmissions = 0;
+	sackSkips = 0;
+	sacked = false;
+}
+
+
+ReliableSegment::ReliableSegment(QPair<QByteArray, bool> fragment, qint64 sentAt) {
+	data = fragment.first;
+	more = fragment.second;
+	this->sentAt = sentAt;
+	transmissions = 1;
+	sackSkips = 0;
+	sacked = false;
+}
+
+
+// New peers start in slow start with a window of 2 segments. The session must differ from
+// any a previous run of this process used with the peer. qrand alone only guarantees that
+// once the node has seeded it, so the clock is mixed in as well
+ReliablePeer::ReliablePeer() {
+	session = (quint32)qrand() ^ (quint32)(ProtocolTimer::now() * 2654435761ULL);
+	nextSeq = 0;
+	sacked = 0;
+	cwnd = 2;
+	ssthresh = 64;
+	srtt = 0;
+	rttvar = 0;
+	rto = initialRto;
+	recoverySeq = 0;
+	peerSession = 0;
+	expectedSeq = 0;
+	discarding = false;
+	lastProgress = 0;
+}
+
+
+// BlockTransport constructor
+BlockTransport::BlockTransport(Transport *transport, const quint32 *node, QObject *parent) : QObject(parent)
+{
+	this->transport = transport;
+	this->node = node;
+
+	retransmitTimer = new ProtocolTimer(this);
+	connect(retransmitTimer, SIGNAL(timeout()), this, SLOT(checkTimeouts()));
+}
+
+
+// Queue message for reliable delivery to address:port, one fragment per segment
+void BlockTransport::send(QByteArray message, QHostAddress address, quint16 port)
+{
+	QPair<quint32, quint16> dest(address.toIPv4Address(), port);
+	int offset = 0;
+	do {
+		QByteArray fragment = message.mid(offset, fragmentBytes);
+		offset += fragmentBytes;
+		peers[dest].waiting.enqueue(QPair<QByteArray, bool>(fragment, offset < message.size()));
+	} while (offset < message.size());
+	pump(dest);
+}
+
+
+// Send waiting messages while the congestion window has room
+void BlockTransport::pump(QPair<quint32, quint16> dest)
+{
+	ReliablePeer &peer = peers[dest];
+	while (!peer.waiting.isEmpty() && peer.inFlight.size() - peer.sacked < (int)peer.cwnd) {
+		quint32 seq = peer.nextSeq++;
+		peer.inFlight.insert(seq, ReliableSegment(peer.waiting.dequeue(), ProtocolTimer::now()));
+		transmit(dest, seq);
+	}
+	if (!peer.inFlight.isEmpty() && !retransmitTimer->isActive()) {
+		retransmitTimer->start(20);
+	}
+}
+
+
+// Put the in-flight segment seq on the wire
+void BlockTransport::transmit(QPair<quint32, quint16> dest, quint32 seq)
+{
+	ReliablePeer &peer = peers[dest];
+	QVariantMap segmentMap;
+	segmentMap.insert("RelSeq", seq);
+	segmentMap.insert("RelSession", peer.session);
+	segmentMap.insert("RelData", peer.inFlight[seq].data);
+	if (peer.inFlight[seq].more) {
+		segmentMap.insert("RelMore", 1);
+	}
+
+	QByteArray out;
+	QDataStream stream(&out, QIODevice::WriteOnly);
+	stream << segmentMap;
+	transport->sendDatagram(out, QHostAddress(dest.first), dest.second);
+}
+
+
+// Jacobson/Karels smoothing of the round trip time
+void BlockTransport::sampleRtt(ReliablePeer &peer, qint64 rtt)
+{
+	if (peer.srtt == 0) {
+		peer.srtt = rtt;
+		peer.rttvar = rtt / 2.0;
+	}
+	else {
+		peer.rttvar = 0.75 * peer.rttvar + 0.25 * qAbs(peer.srtt - rtt);
+		peer.srtt = 0.875 * peer.srtt + 0.125 * rtt;
+	}
+	peer.rto = qBound(minRto, (qint64)(peer.srtt + 4 * peer.rttvar), maxRto);
+}
+
+
+// Data segment from address:port. Deliver it in order and acknowledge what we have
+void BlockTransport::receiveSegment(QVariantMap map, QHostAddress address, quint16 port)
+{
+	QPair<quint32, quint16> dest(address.toIPv4Address(), port);
+	ReliablePeer &peer = peers[dest];
+	quint32 peerSession = map["RelSession"].toUInt();
+	quint32 seq = map["RelSeq"].toUInt();
+
+	// Sender restarted or gave up on us. Start counting from its first segment again
+	if (peerSession != peer.peerSession) {
+		peer.peerSession = peerSession;
+		peer.expectedSeq = 0;
+		peer.outOfOrder.clear();
+		peer.partial.clear();
+		peer.discarding = false;
+		peer.lastProgress = ProtocolTimer::now();
+	}
+
+	if (seq == peer.expectedSeq) {
+		peer.expectedSeq++;
+		deliverFragment(peer, map, address, port);
+		while (peer.outOfOrder.contains(peer.expectedSeq)) {
+			deliverFragment(peer, peer.outOfOrder.take(peer.expectedSeq), address, port);
+			peer.expectedSeq++;
+		}
+	}
+	else if (seq > peer.expectedSeq && peer.outOfOrder.size() < maxOutOfOrder) {
+		// Reassembly was idle until now, so its timeout starts here
+		if (peer.outOfOrder.isEmpty() && peer.partial.isEmpty()) {
+			peer.lastProgress = ProtocolTimer::now();
+		}
+		peer.outOfOrder.insert(seq, map);
+	}
+	if (!peer.outOfOrder.isEmpty() || !peer.partial.isEmpty()) {
+		if (!retransmitTimer->isActive()) retransmitTimer->start(20);
+	}
+
+	// Cumulative ack plus the segments we hold beyond it
+	QVariantList sack;
+	for (auto held: peer.outOfOrder.keys()) {
+		if (sack.size() == maxSackEntries) break;
+		sack.append(held);
+	}
+	QVariantMap ackMap;
+	ackMap.insert("RelAck", peer.expectedSeq);
+	ackMap.insert("RelSession", peerSession);
+	ackMap.insert("RelSack", sack);
+
+	QByteArray out;
+	QDataStream stream(&out, QIODevice::WriteOnly);
+	stream << ackMap;
+	transport->send(out, address, port);
+}
+
+
+// Append an in-order fragment to the message being reassembled. Emit the message once its
+// last fragment is in
+void BlockTransport::deliverFragment(ReliablePeer &peer, QVariantMap segmentMap, QHostAddress address, quint16 port)
+{
+	peer.lastProgress = ProtocolTimer::now();
+	bool more = segmentMap.contains("RelMore");
+	if (!peer.discarding) {
+		peer.partial.append(segmentMap["RelData"].toByteArray());
+		if (peer.partial.size() > maxMessageBytes) {
+			qDebug() << "Reassembled message too large. Dropping it";
+			peer.partial.clear();
+			peer.discarding = true;
+		}
+	}
+	if (more) return;
+
+	if (!peer.discarding) {
+		QByteArray message = peer.partial;
+		peer.partial.clear();
+		emit messageReceived(message, address, port);
+	}
+	peer.discarding = false;
+}
+
+
+// Acknowledgement from address:port. Free segments the cumulative ack covers, mark sacked
+// ones, grow the window and fast retransmit segments that later segments have overtaken
+// three times
+void BlockTransport::receiveAck(QVariantMap map, QHostAddress address, quint16 port)
+{
+	QPair<quint32, quint16> dest(address.toIPv4Address(), port);
+	if (!peers.contains(dest)) return;
+	ReliablePeer &peer = peers[dest];
+	if (map["RelSession"].toUInt() != peer.session) return;
+	qint64 now = ProtocolTimer::now();
+
+	// Segments acknowledged for the first time by this ack
+	QSet<quint32> acked;
+	quint32 cumulative = map["RelAck"].toUInt();
+	for (auto seq: peer.inFlight.keys()) {
+		if (seq >= cumulative) break;
+		if (peer.inFlight[seq].sacked) {
+			peer.inFlight.remove(seq);
+			peer.sacked--;
+		}
+		else {
+			acked.insert(seq);
+		}
+	}
+	for (auto seq: map["RelSack"].toList()) {
+		if (peer.inFlight.contains(seq.toUInt()) && !peer.inFlight[seq.toUInt()].sacked) {
+			acked.insert(seq.toUInt());
+		}
+	}
+
+	quint32 highestAcked = 0;
+	for (auto seq: acked) {
+		ReliableSegment segment = peer.inFlight[seq];
+		if (seq < cumulative) {
+			peer.inFlight.remove(seq);
+		}
+		else {
+			peer.inFlight[seq].sacked = true;
+			peer.sacked++;
+		}
+		highestAcked = qMax(highestAcked, seq);
+		// Karn: only segments sent once give a usable RTT
+		if (segment.transmissions == 1) {
+			sampleRtt(peer, now - segment.sentAt);
+		}
+		// Slow start below ssthresh, additive increase above
+		if (peer.cwnd < peer.ssthresh) {
+			peer.cwnd += 1;
+		}
+		else {
+			peer.cwnd += 1 / peer.cwnd;
+		}
+	}
+
+	// The peer dropped segments it had sacked, since its cumulative ack stops at one.
+	// Everything it sacked has to go out again
+	if (!peer.inFlight.isEmpty() && peer.inFlight.first().sacked) {
+		qDebug() << "Block transport peer dropped " << QString::number(peer.sacked) << " sacked segments. Resending them";
+		for (auto seq: peer.inFlight.keys()) {
+			ReliableSegment &segment = peer.inFlight[seq];
+			if (!segment.sacked) continue;
+			segment.sacked = false;
+			segment.transmissions++;
+			segment.sentAt = now;
+			transmit(dest, seq);
+		}
+		peer.sacked = 0;
+	}
+
+	for (auto seq: peer.inFlight.keys()) {
+		if (acked.isEmpty() || seq > highestAcked) break;
+		ReliableSegment &segment = peer.inFlight[seq];
+		if (segment.sacked) continue;
+		segment.sackSkips++;
+		if (segment.sackSkips == 3) {
+			// Halve the window once per window of data
+			if (seq >= peer.recoverySeq) {
+				peer.ssthresh = qMax(peer.cwnd / 2, 2.0);
+				peer.cwnd = peer.ssthresh;
+				peer.recoverySeq = peer.nextSeq;
+			}
+			segment.transmissions++;
+			segment.sentAt = now;
+			transmit(dest, seq);
+		}
+	}
+
+	pump(dest);
+}
+
+
+// Retransmit the oldest segment of every peer whose retransmission timeout passed, and
+// forget partial messages that stopped making progress. Sacks only tell the sender what
+// not to resend yet, it keeps sacked segments until the cumulative ack covers them, so
+// dropping held segments here costs a resend but never data
+void BlockTransport::checkTimeouts()
+{
+	qint64 now = ProtocolTimer::now();
+	bool busy = false;
+	for (auto dest: peers.keys()) {
+		ReliablePeer &peer = peers[dest];
+
+		if (!peer.outOfOrder.isEmpty() || !peer.partial.isEmpty()) {
+			if (now - peer.lastProgress > reassemblyTimeout) {
+				qDebug() << "Reassembly timed out. Dropping " << QString::number(peer.partial.size()) << " bytes";
+				peer.outOfOrder.clear();
+				// The rest of the message we were building is useless without its start
+				if (!peer.partial.isEmpty()) {
+					peer.discarding = true;
+				}
+				peer.partial.clear();
+			}
+			else {
+				busy = true;
+			}
+		}
+
+		if (peer.inFlight.isEmpty()) continue;
+		busy = true;
+
+		quint32 oldest = peer.inFlight.firstKey();
+		ReliableSegment &segment = peer.inFlight[oldest];
+		if (now - segment.sentAt < peer.rto) continue;
+
+		// Peer is gone. Tell the sender how many messages are lost and start a new session
+		// next time
+		if (segment.transmissions >= maxTransmissions) {
+			qDebug() << "Block transport peer " << QHostAddress(dest.first) << ":" << dest.second << " is not answering";
+			int lost = 0;
+			for (auto inFlight: peer.inFlight) {
+				if (!inFlight.more) lost++;
+			}
+			for (auto waiting: peer.waiting) {
+				if (!waiting.second) lost++;
+			}
+			ReliablePeer fresh;
+			fresh.peerSession = peer.peerSession;
+			fresh.expectedSeq = peer.expectedSeq;
+			fresh.outOfOrder = peer.outOfOrder;
+			fresh.partial = peer.partial;
+			fresh.discarding = peer.discarding;
+			fresh.lastProgress = peer.lastProgress;
+			peer = fresh;
+			emit sendFailed(QHostAddress(dest.first), dest.second, lost);
+			continue;
+		}
+
+		TRACE(TraceDebug, TraceRetransmitTimeout, *node, dest.second, oldest, peer.rto);
+		peer.ssthresh = qMax((peer.inFlight.size() - peer.sacked) / 2.0, 2.0);
+		peer.cwnd = 1;
+		peer.rto = qMin(peer.rto * 2, maxRto);
+		peer.recoverySeq = peer.nextSeq;
+		segment.transmissions++;
+		transmit(dest, oldest);
+
+		// Restart the clock of everything still in flight
+		for (auto seq: peer.inFlight.keys()) {
+			peer.inFlight[seq].sentAt = now;
+		}
+	}
+	if (!busy) {
+		retransmitTimer->stop();
+	}
+}
+
+
+// SeqNos start at 1, so nothing is seen yet
+RumorOrigin::RumorOrigin() {
+	contiguous = 0;
+}
+
+
+RouteEntry::RouteEntry() {
+	expires = 0;
+	direct = false;
+}
+
+
+HotKey::HotKey() {
+	rate = 0;
+	updated = 0;
+	lastPush = 0;
+}
+
+
+TransferStats::TransferStats() {
+	blocks = 0;
+	rawBytes = 0;
+	wireBytes = 0;
+	codecNanos = 0;
+}
+
+
+Histogram::Histogram() {
+	sum = 0;
+	count = 0;
+}
+
+
+Histogram::Histogram(const double *bounds, int boundCount) {
+	for (int i = 0; i < boundCount; i++) {
+		this->bounds.append(bounds[i]);
+		counts.append(0);
+	}
+	counts.append(0);
+	sum = 0;
+	count = 0;
+}
+
+
+void Histogram::observe(double value) {
+	int bucket = 0;
+	while (bucket < bounds.size() && value > bounds[bucket]) bucket++;
+	counts[bucket]++;
+	sum += value;
+	count++;
 }
 
-// Slot method to display fingerTable
-void MessageSender::displayTable() {
-	qDebug() << "Display slot";
-	QTableWidget *visualTable = tableDialog->getVisualTable();
-	visualTable->clear();
-	int start = 1;
-	QStringList *labels = new QStringList();
-	(*labels) << "Start ID" << "End ID" << "Successor ID" << "IP Address" << "Port";
-	for (int i = 0; i < 7; i++) {
-		QByteArray key = QByteArray::number((nodeID + start) % 256);
-		for (int j = 0; j < (*fingerTable)[key].size(); j++) {
-			QTableWidgetItem *t = new QTableWidgetItem(QString((*fingerTable)[key][j]));
-			qDebug() << "Item should be " << QString((*fingerTable)[key][j]);
-			visualTable->setItem(i, j, t);
+
+void Metrics::count(QString name, qint64 amount) {
+	counters[name] += amount;
+}
+
+
+void Metrics::setGauge(QString name, double value) {
+	gauges[name] = value;
+}
+
+
+// Add value to the histogram called name. bounds only matter the first time
+void Metrics::observe(QString name, double value, const double *bounds, int boundCount) {
+	if (!histograms.contains(name)) {
+		histograms.insert(name, Histogram(bounds, boundCount));
+	}
+	histograms[name].observe(value);
+}
+
+
+// Metric name without its labels
+static QString metricFamily(QString name) {
+	int brace = name.indexOf('{');
+	return brace < 0 ? name : name.left(brace);
+}
+
+
+// Series name for name with suffix added to the family and labels put before its own
+static QString metricSeries(QString name, QString suffix, QString labels) {
+	int brace = name.indexOf('{');
+	QString own = brace < 0 ? QString() : name.mid(brace + 1, name.size() - brace - 2);
+	if (!own.isEmpty()) labels = labels.isEmpty() ? own : labels + "," + own;
+	return metricFamily(name) + suffix + (labels.isEmpty() ? QString() : "{" + labels + "}");
+}
+
+
+// Render the metrics of several nodes, each series labelled with its node. Series of one
+// family are kept together under a single TYPE line as scrapers expect
+QString Metrics::render(QList<QPair<QString, Metrics *>> nodes) {
+	QMap<QString, QString> types;
+	QMap<QString, QStringList> series;
+	for (auto node: nodes) {
+		QString nodeLabel = "node=\"" + node.first + "\"";
+		Metrics *metrics = node.second;
+		for (auto i = metrics->counters.begin(); i != metrics->counters.end(); i++) {
+			types.insert(metricFamily(i.key()), "counter");
+			series[metricFamily(i.key())].append(metricSeries(i.key(), "", nodeLabel) + " " + QString::number(i.value()));
+		}
+		for (auto i = metrics->gauges.begin(); i != metrics->gauges.end(); i++) {
+			types.insert(metricFamily(i.key()), "gauge");
+			series[metricFamily(i.key())].append(metricSeries(i.key(), "", nodeLabel) + " " + QString::number(i.value(), 'g', 12));
+		}
+		for (auto i = metrics->histograms.begin(); i != metrics->histograms.end(); i++) {
+			QString family = metricFamily(i.key());
+			types.insert(family, "histogram");
+			const Histogram &histogram = i.value();
+			qint64 cumulative = 0;
+			for (int b = 0; b < histogram.counts.size(); b++) {
+				cumulative += histogram.counts[b];
+				QString bound = b < histogram.bounds.size() ? QString::number(histogram.bounds[b]) : QString("+Inf");
+				series[family].append(metricSeries(i.key(), "_bucket", nodeLabel + ",le=\"" + bound + "\"") + " " + QString::number(cumulative));
+			}
+			series[family].append(metricSeries(i.key(), "_sum", nodeLabel) + " " + QString::number(histogram.sum, 'g', 12));
+			series[family].append(metricSeries(i.key(), "_count", nodeLabel) + " " + QString::number(histogram.count));
+		}
+	}
+
+	QString out;
+	for (auto i = types.begin(); i != types.end(); i++) {
+		out += "# TYPE " + i.key() + " " + i.value() + "\n";
+		out += series[i.key()].join("\n") + "\n";
+	}
+	return out;
+}
+
+
+// Type of a message for metrics and traces: an index into messageTypeKeys, or one past
+// its end for a rumor and two past for anything else
+static int messageTypeIndex(const QVariantMap &map) {
+	for (int i = 0; i < messageTypeKeyCount; i++) {
+		if (map.contains(messageTypeKeys[i])) return i;
+	}
+	return map.contains("Origin") ? messageTypeKeyCount : messageTypeKeyCount + 1;
+}
+
+
+static QString messageTypeName(int index) {
+	if (index < messageTypeKeyCount) return messageTypeKeys[index];
+	return index == messageTypeKeyCount ? "rumor" : "other";
+}
+
+
+// Index of the message type identified by key, for messages counted after serializing
+static int messageTypeIndex(const char *key) {
+	for (int i = 0; i < messageTypeKeyCount; i++) {
+		if (qstrcmp(messageTypeKeys[i], key) == 0) return i;
+	}
+	return messageTypeKeyCount + 1;
+}
+
+
+int Tracer::level = -1;
+int Tracer::sampleEvery = 1;
+quint32 Tracer::sampleCount = 0;
+QString Tracer::file;
+QAtomicInt Tracer::head;
+TraceEvent Tracer::events[TRACE_BUFFER_EVENTS];
+
+// Read the trace options. Tracing stays off unless -trace-level is given
+void Tracer::configure(QStringList args) {
+	for (int i = 1; i < args.size() - 1; i++) {
+		if (args[i] == "-trace-level") level = qBound(-1, args[i + 1].toInt(), TRACE_MAX_LEVEL);
+		if (args[i] == "-trace-sample") sampleEvery = qMax(1, args[i + 1].toInt());
+		if (args[i] == "-trace-file") file = args[i + 1];
+	}
+}
+
+
+// Store one event over the oldest one. The sample counter is not atomic; an occasional
+// miscount only changes which debug events are kept
+void Tracer::record(int level, int id, quint32 node, qint64 a, qint64 b, qint64 c) {
+	if (level == TraceDebug && sampleEvery > 1 && sampleCount++ % sampleEvery) return;
+	quint32 seq = (quint32)head.fetchAndAddRelaxed(1);
+	TraceEvent &event = events[seq & (TRACE_BUFFER_EVENTS - 1)];
+	event.time = ProtocolTimer::now();
+	event.seq = seq;
+	event.node = node;
+	event.id = id;
+	event.level = level;
+	event.args[0] = a;
+	event.args[1] = b;
+	event.args[2] = c;
+}
+
+
+// The buffered events, oldest first, behind the event and message type names so the dump
+// can be read without this build. An event being written meanwhile may come out torn;
+// its seq will not match its position
+QByteArray Tracer::dump() {
+	QStringList names;
+	QStringList argNames;
+	QStringList types;
+	for (int i = 0; i < TraceEventCount; i++) {
+		names << traceEventNames[i];
+		argNames << traceEventArgs[i];
+	}
+	for (int i = 0; i < messageTypeCount; i++) {
+		types << messageTypeName(i);
+	}
+
+	quint32 end = (quint32)(int)head;
+	quint32 count = qMin(end, (quint32)TRACE_BUFFER_EVENTS);
+	QByteArray out;
+	QDataStream stream(&out, QIODevice::WriteOnly);
+	stream << traceMagic << traceVersion << names << argNames << types << count;
+	for (quint32 seq = end - count; seq != end; seq++) {
+		const TraceEvent &event = events[seq & (TRACE_BUFFER_EVENTS - 1)];
+		stream << event.time << event.seq << event.node << event.id << event.level
+			<< event.args[0] << event.args[1] << event.args[2];
+	}
+	return out;
+}
+
+
+// Write the dump to the -trace-file, if one was given
+void Tracer::dumpToFile() {
+	if (file.isEmpty()) return;
+	QFile out(file);
+	if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qDebug() << "Could not write trace to " << file;
+		return;
+	}
+	out.write(dump());
+	qDebug() << "Wrote trace to " << file;
+}
+
+
+Peer::Peer() {
+
+}
+
+Peer::Peer(QHostAddress ipAddress, quint16 port)
+{
+	this->ipAddress = ipAddress;
+	this->port = port;
+}
+
+
+// Functions for peer
+Peer::Peer(QString hostName, QHostAddress ipAddress, quint16 port)
+{
+	this->hostName = hostName;
+	this->ipAddress = ipAddress;
+	this->port = port;
+}
+
+
+QString Peer::getHostName() {
+	return hostName;
+}
+
+
+void Peer::setHostName(QString name) {
+	hostName = name;
+}
+
+
+QHostAddress Peer::getAddress() {
+	return ipAddress;
+}
+
+
+void Peer::setAddress(QHostAddress address) {
+	ipAddress = address;
+}
+
+
+quint16 Peer::getPort() {
+	return port;
+}
+
+
+void Peer::setPort(quint16 portNum) {
+	port = portNum;
+}
+
+
+// Constructor for MessageSender class. With a host this is one of the host's virtual
+// nodes: an extra ring position with its own tables but the host's block store and no window.
+// With an external transport it is a windowless node that sends through that transport
+// instead of a UDP socket, e.g. inside the simulator
+MessageSender::MessageSender(MessageSender *host, Transport *externalTransport) : QObject(),
+	rumorBodies(rumorBodyCacheSize),
+	blockCache(blockCacheBytes), blockRequestCounts(blockRequestHistory),
+	host(host), store(host ? host->store : new BlockStore()), fileHash(store->fileHash),
+	fileMetadata(store->fileMetadata), keywordIndex(store->keywordIndex),
+	lookupTraces(maxTracedLookups)
+{
+
+	// Only the host node of a Peerster process has a window
+	chat = 0;
+	tableDialog = 0;
+	fileDialog = 0;
+	if (!host && !externalTransport) {
+		// Create instance of ChatDialog and show it
+		chat = new ChatDialog();
+		chat->show();
+
+		// Create instance of TableDialog and hide it
+		tableDialog = new TableDialog();
+		tableDialog->hide();
+
+		// File Dialog Window
+		fileDialog = new QFileDialog();
+		fileDialog->setFileMode(QFileDialog::ExistingFiles);
+	}
+
+	// The host starts the I/O thread and the worker pool its virtual nodes share. A node
+	// with an external transport keeps everything on the calling thread, so simulated
+	// time stays deterministic
+	workers = host ? host->workers : 0;
+	ioThread = host ? host->ioThread : 0;
+	batchedSyscalls = host ? host->batchedSyscalls : true;
+	if (!host && !externalTransport) {
+		int threads = qMax(1, QThread::idealThreadCount());
+		QStringList threadArgs = QCoreApplication::arguments();
+		for (int i = 1; i < threadArgs.size() - 1; i++) {
+			// Worker threads for block serving and hashing. 0 runs everything on the main thread
+			if (threadArgs[i] == "-threads") {
+				threads = qMax(0, threadArgs[i + 1].toInt());
+			}
+			// 0 reads and writes the socket one datagram per call instead of recvmmsg/sendmmsg
+			if (threadArgs[i] == "-mmsg") {
+				batchedSyscalls = threadArgs[i + 1].toInt() != 0;
+			}
+		}
+		if (threads > 0) {
+			ioThread = new QThread(this);
+			ioThread->start();
+			workers = new QThreadPool(this);
+			workers->setMaxThreadCount(threads);
+		}
+	}
+
+	// Create instance of NetSocket and bind it to UDP port
+	socket = 0;
+	io = 0;
+	if (externalTransport) {
+		transport = externalTransport;
+	}
+	else {
+		socket = new NetSocket();
+		if (!(host ? socket->bindAny() : socket->bind()))
+			exit(1);
+
+		// Coalesces small outgoing messages per destination
+		DatagramBatcher *batcher = new DatagramBatcher(socket, this);
+		transport = batcher;
+
+		// Reads, decodes and writes our datagrams, on the I/O thread if there is one
+		io = new DatagramIo(socket);
+		io->setBatchedSyscalls(batchedSyscalls);
+		batcher->setIo(io);
+		if (ioThread) {
+			socket->moveToThread(ioThread);
+			io->moveToThread(ioThread);
+		}
+	}
+
+	// Reliable delivery for block requests and replies
+	blockTransport = new BlockTransport(transport, &nodeID, this);
+
+	// Add local peers
+	int portMin = socket ? socket->getMyPortMin() : 0;
+	int portMax = socket ? socket->getMyPortMax() : -1;
+	int myPort = socket ? socket->getMyPortVal() : 0;
+	for(int i=portMin; i<=portMax; i++) {
+		if(i != myPort) {
+			Peer* newPeer = new Peer(QHostInfo::localHostName(), QHostAddress::LocalHost, i);
+			newPeer->setHostName(QHostInfo::localHostName());
+			newPeer->setAddress(QHostAddress::LocalHost);
+			newPeer->setPort(i);
+			peerLst.push_back(*newPeer);
+
+			QHostAddress address = QHostAddress::LocalHost;
+			QString peerKey = address.toString() + ":" + QString::number(i);
+			peerCheck.insert(peerKey);
+		}
+	}
+
+	//Create a chord fingerTable - id maps to size 3 list (start, end, successor)
+	fingerTable = new QHash<QByteArray, QList<QByteArray>>();
+
+	//Create a chord fileTable - id maps to all the blocks of a file
+	fileTable = new QHash<QByteArray, QList<QByteArray>>();
+
+	// Create a unique ID for this instance of MessageSender. Virtual nodes are created in
+	// the same millisecond as their host, so only the host seeds qrand. A simulator seeds
+	// it once for all its nodes
+	qint64 seedVal = QDateTime::currentMSecsSinceEpoch();
+	if (!host && !externalTransport) qsrand(seedVal);
+
+	// Seed the gossip RNG once. Mixing in the pid and port keeps instances started in the
+	// same millisecond apart
+	quint64 rngSalt = socket ? socket->getMyPortVal() : qrand();
+	rngState = ((quint64)seedVal << 16) ^ (quint64)getpid() ^ (rngSalt << 40) ^ 0x9e3779b97f4a7c15ULL;
+	QString idVal = QString::number(qrand());
+	QString hostName = QHostInfo::localHostName();
+	originID = hostName + idVal;
+	QCA::Initializer qcainit;
+
+	QByteArray nodeHash = QCA::Hash("sha1").hash(originID.toLatin1()).toByteArray();
+	QDataStream in(nodeHash.right(4));
+	in.setByteOrder(QDataStream::BigEndian);
+	quint32 result;
+	in >> result;
+	nodeID = result % RING_SIZE;
+	updateNum = (nodeID + 1) % RING_SIZE;
+	entryNum = 1;
+	bulkLookupCount = 0;
+
+
+
+	qDebug() << "My OriginID is " << originID << endl;
+	qDebug() << "My nodeID TEST is " << QString::number(nodeID) << endl;
+
+	// Add command line peers
+	gossipFanout = defaultGossipFanout;
+	joinSamples = 0;
+	phiThreshold = defaultPhiThreshold;
+	joinPort = 0;
+	requestRate = 0;
+	requestRateUpdated = ProtocolTimer::now();
+	downloadTransfer = 0;
+	messagesSent.fill(0, messageTypeCount);
+	messageBytesSent.fill(0, messageTypeCount);
+	messagesReceived.fill(0, messageTypeCount);
+	messageBytesReceived.fill(0, messageTypeCount);
+	stabilizeStarted = 0;
+	statsServer = 0;
+	traceLookups = false;
+	quint16 statsPort = 0;
+	QStringList args = QCoreApplication::arguments();
+	for (int i = 1; i < args.size() - 1; i++) {
+		// Keep this node's ring state in a snapshot file across restarts
+		if (args[i] == "-state" && chat) {
+			stateFile = args[i + 1];
+		}
+		// Number of neighbors each rumor and status round goes to
+		if (args[i] == "-fanout") {
+			gossipFanout = qMax(1, args[i + 1].toInt());
+		}
+		// Have the nodes on our lookups' paths report themselves
+		if (args[i] == "-lookup-trace") {
+			traceLookups = args[i + 1].toInt() != 0;
+		}
+		// Sample this many ring positions when joining and split the busiest
+		if (args[i] == "-join-samples") {
+			joinSamples = qMax(0, args[i + 1].toInt());
+		}
+		// Suspicion level at which the failure detector gives up on a neighbor
+		if (args[i] == "-phi-threshold") {
+			phiThreshold = qMax(1.0, args[i + 1].toDouble());
+		}
+		// Serve metrics for scraping on this localhost port
+		if (args[i] == "-stats-port" && chat) {
+			statsPort = args[i + 1].toUInt();
+		}
+	}
+	createFingerTable();
+
+	// Create a timer for chord stabilization
+	stabilizeTimer = new ProtocolTimer(this);
+
+	// Timer to check the status of this node's predecessor
+	checkPredTimer = new ProtocolTimer(this);
+
+	// Timer to update fingerTable
+	fingerTableTimer = new ProtocolTimer(this);
+
+	// Timer for neighbor heartbeats and failure detection
+	livenessTimer = new ProtocolTimer(this);
+
+	// Timer for push-pull anti-entropy rounds
+	gossipTimer = new ProtocolTimer(this);
+
+	// Timer to drop routes nobody refreshed
+	routeTimer = new ProtocolTimer(this);
+
+	// Timer ending the wait for load reports during a load-aware join
+	joinProbeTimer = new ProtocolTimer(this);
+	joinProbeTimer->setSingleShot(true);
+
+	// Timer to periodically write the node snapshot
+	saveStateTimer = new ProtocolTimer(this);
+
+	// Timer waiting for neighbors of a restored snapshot to answer
+	stateCheckTimer = new ProtocolTimer(this);
+	stateCheckTimer->setSingleShot(true);
+
+	if (statsPort) {
+		statsServer = new StatsServer(this, statsPort);
+	}
+
+	successor.first = RING_NONE;
+	predecessor.first = RING_NONE;
+	rNearest.append(successor);
+	showRing();
+
+	// Warm restart: reuse our saved ID, tables and stored files, then ping the saved neighbors
+	if (loadState()) {
+		verifyRestoredState();
+	}
+
+	// ******** Signal->Slot connections ***********************************************
+
+	if (chat) {
+		// Get references to private members of ChatDialog
+		MultiLineEdit* downloadFileLine = chat->getDownloadFileLine();
+		MultiLineEdit* fileSearchLine = chat->getFileSearchLine();
+		MultiLineEdit* joinChordLine = chat->getJoinChordLine();
+		MultiLineEdit* searchFileLine = chat->getSearchFileLine();
+		QListWidget *fileSearchResultsList = chat->getFileSearchResultsList();
+		QPushButton *shareFileButton = chat->getShareFileButton();
+		QPushButton *displayTableButton = chat->getDisplayTableButton();
+
+		// User presses return after entering a "host:port" to join a peer's chord
+		connect(joinChordLine, SIGNAL(returnPressed()), this, SLOT(joinGuiChord()));
+
+		// User enters a file ID to search for
+		connect(searchFileLine, SIGNAL(returnPressed()), this, SLOT(searchChordFile()));
+
+		// User enters keywords to search the chord for files
+		connect(fileSearchLine, SIGNAL(returnPressed()), this, SLOT(searchKeywords()));
+
+		// User presses return after entering a "targetNodeID:hexDataHash" to download a file
+		connect(downloadFileLine, SIGNAL(returnPressed()), this, SLOT(downloadFile()));
+
+		// User double clicks a file to start a download
+		connect(fileSearchResultsList, SIGNAL(itemActivated(QListWidgetItem *)), this, SLOT(startFileDownload(QListWidgetItem *)));
+
+		// User clicks the share file button
+		connect(shareFileButton, SIGNAL(clicked()), this, SLOT(openFileDialog()));
+
+		// User clicks the display table button
+		connect(displayTableButton, SIGNAL(clicked()), this, SLOT(displayTable()));
+
+		// User selects a file(s) to share
+		connect(fileDialog, SIGNAL(filesSelected(const QStringList &)), this, SLOT(getFileMetadata(const QStringList &)));
+	}
+
+	// node receives a message. DatagramIo decodes it, possibly on the I/O thread
+	if (io) {
+		connect(socket, SIGNAL(readyRead()), io, SLOT(readPending()));
+		connect(io, SIGNAL(received(QVariantMap, uint, int, int, int)),
+			this, SLOT(onDecodedMessage(QVariantMap, uint, int, int, int)));
+	}
+
+	// node receives a block message through the reliable transport
+	connect(blockTransport, SIGNAL(messageReceived(QByteArray, QHostAddress, quint16)),
+		this, SLOT(onReliableMessage(QByteArray, QHostAddress, quint16)));
+	connect(blockTransport, SIGNAL(sendFailed(QHostAddress, quint16, int)),
+		this, SLOT(blockSendFailed(QHostAddress, quint16, int)));
+
+	// Run chord stabilization protocol
+	connect(stabilizeTimer, SIGNAL(timeout()), this, SLOT(stabilizeNode()));
+
+	// Check the state of this node's predecessor
+	connect(checkPredTimer, SIGNAL(timeout()), this, SLOT(checkPredecessor()));
+
+	// Update the successor for every interval in our table
+	connect(fingerTableTimer, SIGNAL(timeout()), this, SLOT(updateTable()));
+
+	// Drop suspected neighbors, the predecessor and successor included, and ping the rest
+	connect(livenessTimer, SIGNAL(timeout()), this, SLOT(checkLiveness()));
+
+	// Exchange status vectors with random neighbors
+	connect(gossipTimer, SIGNAL(timeout()), this, SLOT(antiEntropy()));
+	connect(routeTimer, SIGNAL(timeout()), this, SLOT(expireRoutes()));
+
+	// Pick our ID from the load reports that arrived in time
+	connect(joinProbeTimer, SIGNAL(timeout()), this, SLOT(finishBalancedJoin()));
+
+	// Write a snapshot of this node periodically and on shutdown
+	connect(saveStateTimer, SIGNAL(timeout()), this, SLOT(saveState()));
+	connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), this, SLOT(saveState()));
+
+	// Saved neighbors had their chance to answer. Drop the ones that didn't
+	connect(stateCheckTimer, SIGNAL(timeout()), this, SLOT(finishStateCheck()));
+
+	fingerTableTimer->start(5000);
+
+	stabilizeTimer->start(10000);
+
+	checkPredTimer->start(10000);
+
+	livenessTimer->start(heartbeatInterval);
+
+	gossipTimer->start(gossipInterval);
+	routeTimer->start(routeLifetime / 2);
+
+	if (!stateFile.isEmpty()) {
+		saveStateTimer->start(30000);
+	}
+	// ********************************************************************************
+
+	// A virtual node takes its place in the host's ring right away, at the ID of a saved
+	// one if the host restored any
+	if (host) {
+		if (!host->savedVirtualNodes.isEmpty()) {
+			restoreVirtualNode(host->savedVirtualNodes.takeFirst());
+		}
+		joinChord("127.0.0.1:" + QString::number(host->socket->getMyPortVal()));
+	}
+	else if (chat) {
+		createVirtualNodes();
+	}
+}
+
+
+// Tables and windows that are not QObject children of the node
+MessageSender::~MessageSender()
+{
+	// Let workers finish before the tables their results go to are gone
+	if (!host && workers) {
+		workers->waitForDone();
+	}
+	if (!host && ioThread) {
+		ioThread->quit();
+		ioThread->wait();
+	}
+	delete fingerTable;
+	delete fileTable;
+	if (!host) delete store;
+	delete chat;
+	delete tableDialog;
+	delete fileDialog;
+}
+
+
+// Refresh the size gauges, which are cheaper to read at scrape time than to keep current
+void MessageSender::updateGauges() {
+	metrics.setGauge("peerster_store_files", fileMetadata.size());
+	metrics.setGauge("peerster_store_blocks", fileHash.size());
+	metrics.setGauge("peerster_store_keywords", keywordIndex.size());
+	metrics.setGauge("peerster_ring_files", fileTable->size());
+	metrics.setGauge("peerster_keyword_postings", keywordPostings.size());
+	metrics.setGauge("peerster_routes", routeTable.size());
+	metrics.setGauge("peerster_block_cache_bytes", blockCache.totalCost());
+	metrics.setGauge("peerster_lookup_cache_entries", lookupCache.size());
+	metrics.setGauge("peerster_successor_list_length", rNearest.size());
+	metrics.setGauge("peerster_request_rate", requestRate);
+	metrics.counters["peerster_datagrams_sent_total"] = transport->datagramsSent;
+	metrics.counters["peerster_datagram_bytes_sent_total"] = transport->datagramBytesSent;
+
+	// Per type message counts are kept in plain arrays on the hot path. Only types seen
+	// so far get a series
+	for (int i = 0; i < messageTypeCount; i++) {
+		QString type = "{type=\"" + messageTypeName(i) + "\"}";
+		if (messagesSent[i]) {
+			metrics.counters["peerster_messages_sent_total" + type] = messagesSent[i];
+			metrics.counters["peerster_message_bytes_sent_total" + type] = messageBytesSent[i];
+		}
+		if (messagesReceived[i]) {
+			metrics.counters["peerster_messages_received_total" + type] = messagesReceived[i];
+			metrics.counters["peerster_message_bytes_received_total" + type] = messageBytesReceived[i];
+		}
+	}
+}
+
+
+// Metrics of this node and its virtual nodes, labelled by node ID
+QString MessageSender::renderMetrics() {
+	QList<QPair<QString, Metrics *>> nodes;
+	updateGauges();
+	nodes.append(qMakePair(QString::number(nodeID), &metrics));
+	for (auto node: virtualNodes) {
+		node->updateGauges();
+		nodes.append(qMakePair(QString::number(node->nodeID), &node->metrics));
+	}
+	return Metrics::render(nodes);
+}
+
+
+// StatsServer constructor. Only listens on localhost; the metrics are not for the network
+StatsServer::StatsServer(MessageSender *node, quint16 port) : QObject(node)
+{
+	this->node = node;
+	server = new QTcpServer(this);
+	connect(server, SIGNAL(newConnection()), this, SLOT(acceptClient()));
+	if (!server->listen(QHostAddress::LocalHost, port)) {
+		qDebug() << "Could not serve metrics on port " << port << ": " << server->errorString();
+	}
+	else {
+		qDebug() << "Serving metrics on http://127.0.0.1:" << port << "/metrics";
+	}
+}
+
+
+// Slot for a new scrape connection. The answer goes out once the request has arrived
+void StatsServer::acceptClient()
+{
+	while (server->hasPendingConnections()) {
+		QTcpSocket *client = server->nextPendingConnection();
+		connect(client, SIGNAL(readyRead()), this, SLOT(respond()));
+		connect(client, SIGNAL(disconnected()), client, SLOT(deleteLater()));
+	}
+}
+
+
+// Slot for request bytes from a scraper. /trace answers with a trace dump for tracedump,
+// any other path with the metrics
+void StatsServer::respond()
+{
+	QTcpSocket *client = qobject_cast<QTcpSocket *>(sender());
+	if (!client) return;
+	QByteArray request = client->property("request").toByteArray() + client->readAll();
+
+	// Wait for the end of the headers, unless the client is sending junk
+	if (!request.contains("\r\n\r\n") && !request.contains("\n\n") && request.size() < 8192) {
+		client->setProperty("request", request);
+		return;
+	}
+
+	QByteArray body;
+	QByteArray contentType;
+	if (request.startsWith("GET /trace")) {
+		body = Tracer::dump();
+		contentType = "application/octet-stream";
+	}
+	else {
+		body = node->renderMetrics().toUtf8();
+		contentType = "text/plain; version=0.0.4";
+	}
+	QByteArray response = "HTTP/1.0 200 OK\r\nContent-Type: " + contentType + "\r\nContent-Length: "
+		+ QByteArray::number(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+	client->write(response);
+	client->disconnectFromHost();
+}
+
+
+// Show our ring position and neighbors in the window, if we have one
+void MessageSender::showRing() {
+	if (!chat) return;
+	if (virtualNodes.isEmpty()) {
+		chat->setWindowTitle("Node " + QString::number(nodeID));
+	}
+	else {
+		chat->setWindowTitle("Node " + QString::number(nodeID) + " (" + QString::number(virtualNodes.size() + 1) + " ring positions)");
+	}
+	chat->getSuccessorGui()->clear();
+	chat->getSuccessorGui()->append(QString::number(successor.first));
+	chat->getPredecessorGui()->clear();
+	chat->getPredecessorGui()->append(QString::number(predecessor.first));
+}
+
+
+// Host extra ring positions in this process. -vnodes is the number of positions per unit of
+// capacity and -capacity this machine's relative capacity, so a machine twice as capable
+// runs with -capacity 2 and gets about twice the keys
+void MessageSender::createVirtualNodes() {
+	int perCapacity = 1;
+	double capacity = 1.0;
+	QStringList args = QCoreApplication::arguments();
+	for (int i = 1; i < args.size() - 1; i++) {
+		if (args[i] == "-vnodes") {
+			perCapacity = qMax(1, args[i + 1].toInt());
+		}
+		if (args[i] == "-capacity") {
+			capacity = qMax(0.0, args[i + 1].toDouble());
+		}
+	}
+	int count = qBound(1, qRound(perCapacity * capacity), maxVirtualNodes);
+
+	// This node is the first position
+	for (int i = 1; i < count; i++) {
+		MessageSender *vnode = new MessageSender(this);
+		virtualNodes.append(vnode);
+		qDebug() << "Virtual node " << QString::number(i) << " has nodeID " << QString::number(vnode->nodeID);
+	}
+
+	// Fewer positions than before the restart. We hand out the keys of the ones gone,
+	// after the check of our restored neighbors if one is running
+	while (!savedVirtualNodes.isEmpty()) {
+		addRestoredKeys(savedVirtualNodes.takeFirst());
+	}
+	if (!stateCheckTimer->isActive()) {
+		publishRestoredKeys();
+	}
+	showRing();
+}
+
+
+QString MessageSender::getOriginID() {
+	return originID;
+}
+
+bool MessageSender::createFingerTable() {
+	qDebug() << "My Node ID is "<< QString::number(nodeID);
+	int start = 1;
+	for (int i = 0; i < RING_BITS; i++) {
+		fingerTable->insert(QByteArray::number((nodeID + start) % RING_SIZE), QList<QByteArray>() << QByteArray::number((nodeID + start) % RING_SIZE)
+		<< QByteArray::number((nodeID + start * 2) % RING_SIZE) << QByteArray::number(RING_NONE) << QByteArray::number(RING_NONE) << QByteArray::number(RING_NONE));
+		start *= 2;
+	}
+	for (auto i = fingerTable->begin(); i != fingerTable->end(); i++) {
+		qDebug() << i.key() << i.value() << endl;
+	}
+	return true;
+}
+
+
+// Run chord stabilization protocol
+void MessageSender::stabilizeNode() {
+	// Return if we aren't even in a chord network
+	if (successor.first == RING_NONE && predecessor.first == RING_NONE) {
+		qDebug() << "Not in a chord network. Returning" << endl;
+		return;
+	}
+	QPair<QHostAddress, quint16> succInfo = this->successor.second;
+	qDebug() << "Stabilizing: checking if my successor is " << QString::number(this->successor.first);
+	// Request the predecessor of our successor
+	QVariantMap predRequestMap;
+	predRequestMap.insert("predecessorRequest", 1);
+	stabilizeStarted = ProtocolTimer::now();
+	qDebug() << succInfo;
+	transport->send(getSerialized(predRequestMap), succInfo.first, succInfo.second);
+}
+
+
+// Got our successor's predecessor. Continue stabilization
+void MessageSender::stabilizePredecessor(QVariantMap map) {
+
+	int tempNodeID = map["nodeID"].toInt();
+	int succID = this->successor.first;
+
+	qDebug() << "Got our successor's predecessor!" << endl;
+	qDebug() << "Checking if it our new successor is " << QString::number(tempNodeID) << endl;
+
+	QPair<QHostAddress, quint16> tempNodeInfo;
+	tempNodeInfo.first = QHostAddress(map["nodeAddress"].toInt());
+	tempNodeInfo.second = map["nodePort"].toInt();
+
+	QPair<int, QPair<QHostAddress, quint16>> tempNode(tempNodeID, tempNodeInfo);
+
+	// new node has been inserted between us and our old successor. Make this node new successor, make our old successor the secondSucessor
+	if((this->nodeID < tempNodeID && tempNodeID < succID) || (this->nodeID > tempNodeID && tempNodeID < succID && succID < nodeID)
+	|| (this->nodeID < tempNodeID && tempNodeID > succID && succID < nodeID)) {
+		QPair<int, QPair<QHostAddress, quint16>> oldSuccessor = this->successor;
+		this->successor = tempNode;
+		showRing();
+		rNearest.clear();
+		rNearest.append(this->successor);
+		rNearest.append(oldSuccessor);
+	}
+
+	// new node is not within us and our old successor. Update our secondSuccessor to be our successor's successor
+	else {
+		int nextSuccessorID = map["nextSuccessorID"].toInt();
+		QPair<QHostAddress, quint16> nextSuccessorInfo;
+		nextSuccessorInfo.first = QHostAddress(map["nextSuccessorAddress"].toInt());
+		nextSuccessorInfo.second = map["nextSuccessorPort"].toInt();
+		QPair<int, QPair<QHostAddress, quint16>> nextSuccessorNode(nextSuccessorID, nextSuccessorInfo);
+		rNearest.clear();
+		rNearest.append(this->successor);
+		rNearest.append(nextSuccessorNode);
+	}
+	qDebug() << "My successor List";
+	for (auto k: rNearest) {
+		qDebug() << k;
+	}
+}
+
+
+// Check the status of this node's predecessor
+void MessageSender::checkPredecessor() {
+
+	qDebug() << "send msg to pred to see if still alive" << endl;
+
+	// If predecessor exists check if it is alive
+	if(predecessor.first != RING_NONE) {
+		QPair<QHostAddress, quint16> predInfo = this->predecessor.second;
+
+		QVariantMap checkMap;
+		checkMap.insert("predecessorStatusRequest", 1);
+
+		transport->send(getSerialized(checkMap), predInfo.first, predInfo.second);
+	}
+}
+
+
+// The failure detector suspects our predecessor. Assume dead.
+void MessageSender::deadPredecessor() {
+	qDebug() << "My predecessor "<< QString::number(this->predecessor.first) << " is dead";
+	this->predecessor.first = RING_NONE;
+	showRing();
+	// Restart timer to check status of predecessor
+	checkPredTimer->start(10000);
+}
+
+
+// Slot method to update fingerTable
+void MessageSender::updateTable() {
+	// May have to stop all the other timers right quick
+	qDebug() << QString::number(entryNum) << "  " << QString::number(updateNum);
+	// Don't do anything if we don't have a successor/predecessor
+	if (entryNum != 1 && (nodeID + entryNum) % RING_SIZE > updateNum) return;
+	if (successor.first == RING_NONE && predecessor.first == RING_NONE) return;
+	entryNum *= 2;
+	QVariantMap updateFingerMap;
+	updateFingerMap.insert("updateFinger", nodeID);
+	updateFingerMap.insert("updateNode", updateNum);
+	qDebug() << "Trying to update " << updateNum;
+	QByteArray updateFingerMsg = getSerialized(updateFingerMap);
+	transport->send(updateFingerMsg, this->successor.second.first, this->successor.second.second);
+	// for (auto k: fingerTable->keys()) {
+	// 	QVariantMap updateFingerMap;
+	// 	updateFingerMap.insert("updateFinger", nodeID);
+	// 	updateFingerMap.insert("updateNode", k.toInt());
+	// 	qDebug() << "Trying to update " << k.toInt();
+	// 	QByteArray updateFingerMsg = getSerialized(updateFingerMap);
+	// 	socket->writeDatagram(updateFingerMsg, this->successor.second.first, this->successor.second.second);
+	// }
+}
+
+// Slot method to display fingerTable
+void MessageSender::displayTable() {
+	qDebug() << "Display slot";
+	QTableWidget *visualTable = tableDialog->getVisualTable();
+	visualTable->clear();
+	int start = 1;
+	QStringList *labels = new QStringList();
+	(*labels) << "Start ID" << "End ID" << "Successor ID" << "IP Address" << "Port";
+	for (int i = 0; i < RING_BITS; i++) {
+		QByteArray key = QByteArray::number((nodeID + start) % RING_SIZE);
+		for (int j = 0; j < (*fingerTable)[key].size(); j++) {
+			QTableWidgetItem *t = new QTableWidgetItem(QString((*fingerTable)[key][j]));
+			qDebug() << "Item should be " << QString((*fingerTable)[key][j]);
+			visualTable->setItem(i, j, t);
+		}
+		start *= 2;
+	}
+	tableDialog->show();
+}
+
+// The failure detector suspects our successor. Fail over to the next one in the list
+void MessageSender::failureProtocol() {
+	qDebug() << "Failure Protocol";
+	if (!rNearest.size() || rNearest[0].first == RING_NONE) return;
+	int oldSuccessor = rNearest[0].first;
+	rNearest.removeFirst();
+	if (!rNearest.size()) return;
+	successor.first = rNearest[0].first;
+	successor.second.first = rNearest[0].second.first;
+	successor.second.second = rNearest[0].second.second;
+	metrics.count("peerster_successor_failovers_total");
+	TRACE(TraceWarn, TraceSuccessorFailover, nodeID, oldSuccessor, successor.first, 0);
+	showRing();
+	//add for stabilize monitoring rNearest successors
+}
+
+
+// Write this node's ID, ring pointers, finger table, stored files and keyword postings to the
+// state file
+void MessageSender::saveState() {
+	if (stateFile.isEmpty()) return;
+
+	// Blocks are not in the snapshot, only the metadata of the files we share: its metafile
+	// is the block index, and loadState reads the blocks back from the files themselves.
+	// The snapshot is built in memory and only written when it changed since the last save
+	QByteArray snapshot;
+	QDataStream out(&snapshot, QIODevice::WriteOnly);
+	out << stateMagic << stateVersion;
+	out << originID << nodeID << successor << predecessor << rNearest;
+	out << *fingerTable << *fileTable << sharedFileMetadata();
+	out << keywordPostings;
+	out << (quint32)virtualNodes.size();
+	for (auto vnode: virtualNodes) {
+		out << vnode->originID << vnode->nodeID << *vnode->fileTable << vnode->keywordPostings;
+	}
+	if (snapshot == savedSnapshot) return;
+
+	// Write to a temporary file first so a crash never leaves a half written snapshot
+	QString tempName = stateFile + ".tmp";
+	QFile file(tempName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qDebug() << "Could not write node state to " << tempName;
+		return;
+	}
+	bool written = file.write(snapshot) == snapshot.size() && file.flush() && fsync(file.handle()) == 0;
+	file.close();
+	if (!written || file.error() != QFile::NoError) {
+		qDebug() << "Could not write node state to " << tempName;
+		QFile::remove(tempName);
+		return;
+	}
+
+	// The snapshot is on disk before rename() replaces the old one in one step, so there is
+	// a whole one at every moment. Only where it cannot replace an existing file is the old
+	// one removed first. Syncing the directory makes the rename itself durable
+	if (rename(QFile::encodeName(tempName).constData(), QFile::encodeName(stateFile).constData()) != 0) {
+		QFile::remove(stateFile);
+		QFile::rename(tempName, stateFile);
+	}
+	int dir = open(QFile::encodeName(QFileInfo(stateFile).absolutePath()).constData(), O_RDONLY);
+	if (dir >= 0) {
+		fsync(dir);
+		close(dir);
+	}
+	savedSnapshot = snapshot;
+	qDebug() << "Saved node state to " << stateFile;
+}
+
+
+// Metadata of the files we share from disk. Metafiles we only downloaded have no file to
+// reload their blocks from, so they are left out of the snapshot
+QVariantMap MessageSender::sharedFileMetadata() {
+	QVariantMap shared;
+	for (auto i = fileMetadata.begin(); i != fileMetadata.end(); i++) {
+		if (i.value().toMap().contains("path")) shared.insert(i.key(), i.value());
+	}
+	return shared;
+}
+
+
+// Read the blocks of a shared file back into fileHash, checking each against the metafile.
+// Returns false, storing nothing, if the file is gone or changed since it was shared
+bool MessageSender::reloadSharedFile(QVariantMap metaMap) {
+	QFile file(metaMap["path"].toString());
+	if (!file.open(QIODevice::ReadOnly)) return false;
+
+	QByteArray metaFile = metaMap["metaFile"].toByteArray();
+	QList<QPair<QByteArray, QByteArray>> blocks;
+	for (int offset = 0; offset < metaFile.size(); offset += 20) {
+		QByteArray block = file.read(blockSize);
+		QByteArray hashVal = QCA::Hash("sha1").hash(block).toByteArray();
+		if (hashVal != metaFile.mid(offset, 20)) return false;
+		blocks.append(qMakePair(hashVal, block));
+	}
+	if (!file.atEnd()) return false;
+
+	for (auto block: blocks) {
+		storeBlock(block.first, block.second);
+	}
+	return true;
+}
+
+
+// Load the snapshot written by saveState. Returns false if there is no usable snapshot
+bool MessageSender::loadState() {
+	if (stateFile.isEmpty()) return false;
+
+	QFile file(stateFile);
+	if (!file.open(QIODevice::ReadOnly)) {
+		qDebug() << "No saved node state at " << stateFile;
+		return false;
+	}
+	QDataStream in(&file);
+	quint32 magic, version;
+	in >> magic >> version;
+	if (magic != stateMagic || version != stateVersion) {
+		qDebug() << "Ignoring node state with unknown format " << stateFile;
+		return false;
+	}
+
+	QString savedOriginID;
+	quint32 savedNodeID;
+	QPair<int, QPair<QHostAddress, quint16>> savedSuccessor;
+	QPair<int, QPair<QHostAddress, quint16>> savedPredecessor;
+	QList<QPair<int, QPair<QHostAddress, quint16>>> savedNearest;
+	QHash<QByteArray, QList<QByteArray>> savedFingers;
+	QHash<QByteArray, QList<QByteArray>> savedFiles;
+	QVariantMap savedMetadata;
+	QHash<QString, QHash<QByteArray, QVariantMap>> savedPostings;
+	in >> savedOriginID >> savedNodeID >> savedSuccessor >> savedPredecessor >> savedNearest;
+	in >> savedFingers >> savedFiles >> savedMetadata;
+	in >> savedPostings;
+	quint32 vnodeCount;
+	QList<VirtualNodeState> savedVnodes;
+	in >> vnodeCount;
+	for (quint32 i = 0; i < vnodeCount && in.status() == QDataStream::Ok; i++) {
+		VirtualNodeState vnode;
+		in >> vnode.originID >> vnode.nodeID >> vnode.fileTable >> vnode.keywordPostings;
+		savedVnodes.append(vnode);
+	}
+	if (in.status() != QDataStream::Ok) {
+		qDebug() << "Node state is corrupt " << stateFile;
+		return false;
+	}
+
+	originID = savedOriginID;
+	nodeID = savedNodeID;
+	updateNum = (nodeID + 1) % RING_SIZE;
+	entryNum = 1;
+	successor = savedSuccessor;
+	predecessor = savedPredecessor;
+	rNearest = savedNearest;
+	*fingerTable = savedFingers;
+	*fileTable = savedFiles;
+	keywordPostings = savedPostings;
+	savedVirtualNodes = savedVnodes;
+
+	// Share again every file that is still as it was. The index holds the raw metafile hashes
+	// getFileMetadata computed, which the QString keys of fileMetadata do not round trip to.
+	// Hash each metafile again to get them back
+	for (auto i = savedMetadata.begin(); i != savedMetadata.end(); i++) {
+		QVariantMap metaMap = i.value().toMap();
+		if (!reloadSharedFile(metaMap)) {
+			qDebug() << "Shared file " << metaMap["path"].toString() << " is gone or changed. No longer sharing it";
+			continue;
+		}
+		fileMetadata.insert(i.key(), metaMap);
+		QByteArray metaHash = QCA::Hash("sha1").hash(metaMap["metaFile"].toByteArray()).toByteArray();
+		indexFile(metaHash, metaMap["fileName"].toString());
+	}
+
+	showRing();
+	makeStoredFileGui();
+
+	qDebug() << "Restored node " << QString::number(nodeID) << " from " << stateFile;
+	return true;
+}
+
+
+// Take the place of a saved virtual node. A virtual node rejoins through its host at a new
+// address, and may not get its old ID back, so its saved keys are not simply reinstated but
+// handed to their owners, ourselves included, once the join is answered
+void MessageSender::restoreVirtualNode(VirtualNodeState state) {
+	originID = state.originID;
+	nodeID = state.nodeID;
+	updateNum = (nodeID + 1) % RING_SIZE;
+	entryNum = 1;
+	fingerTable->clear();
+	createFingerTable();
+	addRestoredKeys(state);
+	qDebug() << "Virtual node restored at nodeID " << QString::number(nodeID);
+}
+
+
+// Queue the files and keyword postings of a saved virtual node for publishRestoredKeys
+void MessageSender::addRestoredKeys(VirtualNodeState state) {
+	for (auto i = state.fileTable.begin(); i != state.fileTable.end(); i++) {
+		QVariantMap fileMap;
+		fileMap.insert("fileID", i.key().toUInt());
+		fileMap.insert("fileName", QString(i.value().value(0)));
+		QVariantList fileItems = restoredFiles[QString(i.key())].toList();
+		fileItems.append(fileMap);
+		restoredFiles.insert(QString(i.key()), fileItems);
+	}
+	for (auto i = state.keywordPostings.begin(); i != state.keywordPostings.end(); i++) {
+		quint32 keywordID = hashToRing(i.key().toUtf8());
+		QVariantList items = restoredKeywords[QString::number(keywordID)].toList();
+		for (auto j = i.value().begin(); j != i.value().end(); j++) {
+			QVariantMap publishMap = j.value();
+			publishMap.insert("keywordPublish", i.key());
+			publishMap.insert("keywordID", keywordID);
+			publishMap.insert("fileID", j.key());
+			items.append(publishMap);
+		}
+		restoredKeywords.insert(QString::number(keywordID), items);
+	}
+}
+
+
+// Deliver restored keys to the nodes now responsible for them
+void MessageSender::publishRestoredKeys() {
+	bulkLookup("files", restoredFiles);
+	bulkLookup("keywords", restoredKeywords);
+	restoredFiles.clear();
+	restoredKeywords.clear();
+}
+
+
+// Ping every node in our restored successor list, predecessor and finger table
+void MessageSender::verifyRestoredState() {
+	confirmedNodes.clear();
+	QSet<int> pinged;
+
+	if (successor.first != RING_NONE) {
+		sendStatePing(successor.first, successor.second.first, successor.second.second);
+		pinged.insert(successor.first);
+	}
+	if (predecessor.first != RING_NONE && !pinged.contains(predecessor.first)) {
+		sendStatePing(predecessor.first, predecessor.second.first, predecessor.second.second);
+		pinged.insert(predecessor.first);
+	}
+	for (auto k: rNearest) {
+		if (k.first != RING_NONE && !pinged.contains(k.first)) {
+			sendStatePing(k.first, k.second.first, k.second.second);
+			pinged.insert(k.first);
+		}
+	}
+	for (auto entry: fingerTable->values()) {
+		int fingerID = entry[2].toInt();
+		if (fingerID != RING_NONE && !pinged.contains(fingerID)) {
+			sendStatePing(fingerID, QHostAddress(entry[3].toUInt()), entry[4].toUInt());
+			pinged.insert(fingerID);
+		}
+	}
+
+	// Nothing to check if we were alone in the chord
+	if (pinged.isEmpty()) return;
+	stateCheckTimer->start(3000);
+}
+
+
+void MessageSender::sendStatePing(int id, QHostAddress address, quint16 port) {
+	qDebug() << "Checking saved neighbor " << QString::number(id);
+	QVariantMap statePing;
+	statePing.insert("statePing", id);
+	transport->send(getSerialized(statePing), address, port);
+}
+
+
+// Whether node, a neighbor in the given role (0 predecessor, 1 successor, 2 later successor,
+// 3 finger), is among the addresses the failure detector gave up on this round
+bool MessageSender::suspected(QPair<int, QPair<QHostAddress, quint16>> node, int role, const QHash<QPair<quint32, quint16>, double> &suspects) {
+	if (node.first == RING_NONE || node.first == (int)nodeID) return false;
+	QPair<quint32, quint16> address(node.second.first.toIPv4Address(), node.second.second);
+	if (!suspects.contains(address)) return false;
+
+	static const char *roleNames[] = { "predecessor", "successor", "successorList", "finger" };
+	metrics.count(QString("peerster_neighbors_suspected_total{role=\"%1\"}").arg(roleNames[role]));
+	TRACE(TraceWarn, TraceNeighborSuspected, nodeID, node.first, role, qMin(suspects[address], 1000.0));
+	return true;
+}
+
+
+// Every distinct live neighbor we hold: predecessor, successor list and fingers
+QList<QPair<int, QPair<QHostAddress, quint16>>> MessageSender::livenessNeighbors() {
+	QList<QPair<int, QPair<QHostAddress, quint16>>> neighbors;
+	neighbors << predecessor << successor << rNearest;
+	for (auto entry: fingerTable->values()) {
+		neighbors << QPair<int, QPair<QHostAddress, quint16>>(entry[2].toInt(), QPair<QHostAddress, quint16>(QHostAddress(entry[3].toUInt()), entry[4].toUInt()));
+	}
+	QList<QPair<int, QPair<QHostAddress, quint16>>> distinct;
+	QSet<QPair<quint32, quint16>> seen;
+	for (auto node: neighbors) {
+		if (node.first == RING_NONE || node.first == (int)nodeID) continue;
+		QPair<quint32, quint16> address(node.second.first.toIPv4Address(), node.second.second);
+		if (seen.contains(address)) continue;
+		seen.insert(address);
+		distinct.append(node);
+	}
+	return distinct;
+}
+
+
+// Slot for livenessTimer. Drop the neighbors the failure detector suspects, then ping the
+// predecessor, successor list and fingers again. Their statePong replies are the heartbeats.
+// Suspicion is decided once per round, so an address held in several roles is dropped from
+// all of them
+void MessageSender::checkLiveness() {
+	qint64 now = ProtocolTimer::now();
+
+	QHash<QPair<quint32, quint16>, double> suspects;
+	for (auto node: livenessNeighbors()) {
+		QPair<quint32, quint16> address(node.second.first.toIPv4Address(), node.second.second);
+		double phi = detector.phi(address, now);
+		if (phi >= phiThreshold) suspects.insert(address, phi);
+	}
+
+	if (suspected(predecessor, 0, suspects)) {
+		deadPredecessor();
+	}
+
+	// Later successors first, so a failover promotes one that is still believed alive
+	for (int i = rNearest.size() - 1; i >= 1; i--) {
+		if (suspected(rNearest[i], 2, suspects)) rNearest.removeAt(i);
+	}
+	if (suspected(successor, 1, suspects)) {
+		failureProtocol();
+	}
+
+	for (auto key: fingerTable->keys()) {
+		QList<QByteArray> entry = (*fingerTable)[key];
+		QPair<int, QPair<QHostAddress, quint16>> finger(entry[2].toInt(), QPair<QHostAddress, quint16>(QHostAddress(entry[3].toUInt()), entry[4].toUInt()));
+		if (suspected(finger, 3, suspects)) {
+			entry[2] = QByteArray::number(RING_NONE);
+			entry[3] = QByteArray::number(RING_NONE);
+			entry[4] = QByteArray::number(RING_NONE);
+			fingerTable->insert(key, entry);
+		}
+	}
+	for (auto address: suspects.keys()) {
+		detector.forget(address);
+	}
+
+	// Ping every distinct neighbor once
+	QSet<QPair<quint32, quint16>> watched;
+	for (auto node: livenessNeighbors()) {
+		QPair<quint32, quint16> address(node.second.first.toIPv4Address(), node.second.second);
+		watched.insert(address);
+		detector.watch(address, now, heartbeatInterval);
+		QVariantMap statePing;
+		statePing.insert("statePing", node.first);
+		transport->send(getSerialized(statePing), node.second.first, node.second.second);
+	}
+	detector.retain(watched);
+}
+
+
+// Forget restored neighbors that did not answer or came back with a different ID
+void MessageSender::finishStateCheck() {
+	QList<QPair<int, QPair<QHostAddress, quint16>>> aliveNearest;
+	for (auto k: rNearest) {
+		if (confirmedNodes.contains(k.first)) {
+			aliveNearest.append(k);
+		}
+	}
+	QPair<int, QPair<QHostAddress, quint16>> none(RING_NONE, QPair<QHostAddress, quint16>(QHostAddress(), 0));
+	if (!confirmedNodes.contains(successor.first)) {
+		successor = aliveNearest.size() ? aliveNearest[0] : none;
+	}
+	if (!aliveNearest.size() && successor.first != RING_NONE) {
+		aliveNearest.append(successor);
+	}
+	rNearest = aliveNearest;
+
+	if (!confirmedNodes.contains(predecessor.first)) {
+		predecessor = none;
+	}
+
+	for (auto key: fingerTable->keys()) {
+		QList<QByteArray> entry = (*fingerTable)[key];
+		if (!confirmedNodes.contains(entry[2].toInt())) {
+			entry[2] = QByteArray::number(RING_NONE);
+			entry[3] = QByteArray::number(RING_NONE);
+			entry[4] = QByteArray::number(RING_NONE);
+			fingerTable->insert(key, entry);
+		}
+	}
+
+	// No saved successor is left. Join again through any saved neighbor that answered, or
+	// stand alone until another node joins us
+	bool joining = false;
+	if (successor.first == RING_NONE) {
+		QPair<int, QPair<QHostAddress, quint16>> contact = predecessor;
+		for (auto entry: fingerTable->values()) {
+			if (contact.first == RING_NONE && entry[2].toInt() != RING_NONE) {
+				contact = QPair<int, QPair<QHostAddress, quint16>>(entry[2].toInt(), QPair<QHostAddress, quint16>(QHostAddress(entry[3].toUInt()), entry[4].toUInt()));
+			}
+		}
+		predecessor = none;
+		fingerTable->clear();
+		createFingerTable();
+		if (contact.first != RING_NONE) {
+			qDebug() << "No saved successor answered. Joining again through " << QString::number(contact.first);
+			requestJoin(contact.second.first, contact.second.second);
+			joining = true;
+		}
+		else {
+			qDebug() << "No saved neighbor answered. Standing alone";
+		}
+	}
+
+	// Keys of saved virtual nodes we took over go out once we know our place in the ring
+	if (!joining) {
+		publishRestoredKeys();
+	}
+
+	showRing();
+	qDebug() << "Restored state checked. " << QString::number(confirmedNodes.size()) << " saved neighbors alive";
+}
+
+
+// Send message to all peers
+void MessageSender::sendToPeers(QByteArray data) {
+	int numPeers = peerLst.size();
+	qDebug() << "I HAVE " << QString::number(numPeers) << " PEERS!" << endl;
+
+	for (int i = 0; i < numPeers; i++) {
+			Peer tempPeer = peerLst[i];
+			transport->send(data, tempPeer.getAddress(), tempPeer.getPort());
+	}
+
+}
+
+
+// Slot for one message DatagramIo took off the socket. datagramBytes is the size of the
+// datagram it came in, given with the first message of each datagram only
+void MessageSender::onDecodedMessage(QVariantMap receivedMap, uint address, int port, int messageBytes, int datagramBytes)
+{
+	QHostAddress senderAddress(address);
+	quint16 senderPort = port;
+	if (datagramBytes) {
+		metrics.count("peerster_datagrams_received_total");
+		metrics.count("peerster_datagram_bytes_received_total", datagramBytes);
+		TRACE(TraceDebug, TraceReceive, nodeID, datagramBytes, address, port);
+	}
+	recordReceived(receivedMap, messageBytes);
+	handleMessage(receivedMap, &senderAddress, &senderPort);
+}
+
+
+// Slot for a message delivered by the reliable block transport
+void MessageSender::onReliableMessage(QByteArray message, QHostAddress address, quint16 port)
+{
+	QVariantMap receivedMap;
+	QDataStream stream(&message, QIODevice::ReadOnly);
+	stream >> receivedMap;
+	recordReceived(receivedMap, message.size());
+	handleMessage(receivedMap, &address, &port);
+}
+
+
+// Slot for block traffic the reliable transport gave up on. If our pending block request
+// was among it the download can't go on, so fail it instead of waiting forever
+void MessageSender::blockSendFailed(QHostAddress address, quint16 port, int messages)
+{
+	metrics.count("peerster_block_messages_failed_total", messages);
+	if (pendingBlockRequest.isEmpty() || pendingBlockHop != qMakePair(address, port)) return;
+
+	qDebug() << "Block request " << pendingBlockRequest.toHex() << " could not be delivered. Download failed";
+	metrics.count("peerster_downloads_failed_total");
+	pendingBlockRequest.clear();
+	fileReceiving.clear();
+}
+
+
+// Count one received message and its size under its type
+void MessageSender::recordReceived(QVariantMap map, int bytes)
+{
+	int typeIndex = messageTypeIndex(map);
+	messagesReceived[typeIndex]++;
+	messageBytesReceived[typeIndex] += bytes;
+}
+
+
+// Act on one message received from another peerster node
+void MessageSender::handleMessage(QVariantMap receivedMap, QHostAddress *senderAddress, quint16 *senderPort)
+{
+	TRACE(TraceDebug, TraceMessage, nodeID, messageTypeIndex(receivedMap), senderAddress->toIPv4Address(), *senderPort);
+
+
+	// If receiving message from an unregistered peer, add to our peer list
+	// QString peerKey = senderAddress->toString() + ":" + QString::number(*senderPort);
+	// if(!peerCheck.contains(peerKey)) {
+	// 	addPeer(peerKey);
+	// }
+
+	// Reliable transport segment or acknowledgement
+	if (receivedMap.contains("RelSeq")) {
+		blockTransport->receiveSegment(receivedMap, *senderAddress, *senderPort);
+		return;
+	}
+	if (receivedMap.contains("RelAck")) {
+		blockTransport->receiveAck(receivedMap, *senderAddress, *senderPort);
+		return;
+	}
+
+	// Every message tells us how to get back to whoever sent it
+	learnRoutes(receivedMap, senderAddress, senderPort);
+	recordRequest();
+
+	// Rehash nodeID if collision with existing node
+	if (receivedMap.contains("collision")) {
+		QString idVal = QString::number(qrand());
+		QString hostName = QHostInfo::localHostName();
+		originID = hostName + idVal;
+		QCA::Initializer qcainit;
+
+		QByteArray nodeHash = QCA::Hash("sha1").hash(originID.toLatin1()).toByteArray();
+		QDataStream in(nodeHash.right(4));
+		in.setByteOrder(QDataStream::BigEndian);
+		quint32 result;
+		in >> result;
+		nodeID = result % RING_SIZE;
+		updateNum = (nodeID + 1) % RING_SIZE;
+		entryNum = 1;
+		showRing();
+		QVariantMap newNodeMap;
+		newNodeMap.insert("updateNode", nodeID);
+		newNodeMap.insert("join", 1);
+		QByteArray newNodeMsg = getSerialized(newNodeMap);
+		transport->send(newNodeMsg, *senderAddress, *senderPort);
+		return;
+	}
+
+	// We got the search result for a file (node or not present)
+	if (receivedMap.contains("fileSearch") && receivedMap["fileSearch"].toInt() == nodeID) {
+		metrics.count(receivedMap.contains("empty") ? "peerster_lookups_total{result=\"empty\"}" : "peerster_lookups_total{result=\"found\"}");
+		metrics.observe("peerster_lookup_hops", lookupHops(receivedMap), hopBuckets, hopBucketCount);
+		if (receivedMap.contains("expired")) metrics.count("peerster_lookups_expired_total");
+		qint64 latency = receivedMap.contains("lookupStart") ? ProtocolTimer::now() - receivedMap["lookupStart"].toLongLong() : -1;
+		if (latency >= 0) {
+			metrics.observe("peerster_lookup_latency_ms", latency, latencyBuckets, latencyBucketCount);
+		}
+		TRACE(TraceInfo, TraceLookupDone, nodeID, receivedMap["updateNode"].toInt(), lookupHops(receivedMap), latency);
+		if (receivedMap.contains("LookupID")) {
+			finishLookupTrace(receivedMap["LookupID"].toUInt(), receivedMap);
+		}
+		if (!chat) {
+			return;
+		}
+		else if (receivedMap.contains("empty")) {
+			MultiLineEdit *searchFileLine = chat->getSearchFileLine();
+			searchFileLine->clear();
+			searchFileLine->insertPlainText("File " + QString::number(receivedMap["updateNode"].toInt()) + " not found in the chord.");
+			qDebug() << "File " << QString::number(receivedMap["updateNode"].toInt()) << " not found in the chord.";
+		}
+		else if (receivedMap.contains("success")){
+			MultiLineEdit *searchFileLine = chat->getSearchFileLine();
+			searchFileLine->clear();
+			searchFileLine->insertPlainText("File " + QString::number(receivedMap["updateNode"].toInt()) + " found at node " + QString::number(receivedMap["success"].toInt()) );
+			qDebug() << "File " << QString::number(receivedMap["updateNode"].toInt()) << " found at node " << QString::number(receivedMap["success"].toInt());
+		}
+		return;
+	}
+
+	// We are searching for a file
+	else if (receivedMap.contains("fileSearch")) {
+		if (!receivedMap.contains("originAddress")) {
+			receivedMap.insert("originAddress", senderAddress->toIPv4Address());
+			receivedMap.insert("originPort", *senderPort);
+		}
+		// Unless it came from the originator, whoever sent this forwarded it. Keep the last
+		// hotKeyPushDepth forwarders' addresses for hot key pushes, so the header stays small
+		if (receivedMap["Hops"].toInt() > 0) {
+			QVariantList pathAddresses = receivedMap["pathAddresses"].toList();
+			QVariantList pathPorts = receivedMap["pathPorts"].toList();
+			pathAddresses.append(senderAddress->toIPv4Address());
+			pathPorts.append(*senderPort);
+			while (pathAddresses.size() > hotKeyPushDepth) {
+				pathAddresses.removeFirst();
+				pathPorts.removeFirst();
+			}
+			receivedMap.insert("pathAddresses", pathAddresses);
+			receivedMap.insert("pathPorts", pathPorts);
+		}
+		// The originator asked to see the path. Report ourselves to it directly
+		if (receivedMap.contains("LookupID")) {
+			QVariantMap hopMap;
+			hopMap.insert("lookupHop", receivedMap["LookupID"]);
+			hopMap.insert("hop", receivedMap["Hops"].toInt() + 1);
+			hopMap.insert("node", nodeID);
+			transport->send(getSerialized(hopMap), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
+		}
+		// Found the file in our table
+		if (fileTable->keys().contains(QByteArray::number(receivedMap["updateNode"].toInt()))) {
+			receivedMap.insert("success", nodeID);
+			transport->send(getSerialized(receivedMap), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
+			pushHotKey(receivedMap["updateNode"].toUInt(), receivedMap);
+			return;
+		}
+		// A hot key's owner told us where it lives
+		else if (answerFromLookupCache(receivedMap)) {
+			return;
+		}
+		// Check our intervals
+		else {
+			// Without a live finger for the interval, hand the search to our successor
+			QByteArray key = findSearchInterval(receivedMap["updateNode"].toInt());
+			QPair<int, QPair<QHostAddress, quint16>> next = successor;
+			if (!key.isEmpty()) {
+				next.first = (*fingerTable)[key][2].toInt();
+				next.second.first = QHostAddress((*fingerTable)[key][3].toUInt());
+				next.second.second = (*fingerTable)[key][4].toUInt();
+			}
+			// Successor is the same as current node, cycle. Routing loops end when the TTL
+			// runs out
+			int ttl = receivedMap.value("TTL", lookupTtl).toInt();
+			if (next.first == RING_NONE || next.first == (int)nodeID || ttl <= 0) {
+				receivedMap.insert("empty", 1);
+				if (ttl <= 0) receivedMap.insert("expired", 1);
+				transport->send(getSerialized(receivedMap), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
+			}
+			else {
+				receivedMap.insert("TTL", ttl - 1);
+				receivedMap.insert("Hops", receivedMap["Hops"].toInt() + 1);
+				transport->send(getSerialized(receivedMap), next.second.first, next.second.second);
+			}
+			return;
+		}
+
+	}
+
+	// If we are responsible for this file, add it to our file table
+	if (receivedMap.contains("store") && receivedMap.contains("fileID")) {
+		qDebug() << "Got a store file" << endl;
+
+		QList<QByteArray> fileEntry;
+		QString fileName = receivedMap["fileName"].toString();
+		QString fileID = QString::number(receivedMap["fileID"].toInt());
+		QByteArray byteName = QByteArray();
+		byteName.append(fileName);
+		qDebug() << byteName;
+		fileEntry.append(byteName);
+		fileTable->insert(QByteArray::number(receivedMap["fileID"].toInt()), fileEntry);
+		qDebug() << "Currently housed files";
+		QString fileListString = fileID + ":\t" + fileName;
+		if (chat) {
+			chat->getChordFileStore()->addItem(fileListString);
+		}
+
+		for (auto i = fileTable->begin(); i != fileTable->end(); i++) {
+			qDebug() << i.key() << i.value() << endl;
+		}
+	}
+
+	// If we receive the correct spot for this file
+	else if (receivedMap.contains("fileNode") && receivedMap["fileNode"].toInt() == nodeID && (receivedMap.contains("successorID")) || receivedMap.contains("match")) {
+		QVariantMap storeMap;
+		storeMap.insert("fileName", receivedMap["fileName"].toString());
+		storeMap.insert("fileID", receivedMap["updateNode"].toInt());
+		storeMap.insert("store", 1);
+		if (receivedMap.contains("match")) {
+			transport->send(getSerialized(storeMap), *senderAddress, *senderPort);
+		}
+		else {
+			transport->send(getSerialized(storeMap), QHostAddress(receivedMap["successorAddress"].toInt()), receivedMap["successorPort"].toInt());
+		}
+	}
+
+	// If we receive an updateFinger response, update our table
+	else if (receivedMap.contains("updateFinger") && receivedMap["updateFinger"].toInt() == nodeID && receivedMap.contains("successorID")) {
+		QByteArray updateKey = QByteArray::number(receivedMap["updateNode"].toInt());
+		QByteArray successorID = QByteArray::number(receivedMap["successorID"].toInt());
+		QByteArray successorAddress = QByteArray::number(QHostAddress(receivedMap["successorAddress"].toInt()).toIPv4Address());
+		QByteArray successorPort = QByteArray::number(receivedMap["successorPort"].toInt());
+		QList<QByteArray> newEntry;
+		newEntry << updateKey << (*fingerTable)[updateKey][1] << successorID << successorAddress << successorPort;
+		fingerTable->insert(updateKey, newEntry);
+		qDebug() << "Updating table: " << newEntry;
+		qDebug() << QHostAddress(receivedMap["successorAddress"].toInt());
+		qDebug() << receivedMap["successorPort"].toInt();
+		updateNum = (nodeID + entryNum) % RING_SIZE;
+		if (entryNum == RING_SIZE) {
+			for (auto i = fingerTable->begin(); i != fingerTable->end(); i++) {
+				qDebug() << i.key() << i.value() << endl;
+			}
+			// fingerTableTimer->stop();
+			entryNum = 1;
+			updateNum = (nodeID + 1) % RING_SIZE;
+		}
+	}
+	// If a new node receives its successor details
+	else if (receivedMap.contains("updateNode") && receivedMap.contains("successorID")) {
+		successor.first = receivedMap["successorID"].toInt();
+		// If we are the first node to join a 1-chord node
+		if (receivedMap.contains("creator")) {
+			successor.second.first = *senderAddress;
+			successor.second.second = *senderPort;
+			predecessor.first = receivedMap["successorID"].toInt();
+			predecessor.second.first = *senderAddress;
+			predecessor.second.second = *senderPort;
+			qDebug() << "My successor " << successor;
+			qDebug() << "My predecessor " << predecessor;
+		}
+		else {
+			successor.second.first = QHostAddress(receivedMap["successorAddress"].toInt());
+			successor.second.second = receivedMap["successorPort"].toInt();
+		}
+		qDebug() << "My successor is " << QString::number(successor.first);
+		if (receivedMap.contains("replierID")) {
+			bootstrapFromJoin(receivedMap);
+		}
+		publishRestoredKeys();
+		showRing();
+		return;
+	}
+	// If a chord node receives a forwarded message to find a new node's successor
+	else if (receivedMap.contains("updateNode") && receivedMap.contains("findSuccessor")) {
+		//call successor with this newChord
+		handleFindSuccessor(receivedMap);
+		return;
+
+	}
+	// If a chord node receives a forwarded message to find its closest predecessor to a new node
+	else if (receivedMap.contains("updateNode") && receivedMap.contains("findClosestPredecessor")) {
+		qDebug() << "supposed to find closest predecessor";
+		QByteArray closestPredecessor = findClosestPredecessor(receivedMap["updateNode"].toInt());
+		if (closestPredecessor.toInt() == nodeID) {
+			receivedMap.remove("findClosestPredecessor");
+			receivedMap.insert("findSuccessor", 1);
+			handleFindSuccessor(receivedMap);
+			return;
+		}
+		// Shouldn't have to check, but its possible that you yourself are the closest predecessor
+		receivedMap.remove("findClosestPredecessor");
+		receivedMap.insert("findSuccessor", 1);
+		QByteArray findSuccessorMsg = getSerialized(receivedMap);
+		transport->send(findSuccessorMsg, QHostAddress((*fingerTable)[closestPredecessor][3].toInt()), (*fingerTable)[closestPredecessor][4].toInt());
+		return;
+	}
+
+	// If message is from a new node joining the chord, first check your own successors.
+	// else change message for your successors to find the new node's successor
+	else if (receivedMap.contains("updateNode")) {
+		if (receivedMap.contains("join") && receivedMap["updateNode"].toInt() == successor.first || receivedMap["updateNode"].toInt() == nodeID) {
+			QVariantMap collision;
+			collision.insert("collision", 1);
+			transport->send(getSerialized(collision), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
+			return;
+		}
+		if (receivedMap.contains("fileNode") && receivedMap["updateNode"].toInt() == nodeID) {
+			receivedMap.insert("match", 1);
+			transport->send(getSerialized(receivedMap), *senderAddress, *senderPort);
+		}
+		// The creator node was finally joined by another node - make this node your successor and predecesssor - 2 node chord
+		if (successor.first == RING_NONE && predecessor.first == RING_NONE) {
+			successor.first = receivedMap["updateNode"].toInt();
+			predecessor.first = receivedMap["updateNode"].toInt();
+			successor.second.first = *senderAddress;
+			successor.second.second = *senderPort;
+			predecessor.second.first = *senderAddress;
+			predecessor.second.second = *senderPort;
+			receivedMap.insert("successorID", nodeID);
+			// So the joining node knows to add you as its successor
+			receivedMap.insert("creator", 1);
+			addJoinBootstrap(receivedMap);
+			QByteArray newNodeSuccessorMsg = getSerialized(receivedMap);
+			qDebug() << "My successor " << successor;
+			qDebug() << "My predecessor " << predecessor;
+			showRing();
+			transport->send(newNodeSuccessorMsg, *senderAddress, *senderPort);
+			return;
+		}
+		else if (findSuccessor(receivedMap["updateNode"].toInt())) {
+			//send our successor to the new node - i.e the sender
+			receivedMap.insert("successorID", successor.first);
+			receivedMap.insert("successorAddress", successor.second.first.toIPv4Address());
+			receivedMap.insert("successorPort", successor.second.second);
+			addJoinBootstrap(receivedMap);
+			QByteArray newNodeSuccessorMsg = getSerialized(receivedMap);
+			transport->send(newNodeSuccessorMsg, *senderAddress, *senderPort);
+			return;
+		}
+		//have our successor find its closest predecessor, then the closest predecessor will find successor
+		receivedMap.insert("findClosestPredecessor", 1);
+		receivedMap.insert("originAddress", senderAddress->toIPv4Address());
+		receivedMap.insert("originPort", *senderPort);
+		QByteArray findClosestPredMsg = getSerialized(receivedMap);
+		transport->send(findClosestPredMsg, successor.second.first, successor.second.second);
+		return;
+	}
+
+	// Node is requesting our status. Respond that we're alive
+	else if(receivedMap.contains("predecessorStatusRequest")) {
+		qDebug() << "Successor is requesting our status" << endl;
+		QVariantMap predStatusReply;
+		predStatusReply.insert("predecessorStatusReply", 1);
+		transport->send(getSerialized(predStatusReply), *senderAddress, *senderPort);
+	}
+
+	// Got a reply to predecessor check. Predecessor is still alive
+	else if(receivedMap.contains("predecessorStatusReply")) {
+		qDebug() << "Predecessor is still alive!" << endl;
+		detector.heartbeat(QPair<quint32, quint16>(senderAddress->toIPv4Address(), *senderPort), ProtocolTimer::now());
+
+		// Restart checkPredTimer
+		this->checkPredTimer->start(10000);
+	}
+
+	// Someone shared a file with a keyword that we or a node after us is responsible for
+	else if(receivedMap.contains("keywordPublish")) {
+		if (!receivedMap.contains("holderAddress")) {
+			receivedMap.insert("holderAddress", senderAddress->toIPv4Address());
+			receivedMap.insert("holderPort", *senderPort);
+		}
+		handleKeywordPublish(receivedMap);
+	}
+
+	// A node on the path of a lookup we asked to trace
+	else if(receivedMap.contains("lookupHop")) {
+		quint32 lookupID = receivedMap["lookupHop"].toUInt();
+		QMap<int, quint32> *hops = lookupTraces.object(lookupID);
+		if (hops) {
+			hops->insert(receivedMap["hop"].toInt(), receivedMap["node"].toUInt());
+		}
+	}
+
+	// Owner of a hot key telling us where it lives
+	else if(receivedMap.contains("hotKey")) {
+		lookupCache.insert(receivedMap["hotKey"].toUInt(), QPair<int, qint64>(receivedMap["owner"].toInt(),
+			ProtocolTimer::now() + receivedMap["ttl"].toLongLong()));
+	}
+
+	// Joining node asking the owner of a ring position how loaded it is
+	else if(receivedMap.contains("loadProbe")) {
+		if (!receivedMap.contains("originAddress")) {
+			receivedMap.insert("originAddress", senderAddress->toIPv4Address());
+			receivedMap.insert("originPort", *senderPort);
+		}
+		handleLoadProbe(receivedMap);
+	}
+
+	// Answer to one of our load probes
+	else if(receivedMap.contains("loadReport")) {
+		handleLoadReport(receivedMap);
+	}
+
+	// Keyword search travelling between the owners of its keywords
+	else if(receivedMap.contains("keywordQuery")) {
+		if (!receivedMap.contains("originAddress")) {
+			receivedMap.insert("originAddress", senderAddress->toIPv4Address());
+			receivedMap.insert("originPort", *senderPort);
+		}
+		handleKeywordQuery(receivedMap);
+	}
+
+	// Part of a bulk lookup. Resolve what we can and split the rest by next hop
+	else if(receivedMap.contains("bulkLookup")) {
+		if (!receivedMap.contains("originAddress")) {
+			receivedMap.insert("originAddress", senderAddress->toIPv4Address());
+			receivedMap.insert("originPort", *senderPort);
+		}
+		handleBulkLookup(receivedMap);
+	}
+
+	// Owners found for some keys of our bulk lookup
+	else if(receivedMap.contains("bulkLookupReply")) {
+		handleBulkLookupReply(receivedMap, *senderAddress, *senderPort);
+	}
+
+	// Items a bulk lookup found us to be responsible for
+	else if(receivedMap.contains("bulkStore")) {
+		handleBulkStore(receivedMap, *senderAddress, *senderPort);
+	}
+
+	// Final matches of our keyword search
+	else if(receivedMap.contains("keywordResults")) {
+		handleKeywordResults(receivedMap);
+	}
+
+	// Restarted node is checking that we are still the node it saved. Answer with our ID
+	else if(receivedMap.contains("statePing")) {
+		QVariantMap statePong;
+		statePong.insert("statePong", 1);
+		statePong.insert("nodeID", nodeID);
+		transport->send(getSerialized(statePong), *senderAddress, *senderPort);
+	}
+
+	// A neighbor from our saved state is alive
+	else if(receivedMap.contains("statePong")) {
+		confirmedNodes.insert(receivedMap["nodeID"].toInt());
+		detector.heartbeat(QPair<quint32, quint16>(senderAddress->toIPv4Address(), *senderPort), ProtocolTimer::now());
+	}
+
+	// Received a request for our predecessor. Send pred info back
+	else if(receivedMap.contains("predecessorRequest")) {
+
+		QVariantMap predReply;
+
+		// No predecessor exists (Send RING_NONE)
+		if(predecessor.first == RING_NONE) {
+			predReply.insert("predecessorReply", RING_NONE);
+		}
+		// Predecessor exists (Send 1 and routing info)
+		else {
+			quint32 predID = predecessor.first;
+			QPair<QHostAddress, quint16> predInfo = predecessor.second;
+			qDebug() << "Got a request for my predecessor  sending my pred " << QString(predID) << endl;
+			predReply.insert("predecessorReply", 1);
+			predReply.insert("nodeID", predID);
+			predReply.insert("nodeAddress", predInfo.first.toIPv4Address());
+			predReply.insert("nodePort", predInfo.second);
+			predReply.insert("nextSuccessorID", successor.first);
+			predReply.insert("nextSuccessorAddress", successor.second.first.toIPv4Address());
+			predReply.insert("nextSuccessorPort", successor.second.second);
+		}
+		qDebug() << "I am sending my predecessor AND successor back to the sender/potential predecessor";
+		transport->send(getSerialized(predReply), *senderAddress, *senderPort);
+	}
+
+	// Received a predecessor reply. Part of stabilization protocol
+	else if(receivedMap.contains("predecessorReply")) {
+
+		qDebug() << "Got pred from succ. Check if it is our new succ then check if we are our succ's new pred" << endl;
+
+		detector.heartbeat(QPair<quint32, quint16>(senderAddress->toIPv4Address(), *senderPort), ProtocolTimer::now());
+		if (stabilizeStarted) {
+			metrics.observe("peerster_stabilize_round_ms", ProtocolTimer::now() - stabilizeStarted, latencyBuckets, latencyBucketCount);
+			TRACE(TraceInfo, TraceStabilizeRound, nodeID, successor.first, ProtocolTimer::now() - stabilizeStarted, 0);
+			stabilizeStarted = 0;
+		}
+		// If Successor has a predecessor run stabilization protocol
+		if(receivedMap["predecessorReply"].toInt() != RING_NONE) {
+			stabilizePredecessor(receivedMap);
+		}
+
+		// Get routing info for successor
+		QPair<QHostAddress, quint16> succInfo = successor.second;
+
+		// Tell our successor to check if we are its predecessor
+		qDebug() << "sending predTest" <<endl;
+
+		QVariantMap predCheck;
+		predCheck.insert("predecessorTest", 1);
+		predCheck.insert("nodeID", this->nodeID);
+		transport->send(getSerialized(predCheck), succInfo.first, succInfo.second);
+	}
+
+	// Node thinks it might be our predecessor. Check if this is true and stabilize accordingly
+	// Last step in successor/predecessor stabilization. Reset timer at end
+	else if(receivedMap.contains("predecessorTest")) {
+		int tempNodeID = receivedMap["nodeID"].toInt();
+		QPair<QHostAddress, quint16> tempNodeInfo(*senderAddress, *senderPort);
+		QPair<int, QPair<QHostAddress, quint16>> tempNode(tempNodeID, tempNodeInfo);
+
+		qDebug() << "checking if my new pred is node " << QString::number(tempNodeID) << endl;
+
+		// If predecessor doesn't exist or tempNode falls btw old predecessor and us then update
+		if((predecessor.first == RING_NONE) || (tempNodeID > predecessor.first && tempNodeID < nodeID) || (predecessor.first > tempNodeID && tempNodeID < nodeID && nodeID < predecessor.first)
+		|| (predecessor.first < tempNodeID && tempNodeID > nodeID && predecessor.first > nodeID)) {
+			qDebug() << "Old Predecessor: " << QString::number(this->predecessor.first);
+			this->predecessor = tempNode;
+			showRing();
+			qDebug() << "New Predecessor: " << QString::number(this->predecessor.first);
+			// Check whether chord files should be transferred to predecessor
+			for(auto key: (*fileTable).keys()) {
+				quint32 fileID = key.toInt();
+				if((predecessor.first >= fileID && predecessor.first < nodeID) || ( predecessor.first >= fileID && predecessor.first > nodeID && fileID > nodeID) ||
+				(predecessor.first <= fileID && nodeID < fileID && nodeID > predecessor.first)) {
+					qDebug() << "File transferring to Predecessor" << endl;
+					qDebug() << QString::number(fileID) << endl;
+					QVariantMap storeFileMap;
+					storeFileMap.insert("store", 1);
+					storeFileMap.insert("fileID", fileID);
+					storeFileMap.insert("fileName", QString((*fileTable)[key][0]));
+					transport->send(getSerialized(storeFileMap), predecessor.second.first, predecessor.second.second);
+					metrics.count("peerster_key_migrations_total{kind=\"file\"}");
+					TRACE(TraceInfo, TraceKeyMigration, nodeID, fileID, predecessor.first, 0);
+					fileTable->remove(key);
+					makeStoredFileGui();
+				}
+
+			}
+			transferKeywords();
+		}
+		else {
+			qDebug() << "Nope. Not my predecessor" << endl;
+		}
+
+		qDebug() << "Done stabilizing" << endl;
+		qDebug() << "Successor: " << QString::number(this->successor.first) << endl;
+		qDebug() << "Predecessor: " << QString::number(this->predecessor.first) << endl;
+
+		// Stabilization of successor/predecessor complete. Reset timer
+		stabilizeTimer->start(10000);
+	}
+
+	// If message contains LastIP/LastPort then add node to peer list
+	else if(receivedMap.contains("LastIP") && receivedMap.contains("LastPort")) {
+
+		quint32 addressNum = receivedMap.value("LastIP").toUInt();
+		QHostAddress hostAddress = QHostAddress(addressNum);
+		QString finalAddress = hostAddress.toString();
+		QString port = QString::number(receivedMap.value("LastPort").toInt());
+		QString peerKey = finalAddress + ":" + port;
+
+		qDebug() << "LastIP " << finalAddress << endl;
+		qDebug() << "LastPort " << port << endl;
+
+		addPeer(peerKey);
+	}
+
+	// Private Msg or Block Msg
+	else if(receivedMap.contains("Dest")) {
+
+		// Get info from message
+		QString dest = receivedMap["Dest"].toString();
+		QString origin = receivedMap["Origin"].toString();
+		QString senderOrigin = origin;
+		// Check if the message was sent here
+		if(dest == originID) {
+			// Block Requests
+			if(receivedMap.contains("BlockRequest")) {
+				handleBlockRequestMessage(receivedMap, senderOrigin);
+			}
+			// Block Reply
+			else if(receivedMap.contains("BlockReply")) {
+				handleBlockReplyMessage(receivedMap, senderOrigin);
+			}
+			// Search Reply
+			else if(receivedMap.contains("SearchReply")) {
+				qDebug() << "Got search reply" << endl;
+				handleSearchReplyMessage(receivedMap);
+
+			}
+		}
+		// Serve popular blocks we relayed before instead of passing the request on
+		else if(receivedMap.contains("BlockRequest") && answerFromBlockCache(receivedMap)) {
+			return;
+		}
+		// Forward the message along to the next hop if noForward flag is not set and hops remain
+		else {
+			if (receivedMap.contains("BlockReply")) {
+				cacheRelayedBlock(receivedMap);
+			}
+			QPair<QHostAddress, quint16> nextHop;
+			if (lookupRoute(dest, nextHop)) {
+				sendRouted(receivedMap, nextHop);
+			}
+			else {
+				qDebug() << "No route to " << dest << ". Dropping" << endl;
+			}
 		}
-		start *= 2;
 	}
-	tableDialog->show();
+	// Status vector from a neighbor. Push what it lacks, pull what we lack
+	else if(receivedMap.contains("Want")) {
+		handleStatusMessage(receivedMap, senderAddress, senderPort);
+	}
+	// Change this for searching in chord
+	else if(receivedMap.contains("Search")) {
+		qDebug() << "Got search request" << endl;
+		QString senderOrigin = receivedMap["Origin"].toString();
+		QString searchStr = receivedMap["Search"].toString();
+		localFileSearch(searchStr, senderOrigin);
+	}
+	// Rumor Message
+	else {
+		handleRumorMessage(receivedMap, senderAddress, senderPort);
+	}
 }
 
-// Slot method to update fingerTable
-void MessageSender::failureProtocol() {
-	qDebug() << "Failure Protocol";
-	if (!rNearest.size() || rNearest[0].first == 257) return;
-	rNearest.removeFirst();
-	if (!rNearest.size()) return;
-	successor.first = rNearest[0].first;
-	successor.second.first = rNearest[0].second.first;
-	successor.second.second = rNearest[0].second.second;
-	chat->getSuccessorGui()->clear();
-	chat->getSuccessorGui()->append(QString::number(successor.first));
-	//add for stabilize monitoring rNearest successors
-}
 
+void MessageSender::localFileSearch(QString searchStr, QString dest) {
+	qDebug() << "Searching Locally for  " << searchStr << endl;
+	QStringList keywords = searchStr.split(' ', QString::SkipEmptyParts);
 
-// Send message to all peers
-void MessageSender::sendToPeers(QByteArray data) {
-	int numPeers = peerLst.size();
-	qDebug() << "I HAVE " << QString::number(numPeers) << " PEERS!" << endl;
+	QVariantList fileNameLst;
+	QVariantList fileIdList;
 
-	for (int i = 0; i < numPeers; i++) {
-			Peer tempPeer = peerLst[i];
-			socket->writeDatagram(data, tempPeer.getAddress(), tempPeer.getPort());
+	for(auto key: searchKeywordIndex(keywords)) {
+		QVariantMap metaMap = fileMetadata.value(key).toMap();
+		fileNameLst.append(metaMap["fileName"].toString());
+		fileIdList.append(key);
+	}
+
+	if(!fileNameLst.isEmpty()) {
+		qDebug() << "Found files!!!" << endl;
+		QVariantMap searchReplyMap;
+		searchReplyMap.insert("Dest", dest);
+		searchReplyMap.insert("Origin", originID);
+		searchReplyMap.insert("SearchReply", searchStr);
+		searchReplyMap.insert("MatchNames", fileNameLst);
+		searchReplyMap.insert("MatchIDs", fileIdList);
+		sendPointToPoint(searchReplyMap);
+	}
+	else {
+		qDebug() << "No results found here" << endl;
 	}
+}
 
+// Split a file name into lower case words, e.g. "Lab_Report 2.txt" -> lab, report, 2, txt
+QStringList MessageSender::fileNameTokens(QString fileName) {
+	QStringList tokens;
+	QString token;
+	QString lowerName = fileName.toLower();
+	for (int i = 0; i <= lowerName.size(); i++) {
+		if (i < lowerName.size() && lowerName[i].isLetterOrNumber()) {
+			token.append(lowerName[i]);
+		}
+		else if (!token.isEmpty()) {
+			tokens.append(token);
+			token.clear();
+		}
+	}
+	return tokens;
 }
 
 
-// Slot method to receive incoming msg from another peerster node
-void MessageSender::onReceive()
-{
-	// Initialize byte array to store incoming msg & resize to required length of msg
-	QByteArray *serializedMsg = new QByteArray();
-	int incomingSize = socket->pendingDatagramSize();
-	serializedMsg->resize(incomingSize);
+// Add a shared file to the keyword index. Every prefix of every word is a key so that
+// partial words still match like the old substring scan did
+void MessageSender::indexFile(QByteArray metaHash, QString fileName) {
+	for (auto token: fileNameTokens(fileName)) {
+		for (int len = 1; len <= token.size(); len++) {
+			keywordIndex[token.left(len)].insert(metaHash);
+		}
+	}
+}
 
-	// Vars to hold port & address of sender's host
-	quint16 *senderPort = new quint16();
-	QHostAddress *senderAddress = new QHostAddress();
-	QVariantMap receivedMap;
 
-	// Read in msg to serializedMsg. Deserialize msg and store in receivedMap
-	socket->readDatagram(serializedMsg->data(), incomingSize, senderAddress, senderPort);
-	QDataStream stream(serializedMsg, QIODevice::ReadOnly);
-	stream >> receivedMap;
+// Look up each keyword's posting list and rank files by how many keywords they match.
+// Each file appears once in the result
+QList<QByteArray> MessageSender::searchKeywordIndex(QStringList keywords) {
+	QHash<QByteArray, int> matchCount;
+	QSet<QString> seenTokens;
+	for (auto keyword: keywords) {
+		for (auto token: fileNameTokens(keyword)) {
+			if (seenTokens.contains(token)) continue;
+			seenTokens.insert(token);
+			if (!keywordIndex.contains(token)) continue;
+			for (auto metaHash: keywordIndex[token]) {
+				matchCount[metaHash] += 1;
+			}
+		}
+	}
 
-	qDebug() << "Receiving message from " << *senderAddress << " " << *senderPort << endl;
-	qDebug() << receivedMap;
+	// Most keywords matched first
+	QMap<int, QByteArray> ranked;
+	for (auto i = matchCount.begin(); i != matchCount.end(); i++) {
+		ranked.insertMulti(-i.value(), i.key());
+	}
+	return ranked.values();
+}
 
 
-	// If receiving message from an unregistered peer, add to our peer list
-	// QString peerKey = senderAddress->toString() + ":" + QString::number(*senderPort);
-	// if(!peerCheck.contains(peerKey)) {
-	// 	addPeer(peerKey);
-	// }
+// Hash a key onto the chord the same way node and file IDs are
+quint32 MessageSender::hashToRing(QByteArray value) {
+	QByteArray hash = QCA::Hash("sha1").hash(value).toByteArray();
+	QDataStream in(hash.right(4));
+	in.setByteOrder(QDataStream::BigEndian);
+	quint32 result;
+	in >> result;
+	return result % RING_SIZE;
+}
 
-	// Rehash nodeID if collision with existing node
-	if (receivedMap.contains("collision")) {
-		QString idVal = QString::number(qrand());
-		QString hostName = QHostInfo::localHostName();
-		originID = hostName + idVal;
-		QCA::Initializer qcainit;
 
-		QByteArray nodeHash = QCA::Hash("sha1").hash(originID.toLatin1()).toByteArray();
-		QDataStream in(nodeHash.right(2));
-		in.setByteOrder(QDataStream::BigEndian);
-		quint16 result;
-		in >> result;
-		nodeID = result % 256;
-		updateNum = (nodeID + 1) % 256;
-		entryNum = 1;
-		chat->setWindowTitle("Node " + QString::number(nodeID));
-		QVariantMap newNodeMap;
-		newNodeMap.insert("updateNode", nodeID);
-		QByteArray newNodeMsg = getSerialized(newNodeMap);
-		socket->writeDatagram(newNodeMsg, *senderAddress, *senderPort);
+// True if id falls between our predecessor (exclusive) and us (inclusive)
+bool MessageSender::isResponsibleFor(quint32 id) {
+	if (id == nodeID) return true;
+	// Alone in the chord, everything is ours
+	if (successor.first == RING_NONE) return true;
+	if (predecessor.first == RING_NONE) return false;
+	quint32 predID = predecessor.first;
+	if (predID < nodeID) {
+		return predID < id && id <= nodeID;
+	}
+	return predID < id || id <= nodeID;
+}
+
+
+// Send map one step closer to the node responsible for id: straight to our successor if
+// it owns id, else to the closest preceding finger
+void MessageSender::routeToOwner(quint32 id, QVariantMap map) {
+	if (successor.first == RING_NONE) {
+		qDebug() << "Not in a chord network. Dropping message for " << QString::number(id);
 		return;
 	}
+	QByteArray closestPredecessor = findClosestPredecessor(id);
+	if (findSuccessor(id) || id == (quint32)successor.first || closestPredecessor.toInt() == (int)nodeID) {
+		transport->send(getSerialized(map), successor.second.first, successor.second.second);
+		return;
+	}
+	QList<QByteArray> finger = (*fingerTable)[closestPredecessor];
+	transport->send(getSerialized(map), QHostAddress(finger[3].toUInt()), finger[4].toUInt());
+}
 
-	// We got the search result for a file (node or not present)
-	if (receivedMap.contains("fileSearch") && receivedMap["fileSearch"].toInt() == nodeID) {
-		if (receivedMap.contains("empty")) {
-			MultiLineEdit *searchFileLine = chat->getSearchFileLine();
-			searchFileLine->clear();
-			searchFileLine->insertPlainText("File " + QString::number(receivedMap["updateNode"].toInt()) + " not found in the chord.");
-			qDebug() << "File " << QString::number(receivedMap["updateNode"].toInt()) << " not found in the chord.";
-		}
-		else if (receivedMap.contains("success")){
-			MultiLineEdit *searchFileLine = chat->getSearchFileLine();
-			searchFileLine->clear();
-			searchFileLine->insertPlainText("File " + QString::number(receivedMap["updateNode"].toInt()) + " found at node " + QString::number(receivedMap["success"].toInt()) );
-			qDebug() << "File " << QString::number(receivedMap["updateNode"].toInt()) << " found at node " << QString::number(receivedMap["success"].toInt());
+
+// Add one posting per word of a shared file name to payloads, keyed by the word's ring ID,
+// for a bulk lookup that delivers them to the nodes responsible for the words. Unlike the
+// local index, prefixes are not posted, so chord search matches whole words only
+void MessageSender::publishKeywords(QByteArray metaHash, QString fileName, QVariantMap &payloads) {
+	QSet<QString> published;
+	for (auto keyword: fileNameTokens(fileName)) {
+		if (published.contains(keyword)) continue;
+		published.insert(keyword);
+
+		quint32 keywordID = hashToRing(keyword.toUtf8());
+		QVariantMap publishMap;
+		publishMap.insert("keywordPublish", keyword);
+		publishMap.insert("keywordID", keywordID);
+		publishMap.insert("fileID", metaHash);
+		publishMap.insert("fileName", fileName);
+		publishMap.insert("holder", originID);
+
+		QVariantList items = payloads[QString::number(keywordID)].toList();
+		items.append(publishMap);
+		payloads.insert(QString::number(keywordID), items);
+	}
+}
+
+
+// Store a keyword posting if we own the keyword, else pass it on
+void MessageSender::handleKeywordPublish(QVariantMap map) {
+	quint32 keywordID = map["keywordID"].toUInt();
+	if (isResponsibleFor(keywordID)) {
+		QVariantMap posting;
+		posting.insert("fileName", map["fileName"].toString());
+		posting.insert("holder", map["holder"].toString());
+		if (map.contains("holderAddress")) {
+			posting.insert("holderAddress", map["holderAddress"].toUInt());
+			posting.insert("holderPort", map["holderPort"].toUInt());
 		}
+		keywordPostings[map["keywordPublish"].toString()].insert(map["fileID"].toByteArray(), posting);
+		qDebug() << "Storing keyword " << map["keywordPublish"].toString() << " for " << map["fileName"].toString();
 		return;
 	}
+	int hops = map["keywordHops"].toInt() + 1;
+	if (hops > maxRouteHops) {
+		qDebug() << "Keyword publish went around too long. Dropping";
+		return;
+	}
+	map.insert("keywordHops", hops);
+	routeToOwner(keywordID, map);
+}
 
-	// We are searching for a file
-	else if (receivedMap.contains("fileSearch")) {
-		if (!receivedMap.contains("originAddress")) {
-			receivedMap.insert("originAddress", senderAddress->toIPv4Address());
-			receivedMap.insert("originPort", *senderPort);
-		}
-		// Detect a cycle
-		if (receivedMap.contains(QString::number(nodeID))) {
-			receivedMap.insert("empty", 1);
-			socket->writeDatagram(getSerialized(receivedMap), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
+
+// Intersect the query's candidate files with the posting list of every keyword we own,
+// then move on to the owner of the next keyword. Report back once all keywords are done.
+// Terms are looked up as whole words, the only keys publishKeywords posts
+void MessageSender::handleKeywordQuery(QVariantMap map) {
+	QStringList terms = map["keywordQuery"].toStringList();
+	int termIndex = map["termIndex"].toInt();
+	QVariantMap candidates = map["candidates"].toMap();
+
+	while (termIndex < terms.size()) {
+		quint32 keywordID = hashToRing(terms[termIndex].toUtf8());
+		if (!isResponsibleFor(keywordID)) {
+			int hops = map["keywordHops"].toInt() + 1;
+			if (hops > maxRouteHops) {
+				qDebug() << "Keyword query went around too long. Dropping";
+				return;
+			}
+			map.insert("keywordHops", hops);
+			map.insert("termIndex", termIndex);
+			map.insert("candidates", candidates);
+			routeToOwner(keywordID, map);
 			return;
 		}
-		// Found the file in our table
-		else if (fileTable->keys().contains(QByteArray::number(receivedMap["updateNode"].toInt()))) {
-			receivedMap.insert("success", nodeID);
-			socket->writeDatagram(getSerialized(receivedMap), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
-			return;
+
+		// Candidates are keyed by the hex file ID
+		QHash<QByteArray, QVariantMap> postings = keywordPostings.value(terms[termIndex]);
+		if (termIndex == 0) {
+			for (auto i = postings.begin(); i != postings.end(); i++) {
+				candidates.insert(i.key().toHex(), i.value());
+			}
 		}
-		// Check our intervals
 		else {
-			int start = 128;
-			quint32 updateNode = receivedMap["updateNode"].toInt();
-			for (int i = 0; i < 8; i++) {
-				QByteArray key = QByteArray::number((nodeID + start) % 256);
-				quint32 start = (*fingerTable)[key][0].toInt();
-				quint32 end = (*fingerTable)[key][1].toInt();
-				if ((start <= updateNode && updateNode < end) || (start <= updateNode && updateNode > end && end < start)
-				|| (start >= updateNode && updateNode < end && end < start)) {
-					// Successor is the same as current node, cycle
-					if ((*fingerTable)[key][2].toInt() == nodeID) {
-						receivedMap.insert("empty", 1);
-						socket->writeDatagram(getSerialized(receivedMap), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
-					}
-					else {
-						receivedMap.insert(QString::number(nodeID), 1);
-						socket->writeDatagram(getSerialized(receivedMap), QHostAddress((*fingerTable)[key][3].toInt()), (*fingerTable)[key][4].toInt());
-					}
-					return;
+			for (auto key: candidates.keys()) {
+				if (!postings.contains(QByteArray::fromHex(key.toLatin1()))) {
+					candidates.remove(key);
 				}
-				start /= 2;
 			}
 		}
+		termIndex++;
+		map.insert("keywordHops", 0);
 
+		// No file has all keywords so far, no point visiting the other owners
+		if (candidates.isEmpty()) break;
 	}
 
-	// If we are responsible for this file, add it to our file table
-	if (receivedMap.contains("store") && receivedMap.contains("fileID")) {
-		qDebug() << "Got a store file" << endl;
+	QVariantList fileNames;
+	QVariantList fileIDs;
+	QVariantList holders;
+	QVariantList holderAddresses;
+	QVariantList holderPorts;
+	for (auto key: candidates.keys()) {
+		QVariantMap posting = candidates[key].toMap();
+		fileNames.append(posting["fileName"].toString());
+		fileIDs.append(QByteArray::fromHex(key.toLatin1()));
+		holders.append(posting["holder"].toString());
+		holderAddresses.append(posting["holderAddress"].toUInt());
+		holderPorts.append(posting["holderPort"].toUInt());
+	}
 
-		QList<QByteArray> fileEntry;
-		QString fileName = receivedMap["fileName"].toString();
-		QString fileID = QString::number(receivedMap["fileID"].toInt());
-		QByteArray byteName = QByteArray();
-		byteName.append(fileName);
-		qDebug() << byteName;
-		fileEntry.append(byteName);
-		fileTable->insert(QByteArray::number(receivedMap["fileID"].toInt()), fileEntry);
-		qDebug() << "Currently housed files";
-		QString fileListString = fileID + ":\t" + fileName;
-		QListWidget *chordFileStore = chat->getChordFileStore();
-		chordFileStore->addItem(fileListString);
+	QVariantMap resultsMap;
+	resultsMap.insert("keywordResults", terms.join(" "));
+	resultsMap.insert("RouteOrigin", originID);
+	resultsMap.insert("MatchNames", fileNames);
+	resultsMap.insert("MatchIDs", fileIDs);
+	resultsMap.insert("MatchHolders", holders);
+	resultsMap.insert("MatchAddresses", holderAddresses);
+	resultsMap.insert("MatchPorts", holderPorts);
+
+	// The query never left this node
+	if (!map.contains("originAddress")) {
+		handleKeywordResults(resultsMap);
+		return;
+	}
+	transport->send(getSerialized(resultsMap), QHostAddress(map["originAddress"].toUInt()), map["originPort"].toUInt());
+}
 
-		for (auto i = fileTable->begin(); i != fileTable->end(); i++) {
-			qDebug() << i.key() << i.value() << endl;
+
+// Show the files matching our current keyword search
+void MessageSender::handleKeywordResults(QVariantMap map) {
+	QStringList terms = fileNameTokens(currentSearch);
+	terms.removeDuplicates();
+	if (map["keywordResults"].toString() != terms.join(" ")) return;
+
+	QVariantList fileNames = map["MatchNames"].toList();
+	QVariantList fileIDs = map["MatchIDs"].toList();
+	QVariantList holders = map["MatchHolders"].toList();
+	QVariantList holderAddresses = map["MatchAddresses"].toList();
+	QVariantList holderPorts = map["MatchPorts"].toList();
+	qDebug() << "Keyword search found " << QString::number(fileNames.size()) << " files";
+
+	for (int i = 0; i < fileNames.size(); i++) {
+		QString file = fileNames[i].toString();
+		QString holder = holders[i].toString();
+
+		// Remember how to reach the holder so the download can go point to point
+		if (holderAddresses[i].toUInt() != 0) {
+			learnRoute(holder, QHostAddress(holderAddresses[i].toUInt()), holderPorts[i].toUInt(), true);
+		}
+
+		if (!searchResultsMap.contains(file)) {
+			QVariantList fileInfo;
+			fileInfo.append(holder);
+			fileInfo.append(fileIDs[i].toByteArray());
+			searchResultsMap.insert(file, fileInfo);
+			if (chat) chat->getFileSearchResultsList()->addItem(file);
 		}
 	}
+}
 
-	// If we receive the correct spot for this file
-	else if (receivedMap.contains("fileNode") && receivedMap["fileNode"].toInt() == nodeID && (receivedMap.contains("successorID")) || receivedMap.contains("match")) {
-		QVariantMap storeMap;
-		storeMap.insert("fileName", receivedMap["fileName"].toString());
-		storeMap.insert("fileID", receivedMap["updateNode"].toInt());
-		storeMap.insert("store", 1);
-		if (receivedMap.contains("match")) {
-			socket->writeDatagram(getSerialized(storeMap), *senderAddress, *senderPort);
+
+// Find the owners of many keys at once and deliver payloads[key] (a list of items) to the
+// owner of each key. purpose says what the owners do with the items
+void MessageSender::bulkLookup(QString purpose, QVariantMap payloads) {
+	if (payloads.isEmpty()) return;
+	QString requestID = QString::number(++bulkLookupCount);
+	QVariantMap pending;
+	pending.insert("purpose", purpose);
+	pending.insert("payloads", payloads);
+	pending.insert("keyCount", payloads.size());
+	pending.insert("deadline", ProtocolTimer::now() + bulkLookupTimeout);
+	pendingBulkLookups.insert(requestID, pending);
+
+	QVariantList keys;
+	for (auto key: payloads.keys()) {
+		keys.append(key.toUInt());
+	}
+	QVariantMap lookupMap;
+	lookupMap.insert("bulkLookup", requestID);
+	lookupMap.insert("RouteOrigin", originID);
+	lookupMap.insert("keys", keys);
+	handleBulkLookup(lookupMap);
+}
+
+
+// Answer the keys owned by us or our successor in one reply, and send the rest on in one
+// message per finger they route through
+void MessageSender::handleBulkLookup(QVariantMap map) {
+	QVariantList resolvedKeys;
+	QVariantList ownerIDs;
+	QVariantList ownerAddresses;
+	QVariantList ownerPorts;
+	QHash<QByteArray, QVariantList> nextHops;
+
+	for (auto key: map["keys"].toList()) {
+		quint32 id = key.toUInt();
+		if (isResponsibleFor(id)) {
+			// Address 0 tells the origin to use the address this reply came from
+			resolvedKeys.append(id);
+			ownerIDs.append(nodeID);
+			ownerAddresses.append(0);
+			ownerPorts.append(0);
+		}
+		else if (findSuccessor(id) || id == (quint32)successor.first) {
+			resolvedKeys.append(id);
+			ownerIDs.append(successor.first);
+			ownerAddresses.append(successor.second.first.toIPv4Address());
+			ownerPorts.append(successor.second.second);
 		}
 		else {
-			socket->writeDatagram(getSerialized(storeMap), QHostAddress(receivedMap["successorAddress"].toInt()), receivedMap["successorPort"].toInt());
+			nextHops[findClosestPredecessor(id)].append(id);
 		}
 	}
 
-	// If we receive an updateFinger response, update our table
-	else if (receivedMap.contains("updateFinger") && receivedMap["updateFinger"].toInt() == nodeID && receivedMap.contains("successorID")) {
-		QByteArray updateKey = QByteArray::number(receivedMap["updateNode"].toInt());
-		QByteArray successorID = QByteArray::number(receivedMap["successorID"].toInt());
-		QByteArray successorAddress = QByteArray::number(QHostAddress(receivedMap["successorAddress"].toInt()).toIPv4Address());
-		QByteArray successorPort = QByteArray::number(receivedMap["successorPort"].toInt());
-		QList<QByteArray> newEntry;
-		newEntry << updateKey << (*fingerTable)[updateKey][1] << successorID << successorAddress << successorPort;
-		fingerTable->insert(updateKey, newEntry);
-		qDebug() << "Updating table: " << newEntry;
-		qDebug() << QHostAddress(receivedMap["successorAddress"].toInt());
-		qDebug() << receivedMap["successorPort"].toInt();
-		updateNum = (nodeID + entryNum) % 256;
-		if (entryNum == 256) {
-			for (auto i = fingerTable->begin(); i != fingerTable->end(); i++) {
-				qDebug() << i.key() << i.value() << endl;
-			}
-			// fingerTableTimer->stop();
-			entryNum = 1;
-			updateNum = (nodeID + 1) % 256;
+	if (!resolvedKeys.isEmpty()) {
+		QVariantMap replyMap;
+		replyMap.insert("bulkLookupReply", map["bulkLookup"].toString());
+		replyMap.insert("RouteOrigin", originID);
+		replyMap.insert("keys", resolvedKeys);
+		replyMap.insert("ownerIDs", ownerIDs);
+		replyMap.insert("ownerAddresses", ownerAddresses);
+		replyMap.insert("ownerPorts", ownerPorts);
+		if (map.contains("originAddress")) {
+			transport->send(getSerialized(replyMap), QHostAddress(map["originAddress"].toUInt()), map["originPort"].toUInt());
+		}
+		else {
+			handleBulkLookupReply(replyMap, QHostAddress(), 0);
 		}
 	}
-	// If a new node receives its successor details
-	else if (receivedMap.contains("updateNode") && receivedMap.contains("successorID")) {
-		successor.first = receivedMap["successorID"].toInt();
-		// If we are the first node to join a 1-chord node
-		if (receivedMap.contains("creator")) {
-			successor.second.first = *senderAddress;
-			successor.second.second = *senderPort;
-			predecessor.first = receivedMap["successorID"].toInt();
-			predecessor.second.first = *senderAddress;
-			predecessor.second.second = *senderPort;
-			qDebug() << "My successor " << successor;
-			qDebug() << "My predecessor " << predecessor;
+
+	if (nextHops.isEmpty()) return;
+	int hops = map["bulkHops"].toInt() + 1;
+	if (hops > maxRouteHops) {
+		qDebug() << "Bulk lookup went around too long. Dropping " << QString::number(nextHops.size()) << " groups";
+		return;
+	}
+	map.insert("bulkHops", hops);
+	for (auto hop = nextHops.begin(); hop != nextHops.end(); hop++) {
+		map.insert("keys", hop.value());
+		QByteArray bulkMsg = getSerialized(map);
+		if (hop.key().toInt() == (int)nodeID) {
+			transport->send(bulkMsg, successor.second.first, successor.second.second);
 		}
 		else {
-			successor.second.first = QHostAddress(receivedMap["successorAddress"].toInt());
-			successor.second.second = receivedMap["successorPort"].toInt();
+			QList<QByteArray> finger = (*fingerTable)[hop.key()];
+			transport->send(bulkMsg, QHostAddress(finger[3].toUInt()), finger[4].toUInt());
 		}
-		qDebug() << "My successor is " << QString::number(successor.first);
-		chat->getSuccessorGui()->clear();
-		chat->getSuccessorGui()->append(QString::number(successor.first));
-		chat->getPredecessorGui()->clear();
-		chat->getPredecessorGui()->append(QString::number(predecessor.first));
-		successorFailTimer->stop();
-		predResponseTimer->stop();
-		return;
 	}
-	// If a chord node receives a forwarded message to find a new node's successor
-	else if (receivedMap.contains("updateNode") && receivedMap.contains("findSuccessor")) {
-		//call successor with this newChord
-		handleFindSuccessor(receivedMap);
-		return;
+}
 
-	}
-	// If a chord node receives a forwarded message to find its closest predecessor to a new node
-	else if (receivedMap.contains("updateNode") && receivedMap.contains("findClosestPredecessor")) {
-		qDebug() << "supposed to find closest predecessor";
-		QByteArray closestPredecessor = findClosestPredecessor(receivedMap["updateNode"].toInt());
-		if (closestPredecessor.toInt() == nodeID) {
-			receivedMap.remove("findClosestPredecessor");
-			receivedMap.insert("findSuccessor", 1);
-			handleFindSuccessor(receivedMap);
-			return;
+
+// Owners for some of our bulk lookup keys are known. Send each owner its items in one message
+void MessageSender::handleBulkLookupReply(QVariantMap map, QHostAddress senderAddress, quint16 senderPort) {
+	QString requestID = map["bulkLookupReply"].toString();
+	if (!pendingBulkLookups.contains(requestID)) return;
+	QVariantMap pending = pendingBulkLookups[requestID];
+	QVariantMap payloads = pending["payloads"].toMap();
+
+	QVariantList keys = map["keys"].toList();
+	QVariantList ownerIDs = map["ownerIDs"].toList();
+	QVariantList ownerAddresses = map["ownerAddresses"].toList();
+	QVariantList ownerPorts = map["ownerPorts"].toList();
+
+	QHash<QPair<quint32, quint16>, QVariantList> ownerItems;
+	QVariantList localItems;
+	for (int i = 0; i < keys.size(); i++) {
+		QString key = QString::number(keys[i].toUInt());
+		if (!payloads.contains(key)) continue;
+		QVariantList items = payloads.take(key).toList();
+
+		if (ownerIDs[i].toUInt() == nodeID) {
+			localItems.append(items);
+			continue;
 		}
-		// Shouldn't have to check, but its possible that you yourself are the closest predecessor
-		receivedMap.remove("findClosestPredecessor");
-		receivedMap.insert("findSuccessor", 1);
-		QByteArray findSuccessorMsg = getSerialized(receivedMap);
-		socket->writeDatagram(findSuccessorMsg, QHostAddress((*fingerTable)[closestPredecessor][3].toInt()), (*fingerTable)[closestPredecessor][4].toInt());
-		return;
+		QPair<quint32, quint16> owner(ownerAddresses[i].toUInt(), ownerPorts[i].toUInt());
+		if (owner.first == 0) {
+			owner = QPair<quint32, quint16>(senderAddress.toIPv4Address(), senderPort);
+		}
+		ownerItems[owner].append(items);
 	}
 
-	// If message is from a new node joining the chord, first check your own successors.
-	// else change message for your successors to find the new node's successor
-	else if (receivedMap.contains("updateNode")) {
-		if (receivedMap.size() == 1 && receivedMap["updateNode"].toInt() == successor.first || receivedMap["updateNode"].toInt() == nodeID) {
-			QVariantMap collision;
-			collision.insert("collision", 1);
-			socket->writeDatagram(getSerialized(collision), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
-			return;
+	if (payloads.isEmpty()) {
+		pendingBulkLookups.remove(requestID);
+	}
+	else {
+		pending.insert("payloads", payloads);
+		pendingBulkLookups.insert(requestID, pending);
+	}
+
+	QVariantMap storeMap;
+	storeMap.insert("bulkStore", pending["purpose"].toString());
+	for (auto owner = ownerItems.begin(); owner != ownerItems.end(); owner++) {
+		storeMap.insert("items", owner.value());
+		transport->send(getSerialized(storeMap), QHostAddress(owner.key().first), owner.key().second);
+	}
+	if (!localItems.isEmpty()) {
+		storeMap.insert("items", localItems);
+		handleBulkStore(storeMap, QHostAddress(), 0);
+	}
+}
+
+
+// Store the items a bulk lookup delivered to us
+void MessageSender::handleBulkStore(QVariantMap map, QHostAddress senderAddress, quint16 senderPort) {
+	QString purpose = map["bulkStore"].toString();
+	for (auto item: map["items"].toList()) {
+		QVariantMap itemMap = item.toMap();
+		if (purpose == "files") {
+			QList<QByteArray> fileEntry;
+			fileEntry.append(itemMap["fileName"].toString().toUtf8());
+			fileTable->insert(QByteArray::number(itemMap["fileID"].toUInt()), fileEntry);
 		}
-		if (receivedMap.contains("fileNode") && receivedMap["updateNode"].toInt() == nodeID) {
-			receivedMap.insert("match", 1);
-			socket->writeDatagram(getSerialized(receivedMap), *senderAddress, *senderPort);
+		else if (purpose == "keywords") {
+			if (!itemMap.contains("holderAddress") && !senderAddress.isNull()) {
+				itemMap.insert("holderAddress", senderAddress.toIPv4Address());
+				itemMap.insert("holderPort", senderPort);
+			}
+			handleKeywordPublish(itemMap);
 		}
-		// The creator node was finally joined by another node - make this node your successor and predecesssor - 2 node chord
-		if (successor.first == 257 && predecessor.first == 257) {
-			successor.first = receivedMap["updateNode"].toInt();
-			predecessor.first = receivedMap["updateNode"].toInt();
-			successor.second.first = *senderAddress;
-			successor.second.second = *senderPort;
-			predecessor.second.first = *senderAddress;
-			predecessor.second.second = *senderPort;
-			receivedMap.insert("successorID", nodeID);
-			// So the joining node knows to add you as its successor
-			receivedMap.insert("creator", 1);
-			QByteArray newNodeSuccessorMsg = getSerialized(receivedMap);
-			qDebug() << "My successor " << successor;
-			qDebug() << "My predecessor " << predecessor;
-			chat->getPredecessorGui()->clear();
-			chat->getPredecessorGui()->append(QString::number(receivedMap["updateNode"].toInt()));
-			chat->getSuccessorGui()->clear();
-			chat->getSuccessorGui()->append(QString::number(receivedMap["updateNode"].toInt()));
-			socket->writeDatagram(newNodeSuccessorMsg, *senderAddress, *senderPort);
-			return;
+	}
+	if (purpose == "files") {
+		makeStoredFileGui();
+	}
+}
+
+
+// Hand keyword postings that now belong to our new predecessor over to it
+void MessageSender::transferKeywords() {
+	for (auto keyword: keywordPostings.keys()) {
+		quint32 keywordID = hashToRing(keyword.toUtf8());
+		if (isResponsibleFor(keywordID)) continue;
+
+		QHash<QByteArray, QVariantMap> postings = keywordPostings.take(keyword);
+		for (auto i = postings.begin(); i != postings.end(); i++) {
+			QVariantMap publishMap = i.value();
+			publishMap.insert("keywordPublish", keyword);
+			publishMap.insert("keywordID", keywordID);
+			publishMap.insert("fileID", i.key());
+			transport->send(getSerialized(publishMap), predecessor.second.first, predecessor.second.second);
+			metrics.count("peerster_key_migrations_total{kind=\"keyword\"}");
+			TRACE(TraceInfo, TraceKeyMigration, nodeID, keywordID, predecessor.first, 1);
 		}
-		else if (findSuccessor(receivedMap["updateNode"].toInt())) {
-			//send our successor to the new node - i.e the sender
+	}
+}
+
+
+// Protocol for handling find successor request
+void MessageSender::handleFindSuccessor(QVariantMap receivedMap) {
+	if (receivedMap.contains("join") && receivedMap["updateNode"].toInt() == successor.first || receivedMap["updateNode"].toInt() == nodeID) {
+		QVariantMap collision;
+		collision.insert("collision", 1);
+		transport->send(getSerialized(collision), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
+		return;
+	}
+	if (receivedMap.contains("fileNode") && receivedMap["updateNode"].toInt() == nodeID) {
+		receivedMap.insert("match", 1);
+		transport->send(getSerialized(receivedMap), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
+
+	}
+	if (findSuccessor(receivedMap["updateNode"].toInt())) {
 			receivedMap.insert("successorID", successor.first);
 			receivedMap.insert("successorAddress", successor.second.first.toIPv4Address());
 			receivedMap.insert("successorPort", successor.second.second);
+			addJoinBootstrap(receivedMap);
 			QByteArray newNodeSuccessorMsg = getSerialized(receivedMap);
-			socket->writeDatagram(newNodeSuccessorMsg, *senderAddress, *senderPort);
+			transport->send(newNodeSuccessorMsg, QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
 			return;
 		}
-		//have our successor find its closest predecessor, then the closest predecessor will find successor
+	else {
+		receivedMap.remove("findSuccessor");
 		receivedMap.insert("findClosestPredecessor", 1);
-		receivedMap.insert("originAddress", senderAddress->toIPv4Address());
-		receivedMap.insert("originPort", *senderPort);
 		QByteArray findClosestPredMsg = getSerialized(receivedMap);
-		socket->writeDatagram(findClosestPredMsg, successor.second.first, successor.second.second);
+		transport->send(findClosestPredMsg, successor.second.first, successor.second.second);
 		return;
 	}
+}
 
-	// Node is requesting our status. Respond that we're alive
-	else if(receivedMap.contains("predecessorStatusRequest")) {
-		qDebug() << "Successor is requesting our status" << endl;
-		QVariantMap predStatusReply;
-		predStatusReply.insert("predecessorStatusReply", 1);
-		socket->writeDatagram(getSerialized(predStatusReply), *senderAddress, *senderPort);
-	}
 
-	// Got a reply to predecessor check. Predecessor is still alive
-	else if(receivedMap.contains("predecessorStatusReply")) {
-		qDebug() << "Predecessor is still alive!" << endl;
-		// Stop the predResponseTimer since we got a reply
-		this->predResponseTimer->stop();
+// Add what we know of the ring to a reply to a joining node: our successor list, in order,
+// and our fingers with their starts. The new node seeds its own tables from them and from
+// us, the reply's sender
+void MessageSender::addJoinBootstrap(QVariantMap &reply) {
+	if (!reply.contains("join")) return;
+
+	QVariantList successorIDs;
+	QVariantList successorAddresses;
+	QVariantList successorPorts;
+	for (auto node: rNearest) {
+		if (node.first == RING_NONE) break;
+		successorIDs.append(node.first);
+		successorAddresses.append(node.second.first.toIPv4Address());
+		successorPorts.append(node.second.second);
+	}
 
-		// Restart checkPredTimer
-		this->checkPredTimer->start(10000);
+	QVariantList fingerStarts;
+	QVariantList fingerIDs;
+	QVariantList fingerAddresses;
+	QVariantList fingerPorts;
+	for (auto entry: fingerTable->values()) {
+		if (entry[2].toInt() == RING_NONE) continue;
+		fingerStarts.append(entry[0].toUInt());
+		fingerIDs.append(entry[2].toInt());
+		fingerAddresses.append(entry[3].toUInt());
+		fingerPorts.append(entry[4].toUInt());
 	}
 
-	// Received a request for our predecessor. Send pred info back
-	else if(receivedMap.contains("predecessorRequest")) {
+	reply.insert("successorIDs", successorIDs);
+	reply.insert("successorAddresses", successorAddresses);
+	reply.insert("successorPorts", successorPorts);
+	reply.insert("fingerStarts", fingerStarts);
+	reply.insert("fingerIDs", fingerIDs);
+	reply.insert("fingerAddresses", fingerAddresses);
+	reply.insert("fingerPorts", fingerPorts);
+	reply.insert("replierID", nodeID);
+}
 
-		QVariantMap predReply;
 
-		// No predecessor exists (Send 257)
-		if(predecessor.first == 257) {
-			predReply.insert("predecessorReply", 257);
-		}
-		// Predecessor exists (Send 1 and routing info)
-		else {
-			quint32 predID = predecessor.first;
-			QPair<QHostAddress, quint16> predInfo = predecessor.second;
-			qDebug() << "Got a request for my predecessor  sending my pred " << QString(predID) << endl;
-			predReply.insert("predecessorReply", 1);
-			predReply.insert("nodeID", predID);
-			predReply.insert("nodeAddress", predInfo.first.toIPv4Address());
-			predReply.insert("nodePort", predInfo.second);
-			predReply.insert("nextSuccessorID", successor.first);
-			predReply.insert("nextSuccessorAddress", successor.second.first.toIPv4Address());
-			predReply.insert("nextSuccessorPort", successor.second.second);
-		}
-		qDebug() << "I am sending my predecessor AND successor back to the sender/potential predecessor";
-		socket->writeDatagram(getSerialized(predReply), *senderAddress, *senderPort);
+// We joined. Take our successor list from the replier's, and seed the fingers whose node the
+// reply proves. Each known node hi with the node lo before it gives a range (lo, hi] whose
+// successor is hi: we and our successor, the replier and its successor list, and every
+// replier finger with its start. A finger whose start lies in one of them is exact, unless
+// we come first. The rest stay empty until updateTable looks them up
+void MessageSender::bootstrapFromJoin(QVariantMap reply) {
+	QVariantList ids = reply["successorIDs"].toList();
+	QVariantList addresses = reply["successorAddresses"].toList();
+	QVariantList ports = reply["successorPorts"].toList();
+	QList<QPair<int, QPair<QHostAddress, quint16>>> replierSuccessors;
+	for (int i = 0; i < ids.size() && i < addresses.size() && i < ports.size(); i++) {
+		replierSuccessors << QPair<int, QPair<QHostAddress, quint16>>(ids[i].toInt(), QPair<QHostAddress, quint16>(QHostAddress(addresses[i].toUInt()), ports[i].toUInt()));
 	}
 
-	// Received a predecessor reply. Part of stabilization protocol
-	else if(receivedMap.contains("predecessorReply")) {
+	// Our successor comes first. Whatever follows it in the replier's list follows it in ours
+	rNearest.clear();
+	rNearest.append(successor);
+	int after = -1;
+	for (int i = 0; i < replierSuccessors.size(); i++) {
+		if (replierSuccessors[i].first == successor.first) after = i;
+	}
+	for (int i = after + 1; after >= 0 && i < replierSuccessors.size() && rNearest.size() < successorListSize; i++) {
+		if (replierSuccessors[i].first != (int)nodeID) rNearest.append(replierSuccessors[i]);
+	}
 
-		qDebug() << "Got pred from succ. Check if it is our new succ then check if we are our succ's new pred" << endl;
+	// Ranges (lo, hi] and the node hi that is the successor of every ID in them
+	QList<quint32> rangeStarts;
+	QList<QPair<int, QPair<QHostAddress, quint16>>> rangeNodes;
+	if (successor.first != RING_NONE) {
+		rangeStarts << nodeID;
+		rangeNodes << successor;
+	}
+	quint32 previous = reply["replierID"].toUInt();
+	for (auto node: replierSuccessors) {
+		rangeStarts << previous;
+		rangeNodes << node;
+		previous = node.first;
+	}
+	QVariantList starts = reply["fingerStarts"].toList();
+	ids = reply["fingerIDs"].toList();
+	addresses = reply["fingerAddresses"].toList();
+	ports = reply["fingerPorts"].toList();
+	for (int i = 0; i < starts.size() && i < ids.size() && i < addresses.size() && i < ports.size(); i++) {
+		rangeStarts << starts[i].toUInt();
+		rangeNodes << QPair<int, QPair<QHostAddress, quint16>>(ids[i].toInt(), QPair<QHostAddress, quint16>(QHostAddress(addresses[i].toUInt()), ports[i].toUInt()));
+	}
 
-		successorFailTimer->stop();
-		// If Successor has a predecessor run stabilization protocol
-		if(receivedMap["predecessorReply"].toInt() != 257) {
-			stabilizePredecessor(receivedMap);
+	int seeded = 0;
+	for (auto key: fingerTable->keys()) {
+		quint32 start = key.toUInt();
+		for (int i = 0; i < rangeNodes.size(); i++) {
+			quint32 hi = rangeNodes[i].first;
+			if (rangeNodes[i].first == RING_NONE || hi == nodeID) continue;
+			// start in (lo, hi]. lo == hi is a lone node, whose range is the whole ring
+			quint32 span = (hi - rangeStarts[i] + RING_SIZE) % RING_SIZE;
+			if (span == 0) span = RING_SIZE;
+			quint32 distance = (hi - start + RING_SIZE) % RING_SIZE;
+			if (distance >= span) continue;
+			// We sit in [start, hi), so we are that finger's successor and it stays empty
+			if ((nodeID - start + RING_SIZE) % RING_SIZE < distance) break;
+
+			QList<QByteArray> entry = (*fingerTable)[key];
+			entry[2] = QByteArray::number(rangeNodes[i].first);
+			entry[3] = QByteArray::number(rangeNodes[i].second.first.toIPv4Address());
+			entry[4] = QByteArray::number(rangeNodes[i].second.second);
+			fingerTable->insert(key, entry);
+			seeded++;
+			break;
 		}
+	}
+	qDebug() << "Seeded " << seeded << " of " << fingerTable->size() << " fingers from the join reply";
+}
 
-		// Get routing info for successor
-		QPair<QHostAddress, quint16> succInfo = successor.second;
 
-		// Tell our successor to check if we are its predecessor
-		qDebug() << "sending predTest" <<endl;
+// Protocol for handling received rumor message
+void MessageSender::handleRumorMessage(QVariantMap receivedMap, QHostAddress *senderAddress, quint16 *senderPort) {
+	QString origin = receivedMap["Origin"].toString();
+	qDebug() << "is RUMOR from " << origin << endl;
+	quint32 seqNo = receivedMap["SeqNo"].toUInt();
+	QString key = origin + receivedMap["SeqNo"].toString();
+	qDebug() << "Key is " << key << endl;
 
-		QVariantMap predCheck;
-		predCheck.insert("predecessorTest", 1);
-		predCheck.insert("nodeID", this->nodeID);
-		socket->writeDatagram(getSerialized(predCheck), succInfo.first, succInfo.second);
-	}
 
-	// Node thinks it might be our predecessor. Check if this is true and stabilize accordingly
-	// Last step in successor/predecessor stabilization. Reset timer at end
-	else if(receivedMap.contains("predecessorTest")) {
-		int tempNodeID = receivedMap["nodeID"].toInt();
-		QPair<QHostAddress, quint16> tempNodeInfo(*senderAddress, *senderPort);
-		QPair<int, QPair<QHostAddress, quint16>> tempNode(tempNodeID, tempNodeInfo);
+	// Add LastIP and LastPort Keys
+	quint32 LastIP = senderAddress->toIPv4Address();
+	quint16 LastPort = *senderPort;
+	receivedMap.insert("LastIP", LastIP);
+	receivedMap.insert("LastPort", LastPort);
 
-		qDebug() << "checking if my new pred is node " << QString::number(tempNodeID) << endl;
+	// If new msg then start mongering with random neighbor & send status
+	if(recordRumor(origin, seqNo)) {
 
-		// If predecessor doesn't exist or tempNode falls btw old predecessor and us then update
-		if((predecessor.first == 257) || (tempNodeID > predecessor.first && tempNodeID < nodeID) || (predecessor.first > tempNodeID && tempNodeID < nodeID && nodeID < predecessor.first)
-		|| (predecessor.first < tempNodeID && tempNodeID > nodeID && predecessor.first > nodeID)) {
-			chat->getPredecessorGui()->clear();
-			chat->getPredecessorGui()->append(QString::number(tempNodeID));
-			predResponseTimer->stop();
-			qDebug() << "Old Predecessor: " << QString::number(this->predecessor.first);
-			this->predecessor = tempNode;
-			qDebug() << "New Predecessor: " << QString::number(this->predecessor.first);
-			// Check whether chord files should be transferred to predecessor
-			for(auto key: (*fileTable).keys()) {
-				quint32 fileID = key.toInt();
-				if((predecessor.first >= fileID && predecessor.first < nodeID) || ( predecessor.first >= fileID && predecessor.first > nodeID && fileID > nodeID) ||
-				(predecessor.first <= fileID && nodeID < fileID && nodeID > predecessor.first)) {
-					qDebug() << "File transferring to Predecessor" << endl;
-					qDebug() << QString::number(fileID) << endl;
-					QVariantMap storeFileMap;
-					storeFileMap.insert("store", 1);
-					storeFileMap.insert("fileID", fileID);
-					storeFileMap.insert("fileName", QString((*fileTable)[key][0]));
-					socket->writeDatagram(getSerialized(storeFileMap), predecessor.second.first, predecessor.second.second);
-					fileTable->remove(key);
-					makeStoredFileGui();
-				}
+		// Keep the body around in case a neighbor asks for it
+		rumorBodies.insert(key, new QVariantMap(receivedMap));
 
-			}
+		// If it is a chat message then display the text
+		if(receivedMap.contains("ChatText")) {
+
+			QString msg = receivedMap["ChatText"].toString();
+			// chat->getTextView()->append(msg);
+
+			qDebug() << "new chat message: " << key << " " << msg << endl;
 		}
 		else {
-			qDebug() << "Nope. Not my predecessor" << endl;
+			qDebug() << "Is a route rumor message " << endl;
 		}
 
-		qDebug() << "Done stabilizing" << endl;
-		qDebug() << "Successor: " << QString::number(this->successor.first) << endl;
-		qDebug() << "Predecessor: " << QString::number(this->predecessor.first) << endl;
+		// Start mongering with gossipFanout distinct random neighbors
+		QByteArray byteArrayToSender = getSerialized(receivedMap);
+		for (auto neighbor: getNeighbors(gossipFanout)) {
+			transport->send(byteArrayToSender, neighbor.getAddress(), neighbor.getPort());
+		}
 
-		// Stabilization of successor/predecessor complete. Reset timer
-		stabilizeTimer->start(10000);
+		// Tell the sender what we have so it can fill our gaps. A duplicate tells us nothing
+		// new, and anti-entropy catches up whatever it would have revealed
+		transport->send(getSerialized(createStatusMessage()), *senderAddress, *senderPort);
 	}
+}
 
-	// If message contains LastIP/LastPort then add node to peer list
-	else if(receivedMap.contains("LastIP") && receivedMap.contains("LastPort")) {
-
-		quint32 addressNum = receivedMap.value("LastIP").toUInt();
-		QHostAddress hostAddress = QHostAddress(addressNum);
-		QString finalAddress = hostAddress.toString();
-		QString port = QString::number(receivedMap.value("LastPort").toInt());
-		QString peerKey = finalAddress + ":" + port;
-
-		qDebug() << "LastIP " << finalAddress << endl;
-		qDebug() << "LastPort " << port << endl;
 
-		addPeer(peerKey);
+// Learn routes from a received message. Origin is whoever created a rumor or point to point
+// message, so the sender is the next hop back to it. RouteOrigin names the node that created
+// a lookup or a lookup reply. Those travel the ring carrying the creator's address, or come
+// straight from the creator, so they give a direct route
+void MessageSender::learnRoutes(QVariantMap map, QHostAddress *senderAddress, quint16 *senderPort) {
+	if (map.contains("Origin")) {
+		learnRoute(map["Origin"].toString(), *senderAddress, *senderPort, false);
+	}
+	if (map.contains("RouteOrigin")) {
+		if (map.contains("originAddress")) {
+			learnRoute(map["RouteOrigin"].toString(), QHostAddress(map["originAddress"].toUInt()), map["originPort"].toUInt(), true);
+		}
+		else {
+			learnRoute(map["RouteOrigin"].toString(), *senderAddress, *senderPort, true);
+		}
 	}
+}
 
-	// Private Msg or Block Msg
-	else if(receivedMap.contains("Dest")) {
 
-		// Get info from message
-		QString dest = receivedMap["Dest"].toString();
-		QString origin = receivedMap["Origin"].toString();
-		QString senderOrigin = origin;
-		// Check if the message was sent here
-		if(dest == originID) {
-			// Block Requests
-			if(receivedMap.contains("BlockRequest")) {
-				handleBlockRequestMessage(receivedMap, senderOrigin);
-			}
-			// Block Reply
-			else if(receivedMap.contains("BlockReply")) {
-				handleBlockReplyMessage(receivedMap, senderOrigin);
-			}
-			// Search Reply
-			else if(receivedMap.contains("SearchReply")) {
-				qDebug() << "Got search reply" << endl;
-				handleSearchReplyMessage(receivedMap);
+// Add or refresh the route to name. A live direct route is not replaced by a relayed one
+void MessageSender::learnRoute(QString name, QHostAddress address, quint16 port, bool direct) {
+	if (name.isEmpty() || name == originID || address.isNull() || port == 0) return;
+	qint64 now = ProtocolTimer::now();
 
-			}
-		}
-		// Forward the message along to the next hop if noForward flag is not set and hops remain
-		else if(routeTable.contains(dest)) {
-			QPair<QHostAddress, quint16> routingInfo = routeTable.value(dest);
-			QByteArray byteArrayToSender= getSerialized(receivedMap);
-			socket->writeDatagram(byteArrayToSender, routingInfo.first, routingInfo.second);
+	auto existing = routeTable.find(name);
+	if (existing != routeTable.end() && existing->expires > now && existing->direct && !direct) {
+		if (existing->nextHop.first == address && existing->nextHop.second == port) {
+			existing->expires = now + routeLifetime;
 		}
+		return;
 	}
-	// Change this for searching in chord
-	else if(receivedMap.contains("Search")) {
-		qDebug() << "Got search request" << endl;
-		QString senderOrigin = receivedMap["Origin"].toString();
-		QString searchStr = receivedMap["Search"].toString();
-		localFileSearch(searchStr, senderOrigin);
-	}
-	// Rumor Message
-	else {
-		handleRumorMessage(receivedMap, senderAddress, senderPort);
+
+	RouteEntry entry;
+	entry.nextHop = QPair<QHostAddress, quint16>(address, port);
+	entry.expires = now + routeLifetime;
+	entry.direct = direct;
+	if (existing == routeTable.end()) {
+		qDebug() << "New route to " << name << " via " << address.toString() << ":" << QString::number(port);
 	}
+	routeTable.insert(name, entry);
 }
 
 
-void MessageSender::localFileSearch(QString searchStr, QString dest) {
-	qDebug() << "Searching Locally for  " << searchStr << endl;
-	QStringList keywords = searchStr.split(' ');
-	int numKeywords = keywords.size();
-
-	QVariantList fileNameLst;
-	QVariantList fileIdList;
+// Next hop towards dest, if we have a route that has not expired
+bool MessageSender::lookupRoute(QString dest, QPair<QHostAddress, quint16> &nextHop) {
+	auto entry = routeTable.find(dest);
+	if (entry == routeTable.end()) return false;
+	if (entry->expires <= ProtocolTimer::now()) {
+		routeTable.erase(entry);
+		return false;
+	}
+	nextHop = entry->nextHop;
+	return true;
+}
 
-	for(auto key: fileMetadata.keys()) {
-		QVariantMap metaMap = fileMetadata.value(key).toMap();
-		QString fileName = metaMap["fileName"].toString();
 
-		for(int i=0; i < numKeywords; i++) {
-			if(fileName.contains(keywords[i])) {
-				fileNameLst.append(fileName);
-				fileIdList.append(key);
-			}
+// Drop routes that no traffic refreshed within routeLifetime, bulk lookups past their
+// deadline and hot key state that went stale
+void MessageSender::expireRoutes() {
+	qint64 now = ProtocolTimer::now();
+	for (auto i = routeTable.begin(); i != routeTable.end();) {
+		if (i->expires <= now) {
+			i = routeTable.erase(i);
+		}
+		else {
+			i++;
 		}
 	}
+	expireBulkLookups(now);
+	expireHotKeys(now);
+}
 
-	if(!fileNameLst.isEmpty()) {
-		qDebug() << "Found files!!!" << endl;
-		QVariantMap searchReplyMap;
-		searchReplyMap.insert("Dest", dest);
-		searchReplyMap.insert("Origin", originID);
-		searchReplyMap.insert("SearchReply", searchStr);
-		searchReplyMap.insert("MatchNames", fileNameLst);
-		searchReplyMap.insert("MatchIDs", fileIdList);
-		sendPointToPoint(searchReplyMap);
+
+// Drop cached key locations past their TTL and lookup counts of keys that went cold. A
+// key is only forgotten once a new push to its path would be allowed anyway
+void MessageSender::expireHotKeys(qint64 now) {
+	for (auto i = lookupCache.begin(); i != lookupCache.end();) {
+		if (i.value().second <= now) {
+			i = lookupCache.erase(i);
+		}
+		else {
+			i++;
+		}
 	}
-	else {
-		qDebug() << "No results found here" << endl;
+	for (auto i = keyHeat.begin(); i != keyHeat.end();) {
+		double rate = i.value().rate * qExp(-(now - i.value().updated) / hotKeyWindow);
+		if (rate < coldKeyRate && now - i.value().lastPush >= lookupCacheTtl / 2) {
+			i = keyHeat.erase(i);
+		}
+		else {
+			i++;
+		}
 	}
 }
 
-// Protocol for handling find successor request
-void MessageSender::handleFindSuccessor(QVariantMap receivedMap) {
-	if (receivedMap.keys().size() == 1 && receivedMap["updateNode"].toInt() == successor.first || receivedMap["updateNode"].toInt() == nodeID) {
-		QVariantMap collision;
-		collision.insert("collision", 1);
-		socket->writeDatagram(getSerialized(collision), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
-		return;
-	}
-	if (receivedMap.contains("fileNode") && receivedMap["updateNode"].toInt() == nodeID) {
-		receivedMap.insert("match", 1);
-		socket->writeDatagram(getSerialized(receivedMap), QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
 
-	}
-	if (findSuccessor(receivedMap["updateNode"].toInt())) {
-			receivedMap.insert("successorID", successor.first);
-			receivedMap.insert("successorAddress", successor.second.first.toIPv4Address());
-			receivedMap.insert("successorPort", successor.second.second);
-			QByteArray newNodeSuccessorMsg = getSerialized(receivedMap);
-			socket->writeDatagram(newNodeSuccessorMsg, QHostAddress(receivedMap["originAddress"].toInt()), receivedMap["originPort"].toInt());
-			return;
+// Give up on bulk lookups whose remaining replies were lost, and report how far they got.
+// The keys that found an owner have had their items delivered already
+void MessageSender::expireBulkLookups(qint64 now) {
+	for (auto i = pendingBulkLookups.begin(); i != pendingBulkLookups.end();) {
+		if (i.value()["deadline"].toLongLong() > now) {
+			i++;
+			continue;
 		}
-	else {
-		receivedMap.remove("findSuccessor");
-		receivedMap.insert("findClosestPredecessor", 1);
-		QByteArray findClosestPredMsg = getSerialized(receivedMap);
-		socket->writeDatagram(findClosestPredMsg, successor.second.first, successor.second.second);
-		return;
+		int keyCount = i.value()["keyCount"].toInt();
+		int unresolved = i.value()["payloads"].toMap().size();
+		qDebug() << "Bulk lookup " << i.key() << " (" << i.value()["purpose"].toString() << ") timed out with "
+			<< QString::number(keyCount - unresolved) << " of " << QString::number(keyCount) << " keys delivered";
+		metrics.count("peerster_bulk_lookups_expired_total");
+		metrics.count("peerster_bulk_lookup_keys_unresolved_total", unresolved);
+		i = pendingBulkLookups.erase(i);
 	}
 }
 
 
-// Protocol for handling received rumor message
-void MessageSender::handleRumorMessage(QVariantMap receivedMap, QHostAddress *senderAddress, quint16 *senderPort) {
-	QString origin = receivedMap["Origin"].toString();
-	qDebug() << "is RUMOR from " << origin << endl;
-	int seqNo = receivedMap["SeqNo"].toInt();
-	QString key = origin + receivedMap["SeqNo"].toString();
-	qDebug() << "Key is " << key << endl;
+// Status vector: for every origin, the next SeqNo we are missing
+QVariantMap MessageSender::createStatusMessage() {
+	QVariantMap want;
+	for (auto i = rumorOrigins.begin(); i != rumorOrigins.end(); i++) {
+		want.insert(i.key(), i.value().contiguous + 1);
+	}
+	QVariantMap statusMap;
+	statusMap.insert("Want", want);
+	return statusMap;
+}
 
 
-	// Add LastIP and LastPort Keys
-	quint32 LastIP = senderAddress->toIPv4Address();
-	quint16 LastPort = *senderPort;
-	receivedMap.insert("LastIP", LastIP);
-	receivedMap.insert("LastPort", LastPort);
+// Compare a neighbor's status vector with ours. Send it the rumors it is missing that we
+// still have, and our own status if it has rumors we are missing. Equal vectors end the
+// exchange, so steady state costs one status message per neighbor per round
+void MessageSender::handleStatusMessage(QVariantMap receivedMap, QHostAddress *senderAddress, quint16 *senderPort) {
+	QVariantMap theirWant = receivedMap["Want"].toMap();
+
+	int pushed = 0;
+	for (auto i = rumorOrigins.begin(); i != rumorOrigins.end() && pushed < maxRumorPush; i++) {
+		quint32 theirNext = theirWant.contains(i.key()) ? theirWant[i.key()].toUInt() : 1;
+		for (quint32 seq = theirNext; seq <= i.value().contiguous && pushed < maxRumorPush; seq++) {
+			QVariantMap *body = rumorBodies.object(i.key() + QString::number(seq));
+			if (!body) continue;
+			transport->send(getSerialized(*body), *senderAddress, *senderPort);
+			pushed++;
+		}
+	}
 
-	// If new msg then start mongering with random neighbor & send status
-	if(!msgMap.contains(key)) {
+	for (auto origin: theirWant.keys()) {
+		if (theirWant[origin].toUInt() > rumorOrigins.value(origin).contiguous + 1) {
+			transport->send(getSerialized(createStatusMessage()), *senderAddress, *senderPort);
+			return;
+		}
+	}
+}
 
-		// Add msg to msgMap
-		msgMap.insert(key, receivedMap);
 
-		// If it is a chat message then display the text
-		if(receivedMap.contains("ChatText")) {
+// Anti-entropy round: send our status vector to gossipFanout distinct random neighbors
+void MessageSender::antiEntropy() {
+	if (peerLst.isEmpty()) return;
+	QByteArray statusMsg = getSerialized(createStatusMessage());
+	for (auto neighbor: getNeighbors(gossipFanout)) {
+		transport->send(statusMsg, neighbor.getAddress(), neighbor.getPort());
+	}
+}
 
-			QString msg = receivedMap["ChatText"].toString();
-			// chat->getTextView()->append(msg);
 
-			qDebug() << "new chat message: " << key << " " << msg << endl;
-		}
-		else {
-			qDebug() << "Is a route rumor message " << endl;
+// Mark origin's rumor seqNo as seen. Returns false if we saw it before or it is not a rumor
+bool MessageSender::recordRumor(QString origin, quint32 seqNo) {
+	if (origin.isEmpty()) return false;
+	RumorOrigin &state = rumorOrigins[origin];
+	if (seqNo <= state.contiguous || state.window.contains(seqNo)) {
+		return false;
+	}
+
+	// Too far ahead. Give up on the oldest gaps to keep the window bounded
+	if (seqNo > state.contiguous + rumorWindow) {
+		state.contiguous = seqNo - rumorWindow;
+		for (auto seen: state.window.toList()) {
+			if (seen <= state.contiguous) state.window.remove(seen);
 		}
+	}
 
-		// Start mongering if noForward flag is NOT set
-		QByteArray byteArrayToSender;
-		Peer neighbor = getNeighbor();
-		int tempPort = neighbor.getPort();
-		QHostAddress address = neighbor.getAddress();
-		byteArrayToSender = getSerialized(receivedMap);
-		socket->writeDatagram(byteArrayToSender, address, tempPort);
+	state.window.insert(seqNo);
+	while (state.window.remove(state.contiguous + 1)) {
+		state.contiguous++;
 	}
+	return true;
 }
 
 
 // Protocol for handling block reply messages
 void MessageSender::handleBlockReplyMessage(QVariantMap receivedMap, QString senderOrigin) {
-	qDebug() << "IS BLOCK REPLY!!!" << endl;
+	// Remember what we were waiting for, so a result that comes back after the download
+	// moved on or restarted is dropped
+	receivedMap.insert("ExpectedHash", expectedBlock());
+	receivedMap.insert("Transfer", downloadTransfer);
+
+	// Decompressing and hashing happen on a worker. The result comes back to
+	// finishBlockReply on this thread, which is the only one that touches our tables
+	if (workers) {
+		workers->start(new BlockVerifyTask(this, receivedMap, senderOrigin));
+		return;
+	}
+	finishBlockReply(verifyBlockReply(receivedMap), senderOrigin);
+}
+
+
+// Undo the compression the sender picked and check the block against its hash, which is
+// over the uncompressed bytes. Touches no node state, so it runs on any thread
+QVariantMap MessageSender::verifyBlockReply(QVariantMap map) {
+	QByteArray data = map["Data"].toByteArray();
+	int wireBytes = data.size();
+	qint64 codecNanos = map["CodecNanos"].toLongLong();
+	if (map["Codec"].toString() == "qz") {
+		QElapsedTimer codecTimer;
+		codecTimer.start();
+		data = qUncompress(data);
+		codecNanos += codecTimer.nsecsElapsed();
+	}
+	map.insert("Data", data);
+	map.insert("WireBytes", wireBytes);
+	map.insert("CodecNanos", codecNanos);
+	map.insert("Valid", QCA::Hash("sha1").hash(data).toByteArray() == map["BlockReply"].toByteArray());
+	return map;
+}
+
+
+// Hash of the block our download needs next: the metafile until it arrived, then the head
+// of fileReceiving. Empty when no download is running
+QByteArray MessageSender::expectedBlock() {
+	return fileReceiving.isEmpty() ? pendingBlockRequest : fileReceiving.left(20);
+}
+
+
+// Start downloading the file whose metafile hashes to metaHash. Replies still on their way
+// for an earlier download are dropped
+void MessageSender::beginDownload(QByteArray metaHash) {
+	downloadTransfer++;
+	fileReceiving.clear();
+	pendingBlockRequest = metaHash;
+}
+
+
+// Slot for a block reply that verifyBlockReply has looked at. Store it and ask for the next
+void MessageSender::finishBlockReply(QVariantMap receivedMap, QString senderOrigin) {
 	QByteArray hashVal = receivedMap["BlockReply"].toByteArray();
+	if (receivedMap["Transfer"].toUInt() != downloadTransfer || receivedMap["ExpectedHash"].toByteArray() != hashVal
+		|| hashVal != expectedBlock()) {
+		TRACE(TraceDebug, TraceBlockReplyDropped, nodeID, traceHash(hashVal), receivedMap["Transfer"].toUInt(), downloadTransfer);
+		metrics.count("peerster_block_replies_dropped_total");
+		return;
+	}
 	QByteArray receivedData = receivedMap["Data"].toByteArray();
+	int wireBytes = receivedMap["WireBytes"].toInt();
+	qint64 codecNanos = receivedMap["CodecNanos"].toLongLong();
 
-	qDebug() << "DATA RECEIVED! " << receivedData << endl;
-	qDebug() << "HASH RECEIVED! " << hashVal.toHex() << endl;
-	QByteArray dataHash = QCA::Hash("sha1").hash(receivedData).toByteArray();
+	TRACE(TraceDebug, TraceBlockReply, nodeID, receivedData.size(), wireBytes, receivedMap["Valid"].toBool());
+	if(receivedMap["Valid"].toBool()) {
+		if (hashVal == pendingBlockRequest) {
+			pendingBlockRequest.clear();
+		}
+		// A metafile starts a new transfer
+		if(fileReceiving.isEmpty()) {
+			downloadStats = TransferStats();
+		}
+		downloadStats.blocks++;
+		downloadStats.rawBytes += receivedData.size();
+		metrics.count("peerster_blocks_downloaded_total");
+		metrics.count("peerster_block_bytes_downloaded_total", receivedData.size());
+		downloadStats.wireBytes += wireBytes;
+		downloadStats.codecNanos += codecNanos;
 
-	qDebug() << "Data hash! " << dataHash.toHex() << endl;
-	if(QCA::Hash("sha1").hash(receivedData).toByteArray() == hashVal) {
-		qDebug() << "GOOD MESSAGE" << endl;
 		if(fileReceiving.isEmpty()) {
-			qDebug() << "is a metafile" << endl;
 			fileMetadata.insert(hashVal, receivedData);
 			fileReceiving = receivedData;
 			QVariantMap blockRequest = createBlockRequest(senderOrigin, originID);
@@ -1187,24 +4372,20 @@ void MessageSender::handleBlockReplyMessage(QVariantMap receivedMap, QString sen
 			// else {
 			// 	qDebug() << "Dup data message" << endl;
 			// }
-			qDebug() << "is file data" << endl;
-			qDebug() << "data received: " << receivedData.toHex() << endl;
 			fileReceiving.remove(0, 20);
-			if(fileHash.contains(hashVal)) {
-				QVariantList hashValList;
-				hashValList.append(fileHash[hashVal].toByteArray());
-				hashValList.append(receivedData);
-				fileHash[hashVal] = hashValList;
-			}
-			else{
-				fileHash.insert(hashVal, receivedData);
-			}
+			storeBlock(hashVal, receivedData);
 
 			// Request next 20 if possible else reset value of requesting file to null
 			if(!fileReceiving.isEmpty()) {
 				QVariantMap blockRequest = createBlockRequest(senderOrigin, originID);
 				sendPointToPoint(blockRequest);
 			}
+			else {
+				double ratio = downloadStats.wireBytes ? (double)downloadStats.rawBytes / downloadStats.wireBytes : 1;
+				qDebug() << "Transfer complete: " << downloadStats.blocks << " blocks, " << downloadStats.rawBytes
+					<< " bytes, " << downloadStats.wireBytes << " on the wire, compression ratio " << ratio
+					<< ", codec cpu " << downloadStats.codecNanos / 1000000.0 << " ms";
+			}
 		}
 
 
@@ -1215,47 +4396,97 @@ void MessageSender::handleBlockReplyMessage(QVariantMap receivedMap, QString sen
 }
 
 
+// Add block to fileHash under hashVal. Keys that collide (see README) keep a list of every
+// distinct block, which buildBlockReply searches for the one matching the requested hash
+void MessageSender::storeBlock(QByteArray hashVal, QByteArray block) {
+	if (!fileHash.contains(hashVal)) {
+		fileHash.insert(hashVal, block);
+		return;
+	}
+	QVariantList candidates = fileHash[hashVal].toList();
+	if (candidates.isEmpty()) {
+		candidates.append(fileHash[hashVal]);
+	}
+	if (candidates.contains(block)) return;
+	candidates.append(block);
+	fileHash[hashVal] = candidates;
+}
+
+
 // Protocol for handling block request messages
 void MessageSender::handleBlockRequestMessage(QVariantMap receivedMap, QString senderOrigin) {
-	qDebug() << "IS BLOCK REQUEST!!!" << endl;
 	QByteArray hashVal = receivedMap["BlockRequest"].toByteArray();
-	qDebug() << "hashVal " << hashVal.toHex() << endl;
+	QStringList acceptCodecs = receivedMap["AcceptCodecs"].toStringList();
 	if(fileMetadata.contains(hashVal)) {
-		qDebug() << "is meta" << endl;
 		QVariantMap fileMeta = fileMetadata[hashVal].toMap();
-		qDebug() << "file requested is " << fileMeta["fileName"].toString();
-		QVariantMap blockReply = createBlockReply(senderOrigin, originID, hashVal, fileMeta["metaFile"].toByteArray());
+		TRACE(TraceDebug, TraceBlockRequest, nodeID, 1, fileMeta["metaFile"].toByteArray().size(), 0);
 
 		// Support for large files
+		QVariantMap extra;
 		if(fileMeta.contains("inception")) {
-			blockReply.insert("inception", fileMeta["inception"].toInt());
+			extra.insert("inception", fileMeta["inception"].toInt());
 		}
-
-		sendPointToPoint(blockReply);
+		serveBlock(senderOrigin, hashVal, QVariantList() << fileMeta["metaFile"], acceptCodecs, extra);
 	}
 	else if(fileHash.contains(hashVal)) {
-		qDebug() << "is block request" << endl;
-		QVariantList hashValList = fileHash[hashVal].toList();
-		QByteArray dataToSend;
-		if(hashValList.isEmpty()) {
-			dataToSend = fileHash[hashVal].toByteArray();
+		// Colliding blocks are kept as a list. The worker finds the one with this hash
+		QVariantList candidates = fileHash[hashVal].toList();
+		if(candidates.isEmpty()) {
+			candidates.append(fileHash[hashVal]);
 		}
-		else {
-			for(int i=0; i<hashValList.size(); i++) {
-				dataToSend = hashValList[i].toByteArray();
+		TRACE(TraceDebug, TraceBlockRequest, nodeID, 2, candidates[0].toByteArray().size(), candidates.size());
+		serveBlock(senderOrigin, hashVal, candidates, acceptCodecs, QVariantMap());
+	}
+	else {
+		TRACE(TraceDebug, TraceBlockRequest, nodeID, 0, 0, 0);
+	}
+}
 
-				if(QCA::Hash("sha1").hash(dataToSend).toByteArray() == hashVal) {
-					break;
-				}
-			}
-		}
 
-		QVariantMap blockReply = createBlockReply(senderOrigin, originID, hashVal, dataToSend);
-		sendPointToPoint(blockReply);
+// Build, compress and serialize a block reply on a worker when we have them, then send it
+// from this thread through sendServedBlock
+void MessageSender::serveBlock(QString dest, QByteArray hashVal, QVariantList candidates, QStringList acceptCodecs, QVariantMap extra) {
+	if (workers) {
+		workers->start(new BlockServeTask(this, dest, originID, hashVal, candidates, acceptCodecs, extra));
+		return;
 	}
-	else {
-		qDebug() << "is nothing" << endl;
+	int dataBytes = 0;
+	QByteArray message = serialize(buildBlockReply(dest, originID, hashVal, candidates, acceptCodecs, extra, dataBytes));
+	sendServedBlock(dest, message, dataBytes);
+}
+
+
+// Reply carrying whichever candidate matches hashVal, or the first one if only one is
+// given. dataBytes is set to its uncompressed size. Touches no node state
+QVariantMap MessageSender::buildBlockReply(QString dest, QString origin, QByteArray hashVal, QVariantList candidates, QStringList acceptCodecs, QVariantMap extra, int &dataBytes) {
+	QByteArray data = candidates.isEmpty() ? QByteArray() : candidates[0].toByteArray();
+	for (int i = 0; candidates.size() > 1 && i < candidates.size(); i++) {
+		data = candidates[i].toByteArray();
+		if (QCA::Hash("sha1").hash(data).toByteArray() == hashVal) break;
+	}
+	dataBytes = data.size();
+
+	QVariantMap blockReply = createBlockReply(dest, origin, hashVal, data, acceptCodecs);
+	for (auto i = extra.begin(); i != extra.end(); i++) {
+		blockReply.insert(i.key(), i.value());
+	}
+	return blockReply;
+}
+
+
+// Slot for a serialized block reply ready to go to dest over the reliable transport
+void MessageSender::sendServedBlock(QString dest, QByteArray message, int dataBytes) {
+	QPair<QHostAddress, quint16> nextHop;
+	if (!lookupRoute(dest, nextHop)) {
+		qDebug() << "cant send p2p :(" << endl;
+		return;
 	}
+	blockTransport->send(message, nextHop.first, nextHop.second);
+	int typeIndex = messageTypeIndex("BlockReply");
+	messagesSent[typeIndex]++;
+	messageBytesSent[typeIndex] += message.size();
+	metrics.count("peerster_blocks_served_total");
+	metrics.count("peerster_block_bytes_served_total", dataBytes);
 }
 
 
@@ -1279,21 +4510,34 @@ void MessageSender::handleSearchReplyMessage(QVariantMap receivedMap) {
 				fileInfo.append(fileIDs[i].toByteArray());
 				searchResultsMap.insert(file, fileInfo);
 
-				chat->getFileSearchResultsList()->addItem(file);
+				if (chat) chat->getFileSearchResultsList()->addItem(file);
 			}
 		}
 	}
 }
 
 
-// Create block reply message
-QVariantMap MessageSender::createBlockReply(QString dest, QString origin, QByteArray dataHash, QByteArray data) {
+// Create block reply message. Data is compressed if the requester accepts one of our codecs
+// and compression actually makes it smaller
+QVariantMap MessageSender::createBlockReply(QString dest, QString origin, QByteArray dataHash, QByteArray data, QStringList acceptCodecs) {
 	QVariantMap blockReplyMap;
 	blockReplyMap.insert("Dest", dest);
 	blockReplyMap.insert("Origin", origin);
 	blockReplyMap.insert("BlockReply", dataHash);
 	blockReplyMap.insert("Data", data);
 
+	if (acceptCodecs.contains("qz") && data.size() >= minCompressBytes) {
+		QElapsedTimer codecTimer;
+		codecTimer.start();
+		QByteArray compressed = qCompress(data, 1);
+		qint64 codecNanos = codecTimer.nsecsElapsed();
+		if (compressed.size() < data.size()) {
+			blockReplyMap.insert("Codec", "qz");
+			blockReplyMap.insert("CodecNanos", codecNanos);
+			blockReplyMap.insert("Data", compressed);
+		}
+	}
+
 	return blockReplyMap;
 }
 
@@ -1306,6 +4550,7 @@ QVariantMap MessageSender::createBlockRequest(QString dest, QString origin) {
 	blockRequestMap.insert("Dest", dest);
 	blockRequestMap.insert("Origin", origin);
 	blockRequestMap.insert("BlockRequest", requestData);
+	blockRequestMap.insert("AcceptCodecs", QStringList() << "qz");
 
 	return blockRequestMap;
 }
@@ -1326,6 +4571,7 @@ QVariantMap MessageSender::createBlockRequest(QString dest, QString origin, QByt
 	blockRequestMap.insert("Dest", dest);
 	blockRequestMap.insert("Origin", origin);
 	blockRequestMap.insert("BlockRequest", dataHash);
+	blockRequestMap.insert("AcceptCodecs", QStringList() << "qz");
 
 	return blockRequestMap;
 }
@@ -1333,44 +4579,142 @@ QVariantMap MessageSender::createBlockRequest(QString dest, QString origin, QByt
 // Find the successor for the given ID
 bool MessageSender::findSuccessor(quint32 newNode) {
 	// The node's successor is this current node's successor
-	if (successor.first != 257 && ((nodeID < newNode && newNode < successor.first) || (nodeID < newNode && newNode > successor.first && successor.first < nodeID)
+	if (successor.first != RING_NONE && ((nodeID < newNode && newNode < successor.first) || (nodeID < newNode && newNode > successor.first && successor.first < nodeID)
 	|| (nodeID > newNode && newNode < successor.first && nodeID > successor.first))) {
-		qDebug() << "At node " << QString::number(nodeID) << ", " << QString::number(newNode) << "'s successor is " << QString::number(successor.first);
+		TRACE(TraceDebug, TraceFindSuccessor, nodeID, newNode, successor.first, 1);
 		return true;
 	}
-	qDebug() << "At node " << QString::number(nodeID) << ", " << QString::number(newNode) << "'s successor is NOT " << QString::number(successor.first);
+	TRACE(TraceDebug, TraceFindSuccessor, nodeID, newNode, successor.first, 0);
 	return false;
 }
 
+// Key of the finger whose interval [start, end) holds id, farthest finger first. If the
+// failure detector emptied that finger, the next lower finger that is still live. Empty if
+// no interval holds id or no finger at or below it is live
+QByteArray MessageSender::findSearchInterval(quint32 id) {
+	int offset = RING_SIZE / 2;
+	bool found = false;
+	for (int i = 0; i < RING_BITS; i++) {
+		QByteArray key = QByteArray::number((nodeID + offset) % RING_SIZE);
+		quint32 start = (*fingerTable)[key][0].toInt();
+		quint32 end = (*fingerTable)[key][1].toInt();
+		if ((start <= id && id < end) || (start <= id && id > end && end < start)
+		|| (start >= id && id < end && end < start)) {
+			found = true;
+		}
+		if (found && (*fingerTable)[key][2].toInt() != RING_NONE) {
+			return key;
+		}
+		offset /= 2;
+	}
+	return QByteArray();
+}
+
 QByteArray MessageSender::findClosestPredecessor(quint32 newNode) {
-	int i = 128;
+	int i = RING_SIZE / 2;
+	int steps = 0;
 	while (i >= 1) {
-		QByteArray fingerKey = QByteArray::number((nodeID + i) % 256);
-		qDebug() << fingerKey;
+		QByteArray fingerKey = QByteArray::number((nodeID + i) % RING_SIZE);
 		quint32 successorID = (*fingerTable)[fingerKey][2].toInt();
-		if (successorID != 257 && ((nodeID < successorID && successorID < newNode) || (nodeID < successorID && successorID > newNode && newNode < nodeID)
+		steps++;
+		if (successorID != RING_NONE && ((nodeID < successorID && successorID < newNode) || (nodeID < successorID && successorID > newNode && newNode < nodeID)
 		|| (nodeID > successorID && successorID < newNode && newNode < nodeID))) {
+			TRACE(TraceDebug, TraceClosestPredecessor, nodeID, newNode, successorID, steps);
 			return fingerKey;
 		}
 		i /= 2;
 	}
+	TRACE(TraceDebug, TraceClosestPredecessor, nodeID, newNode, nodeID, steps);
 	return QByteArray::number(nodeID);
 }
 
 
-// Retrieve a random neighbor or 1 if current node has no peers
+// Retrieve a random neighbor. Callers check that peerLst is not empty
 Peer MessageSender::getNeighbor() {
-	int size = peerLst.size();
-	qint64 seedVal = QDateTime::currentMSecsSinceEpoch();
-	qsrand(seedVal);
-	int randVal = qrand()%size;
+	int randVal = nextRandom() % peerLst.size();
 	qDebug() << "My Neighbor is "<< peerLst[randVal].getHostName()<< " " << peerLst[randVal].getPort() << endl;
 	return peerLst[randVal];
 }
 
 
+// Up to count distinct random neighbors, drawn by a partial Fisher-Yates shuffle
+QList<Peer> MessageSender::getNeighbors(int count) {
+	QVector<int> order(peerLst.size());
+	for (int i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	QList<Peer> neighbors;
+	for (int i = 0; i < count && i < order.size(); i++) {
+		int pick = i + nextRandom() % (order.size() - i);
+		qSwap(order[i], order[pick]);
+		neighbors.append(peerLst[order[i]]);
+	}
+	return neighbors;
+}
+
+
+// xorshift64* step. Seeded once in the constructor, unlike qrand which we reseeded per call
+quint32 MessageSender::nextRandom() {
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return (quint32)((rngState * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+
 // Method to serialize text sent by a peerster node
 QByteArray MessageSender::getSerialized(QVariantMap map) {
+	QByteArray out = serialize(map);
+
+	// Nearly every message is serialized right before it is sent, so count it here
+	int typeIndex = messageTypeIndex(map);
+	messagesSent[typeIndex]++;
+	messageBytesSent[typeIndex] += out.size();
+	TRACE(TraceDebug, TraceSend, nodeID, typeIndex, out.size(), 0);
+	return out;
+}
+
+
+// BlockServeTask constructor. Everything the job needs is copied in; implicitly shared data
+// is safe to hand between threads this way
+BlockServeTask::BlockServeTask(MessageSender *node, QString dest, QString origin, QByteArray hashVal, QVariantList candidates, QStringList acceptCodecs, QVariantMap extra)
+{
+	this->node = node;
+	this->dest = dest;
+	this->origin = origin;
+	this->hashVal = hashVal;
+	this->candidates = candidates;
+	this->acceptCodecs = acceptCodecs;
+	this->extra = extra;
+}
+
+
+void BlockServeTask::run()
+{
+	int dataBytes = 0;
+	QByteArray message = MessageSender::serialize(MessageSender::buildBlockReply(dest, origin, hashVal, candidates, acceptCodecs, extra, dataBytes));
+	QMetaObject::invokeMethod(node, "sendServedBlock", Qt::QueuedConnection, Q_ARG(QString, dest),
+		Q_ARG(QByteArray, message), Q_ARG(int, dataBytes));
+}
+
+
+BlockVerifyTask::BlockVerifyTask(MessageSender *node, QVariantMap map, QString senderOrigin)
+{
+	this->node = node;
+	this->map = map;
+	this->senderOrigin = senderOrigin;
+}
+
+
+void BlockVerifyTask::run()
+{
+	QMetaObject::invokeMethod(node, "finishBlockReply", Qt::QueuedConnection,
+		Q_ARG(QVariantMap, MessageSender::verifyBlockReply(map)), Q_ARG(QString, senderOrigin));
+}
+
+
+// The wire form of a message. Safe on any thread
+QByteArray MessageSender::serialize(QVariantMap map) {
 	QByteArray out;
 	QDataStream stream(&out, QIODevice::WriteOnly);
 	stream << map;
@@ -1424,12 +4768,14 @@ void MessageSender::joinChord(QString input) {
 		quint16 portNum = tempStr[1].toUShort(&portTest, 10);
 		if(!portTest) return;
 
+		// Our virtual nodes move to the same ring
+		for (auto vnode: virtualNodes) {
+			vnode->joinChord(input);
+		}
+
 		// Check if the host is an ip address
 		if(ipTest.setAddress(tempStr[0])) {
-			QVariantMap newNodeMap;
-			newNodeMap.insert("updateNode", nodeID);
-			QByteArray newNodeMsg = getSerialized(newNodeMap);
-			socket->writeDatagram(newNodeMsg, ipTest, portNum);
+			requestJoin(ipTest, portNum);
 			return;
 		}
 		// Assume host is a host name and do a lookup
@@ -1442,6 +4788,7 @@ void MessageSender::joinChord(QString input) {
 }
 
 void MessageSender::makeStoredFileGui() {
+	if (!chat) return;
 	qDebug() << "Updating list of files GUI" << endl;
 	chat->getChordFileStore()->clear();
 	qDebug() << (*fileTable);
@@ -1465,11 +4812,17 @@ void MessageSender::downloadFile() {
 	qDebug() << "Downloading a file. targetNodeID: " << targetNodeID << " HashVal " << hashString << endl;
 
 	// Create block request
+	beginDownload(hashVal);
 	QVariantMap blockRequest = createBlockRequest(targetNodeID, originID, hashVal);
-	QByteArray serialBlockRequest = getSerialized(blockRequest);
 
-	// Send block request to all peers
-	sendToPeers(serialBlockRequest);
+	// Go straight to the target if we know the way, else ask all peers
+	QPair<QHostAddress, quint16> nextHop;
+	if (lookupRoute(targetNodeID, nextHop)) {
+		sendRouted(blockRequest, nextHop);
+	}
+	else {
+		sendToPeers(getSerialized(blockRequest));
+	}
 }
 
 
@@ -1490,13 +4843,82 @@ void MessageSender::searchChordFile()
  	MultiLineEdit *searchFileLine = chat->getSearchFileLine();
  	QString fileID = searchFileLine->toPlainText();
  	searchFileLine->clear();
- 	QVariantMap fileSearch;
- 	fileSearch.insert("fileSearch", nodeID);
- 	fileSearch.insert("updateNode", fileID.toInt());
- 	socket->writeDatagram(getSerialized(fileSearch), successor.second.first, successor.second.second);
+ 	searchFile(fileID.toInt(), QVariantMap());
  }
 
 
+// Look up which node stores fileID. tags ride along with the search and come back in the
+// result
+void MessageSender::searchFile(quint32 fileID, QVariantMap tags) {
+	if (successor.first == RING_NONE) {
+		qDebug() << "No successor to search through for " << QString::number(fileID);
+		return;
+	}
+	QVariantMap fileSearch = tags;
+	fileSearch.insert("fileSearch", nodeID);
+	fileSearch.insert("updateNode", fileID);
+	fileSearch.insert("lookupStart", ProtocolTimer::now());
+	fileSearch.insert("TTL", lookupTtl);
+	fileSearch.insert("Hops", 0);
+	if (traceLookups) {
+		quint32 lookupID = nextRandom();
+		fileSearch.insert("LookupID", lookupID);
+		lookupTraces.insert(lookupID, new QMap<int, quint32>());
+	}
+	transport->send(getSerialized(fileSearch), successor.second.first, successor.second.second);
+}
+
+
+// Hops a finished lookup took: the first send to our successor plus every forward, which
+// is what Hops counts. Metrics, traces and the simulator all use this
+int MessageSender::lookupHops(QVariantMap result) {
+	return result["Hops"].toInt() + 1;
+}
+
+
+// Log the path a traced lookup took, as reported by the nodes on it. A hop whose report
+// has not arrived yet shows as ?
+void MessageSender::finishLookupTrace(quint32 lookupID, QVariantMap result) {
+	QMap<int, quint32> *reported = lookupTraces.take(lookupID);
+	if (!reported) return;
+	QMap<int, quint32> hops = *reported;
+	delete reported;
+	int pathLength = lookupHops(result);
+	QStringList path;
+	path << QString::number(nodeID);
+	for (int hop = 1; hop <= pathLength; hop++) {
+		path << (hops.contains(hop) ? QString::number(hops[hop]) : QString("?"));
+		if (hops.contains(hop)) TRACE(TraceInfo, TraceLookupHop, nodeID, lookupID, hop, hops[hop]);
+	}
+	qDebug() << "Lookup for " << QString::number(result["updateNode"].toInt()) << " took " << QString::number(pathLength) << " hops: " << path.join(" -> ");
+}
+
+
+quint32 MessageSender::getNodeID() {
+	return nodeID;
+}
+
+
+int MessageSender::getSuccessorID() {
+	return successor.first;
+}
+
+
+int MessageSender::getPredecessorID() {
+	return predecessor.first;
+}
+
+
+// File IDs stored at this node
+QList<quint32> MessageSender::storedFileIDs() {
+	QList<quint32> ids;
+	for (auto key: fileTable->keys()) {
+		ids.append(key.toUInt());
+	}
+	return ids;
+}
+
+
 // Slot returning result of the host lookup
 void MessageSender::peerLookup(QHostInfo host) {
 
@@ -1541,11 +4963,253 @@ void MessageSender::chordLookup(QHostInfo host) {
 		qDebug() << "PORTNUM " << portNum << endl;
 
 		// Send request to get your successor
+		requestJoin(hostAddress, portNum);
+	}
+}
+
+
+// Join the chord known to address:port. With -join-samples, first ask the owners of a few
+// random positions how loaded they are, and only join once we picked an ID that splits the
+// busiest of them
+void MessageSender::requestJoin(QHostAddress address, quint16 port) {
+	if (joinSamples == 0) {
 		QVariantMap newNodeMap;
 		newNodeMap.insert("updateNode", nodeID);
-		QByteArray newNodeMsg = getSerialized(newNodeMap);
-		socket->writeDatagram(newNodeMsg, hostAddress, portNum);
+		newNodeMap.insert("join", 1);
+		transport->send(getSerialized(newNodeMap), address, port);
+		return;
+	}
+
+	joinAddress = address;
+	joinPort = port;
+	loadReports.clear();
+	for (int i = 0; i < joinSamples; i++) {
+		QVariantMap probeMap;
+		probeMap.insert("loadProbe", nextRandom() % RING_SIZE);
+		transport->send(getSerialized(probeMap), address, port);
+	}
+	joinProbeTimer->start(joinProbeTimeout);
+}
+
+
+// Report our load to a joining node if we own the probed position, else pass the probe on
+void MessageSender::handleLoadProbe(QVariantMap map) {
+	quint32 id = map["loadProbe"].toUInt();
+	if (!isResponsibleFor(id)) {
+		int hops = map["probeHops"].toInt() + 1;
+		if (hops > maxRouteHops) return;
+		map.insert("probeHops", hops);
+		routeToOwner(id, map);
+		return;
+	}
+
+	// Our range is (pred, nodeID]. Alone we own the whole ring
+	quint32 predID = predecessor.first == RING_NONE ? nodeID : predecessor.first;
+
+	// Keys we hold, as distances from the start of our range
+	QList<quint32> offsets;
+	for (auto key: fileTable->keys()) {
+		offsets.append((key.toUInt() - predID + RING_SIZE) % RING_SIZE);
+	}
+	for (auto keyword: keywordPostings.keys()) {
+		offsets.append((hashToRing(keyword.toUtf8()) - predID + RING_SIZE) % RING_SIZE);
+	}
+	qSort(offsets);
+
+	// Splitting at the median key leaves half the keys on each side. Without keys, halve
+	// the range. A joining node can't take our own ID or our predecessor's
+	quint32 rangeSize = predID == nodeID ? RING_SIZE : (nodeID - predID + RING_SIZE) % RING_SIZE;
+	quint32 splitOffset = offsets.isEmpty() ? rangeSize / 2 : offsets[(offsets.size() - 1) / 2];
+	if (splitOffset == 0 || splitOffset >= rangeSize) splitOffset = rangeSize / 2;
+
+	// The probe itself was counted in handleMessage like any other request
+	QVariantMap reportMap;
+	reportMap.insert("loadReport", id);
+	reportMap.insert("ownerID", nodeID);
+	reportMap.insert("keys", offsets.size());
+	reportMap.insert("requestRate", requestRate);
+	if (splitOffset > 0 && splitOffset < rangeSize) {
+		reportMap.insert("splitID", (predID + splitOffset) % RING_SIZE);
 	}
+	transport->send(getSerialized(reportMap), QHostAddress(map["originAddress"].toUInt()), map["originPort"].toUInt());
+}
+
+
+// Keep a load report. Finish early once every probe was answered
+void MessageSender::handleLoadReport(QVariantMap map) {
+	if (!joinProbeTimer->isActive()) return;
+	loadReports.append(map);
+	if (loadReports.size() >= joinSamples) {
+		joinProbeTimer->stop();
+		finishBalancedJoin();
+	}
+}
+
+
+// Take the split point of the busiest owner that reported, then join as usual. Keys and
+// request rate are in different units, so each is scaled by the largest reported
+void MessageSender::finishBalancedJoin() {
+	double maxKeys = 0;
+	double maxRequestRate = 0;
+	for (auto report: loadReports) {
+		maxKeys = qMax(maxKeys, report["keys"].toDouble());
+		maxRequestRate = qMax(maxRequestRate, report["requestRate"].toDouble());
+	}
+
+	double busiest = -1;
+	int splitID = -1;
+	QSet<quint32> owners;
+	for (auto report: loadReports) {
+		// Several probes can land on the same owner
+		quint32 owner = report["ownerID"].toUInt();
+		if (owners.contains(owner) || !report.contains("splitID")) continue;
+		owners.insert(owner);
+
+		double load = 0;
+		if (maxKeys > 0) load += joinKeyWeight * report["keys"].toDouble() / maxKeys;
+		if (maxRequestRate > 0) load += joinRequestWeight * report["requestRate"].toDouble() / maxRequestRate;
+		qDebug() << "Node " << QString::number(owner) << " holds " << report["keys"].toString() << " keys at "
+			<< QString::number(report["requestRate"].toDouble()) << " requests, load " << QString::number(load);
+		if (load > busiest) {
+			busiest = load;
+			splitID = report["splitID"].toInt();
+		}
+	}
+
+	if (splitID >= 0 && (quint32)splitID != nodeID) {
+		qDebug() << "Splitting the busiest range at " << QString::number(splitID);
+		adoptNodeID(splitID);
+	}
+	else {
+		qDebug() << "No usable load reports. Joining at our hashed ID";
+	}
+
+	QVariantMap newNodeMap;
+	newNodeMap.insert("updateNode", nodeID);
+	newNodeMap.insert("join", 1);
+	transport->send(getSerialized(newNodeMap), joinAddress, joinPort);
+}
+
+
+// Move to ring position id before joining. The finger table starts over from the new ID
+void MessageSender::adoptNodeID(quint32 id) {
+	nodeID = id % RING_SIZE;
+	updateNum = (nodeID + 1) % RING_SIZE;
+	entryNum = 1;
+	fingerTable->clear();
+	createFingerTable();
+	showRing();
+}
+
+
+// Answer a relayed block request from our cache. The reply names the holder the request
+// was for as its origin, so the requester keeps asking the holder and we keep intercepting
+bool MessageSender::answerFromBlockCache(QVariantMap map) {
+	QByteArray hashVal = map["BlockRequest"].toByteArray();
+	int *requests = blockRequestCounts.object(hashVal);
+	if (requests) {
+		(*requests)++;
+	}
+	else {
+		blockRequestCounts.insert(hashVal, new int(1));
+	}
+
+	QByteArray *data = blockCache.object(hashVal);
+	if (!data) return false;
+	TRACE(TraceDebug, TraceBlockCacheHit, nodeID, traceHash(hashVal), data->size(), 0);
+	sendPointToPoint(createBlockReply(map["Origin"].toString(), map["Dest"].toString(), hashVal, *data, map["AcceptCodecs"].toStringList()));
+	metrics.count("peerster_block_cache_hits_total");
+	metrics.count("peerster_block_bytes_served_total", data->size());
+	return true;
+}
+
+
+// Keep a copy of a relayed block that was asked for through us more than once. Only
+// blocks that match their hash are kept, so we never serve bad data for a holder
+void MessageSender::cacheRelayedBlock(QVariantMap map) {
+	QByteArray hashVal = map["BlockReply"].toByteArray();
+	int *requests = blockRequestCounts.object(hashVal);
+	if (!requests || *requests < popularBlockRequests || blockCache.contains(hashVal)) return;
+
+	QByteArray data = map["Data"].toByteArray();
+	if (map["Codec"].toString() == "qz") {
+		data = qUncompress(data);
+	}
+	if (data.isEmpty() || QCA::Hash("sha1").hash(data).toByteArray() != hashVal) return;
+	blockCache.insert(hashVal, new QByteArray(data), data.size());
+}
+
+
+// End a file search early if a hot key's owner pushed its location to us
+bool MessageSender::answerFromLookupCache(QVariantMap map) {
+	quint32 key = map["updateNode"].toUInt();
+	auto cached = lookupCache.find(key);
+	if (cached == lookupCache.end()) return false;
+	if (cached->second <= ProtocolTimer::now()) {
+		lookupCache.erase(cached);
+		return false;
+	}
+	TRACE(TraceDebug, TraceLookupCacheHit, nodeID, key, cached->first, 0);
+	map.insert("success", cached->first);
+	map.insert("cached", nodeID);
+	transport->send(getSerialized(map), QHostAddress(map["originAddress"].toInt()), map["originPort"].toInt());
+	return true;
+}
+
+
+// Count a lookup for a key we own. Once the key is hot, tell the last few nodes on the
+// lookup path where it lives, at most once per half TTL
+void MessageSender::pushHotKey(quint32 key, QVariantMap map) {
+	qint64 now = ProtocolTimer::now();
+	HotKey &heat = keyHeat[key];
+	heat.rate = heat.rate * qExp(-(now - heat.updated) / hotKeyWindow) + 1;
+	heat.updated = now;
+	if (heat.rate < hotKeyThreshold || now - heat.lastPush < lookupCacheTtl / 2) return;
+	heat.lastPush = now;
+
+	QVariantMap pushMap;
+	pushMap.insert("hotKey", key);
+	pushMap.insert("owner", nodeID);
+	pushMap.insert("ttl", lookupCacheTtl);
+	QByteArray pushMsg = getSerialized(pushMap);
+
+	QVariantList pathAddresses = map["pathAddresses"].toList();
+	QVariantList pathPorts = map["pathPorts"].toList();
+	for (int i = pathAddresses.size() - 1; i >= 0 && i >= pathAddresses.size() - hotKeyPushDepth; i--) {
+		transport->send(pushMsg, QHostAddress(pathAddresses[i].toUInt()), pathPorts[i].toUInt());
+	}
+	qDebug() << "Key " << QString::number(key) << " is hot. Cached along " << QString::number(qMin(pathAddresses.size(), hotKeyPushDepth)) << " hops";
+}
+
+
+// Count one handled request towards our request load, an exponentially decaying count over
+// about requestRateWindow
+void MessageSender::recordRequest() {
+	qint64 now = ProtocolTimer::now();
+	requestRate = requestRate * qExp(-(now - requestRateUpdated) / requestRateWindow) + 1;
+	requestRateUpdated = now;
+}
+
+
+// Slot to search the chord for files whose names contain all the entered words, as whole
+// words
+void MessageSender::searchKeywords() {
+	MultiLineEdit *fileSearchLine = chat->getFileSearchLine();
+	currentSearch = fileSearchLine->toPlainText();
+	fileSearchLine->clear();
+	chat->getFileSearchResultsList()->clear();
+	searchResultsMap.clear();
+
+	QStringList terms = fileNameTokens(currentSearch);
+	terms.removeDuplicates();
+	if (terms.isEmpty()) return;
+	qDebug() << "Searching the chord for " << terms;
+
+	QVariantMap queryMap;
+	queryMap.insert("keywordQuery", terms);
+	queryMap.insert("RouteOrigin", originID);
+	queryMap.insert("termIndex", 0);
+	handleKeywordQuery(queryMap);
 }
 
 
@@ -1557,6 +5221,7 @@ void MessageSender::startFileDownload(QListWidgetItem *listItem) {
 	QString dest = fileInfo[0].toString();
 	QByteArray metaFile = fileInfo[1].toByteArray();
 
+	beginDownload(metaFile);
 	QVariantMap blockRequestMap = createBlockRequest(dest, originID, metaFile);
 	sendPointToPoint(blockRequestMap);
 }
@@ -1571,10 +5236,9 @@ void MessageSender::openFileDialog() {
 void MessageSender::sendPointToPoint(QVariantMap map) {
 	QString dest = map["Dest"].toString();
 	qDebug() << "Sending p2p to " << dest << endl;
-	if(routeTable.contains(dest)) {
-		QPair<QHostAddress, quint16> routingInfo = routeTable.value(dest);
-		QByteArray byteArrayToSender= getSerialized(map);
-		socket->writeDatagram(byteArrayToSender, routingInfo.first, routingInfo.second);
+	QPair<QHostAddress, quint16> nextHop;
+	if(lookupRoute(dest, nextHop)) {
+		sendRouted(map, nextHop);
 	}
 	else {
 		qDebug() << "cant send p2p :(" << endl;
@@ -1582,76 +5246,90 @@ void MessageSender::sendPointToPoint(QVariantMap map) {
 }
 
 
+// Send a point to point message to its next hop. Block traffic goes through the reliable
+// transport, everything else as a plain datagram
+void MessageSender::sendRouted(QVariantMap map, QPair<QHostAddress, quint16> nextHop) {
+	QByteArray byteArrayToSender = getSerialized(map);
+	if (map.contains("BlockRequest") || map.contains("BlockReply")) {
+		if (map.contains("BlockRequest") && map["Origin"].toString() == originID) {
+			pendingBlockRequest = map["BlockRequest"].toByteArray();
+			pendingBlockHop = nextHop;
+		}
+		blockTransport->send(byteArrayToSender, nextHop.first, nextHop.second);
+	}
+	else {
+		transport->send(byteArrayToSender, nextHop.first, nextHop.second);
+	}
+}
+
+
 // Collect the metadata from the files in fileList
 void MessageSender::getFileMetadata(const QStringList &fileList) {
 	qDebug() << "GET METADATA!!!" << endl;
 	qDebug() << fileList << endl;
 	int size = fileList.size();
+	QVariantMap filePayloads;
+	QVariantMap keywordPayloads;
 	for(int i=0; i < size; i++) {
 		QCA::Hash shaHash("sha1");
 
 
 		QByteArray uploadHash = QCA::Hash("sha1").hash(fileList[i].toLatin1()).toByteArray();
-		QDataStream fileStream(uploadHash.right(2));
+		QDataStream fileStream(uploadHash.right(4));
 		fileStream.setByteOrder(QDataStream::BigEndian);
-		quint16 result;
+		quint32 result;
 		fileStream >> result;
-		quint32 fileID = result % 256;
+		quint32 fileID = result % RING_SIZE;
 
 		qDebug() << "Uploading " << fileList[i] << endl;
 		qDebug() << "File Hash is " << QString::number(fileID);
 
+		// Files are placed at their owners in one bulk lookup once all are hashed
 		QVariantMap fileMap;
 		QStringList tokens = fileList[i].split("/");
-		fileMap.insert("updateNode", fileID);
-		fileMap.insert("fileNode", nodeID);
+		fileMap.insert("fileID", fileID);
 		fileMap.insert("fileName", tokens.at(tokens.size() - 1));
-		socket->writeDatagram(getSerialized(fileMap), successor.second.first, successor.second.second);
-
-		// QFile file(fileList[i]);
-		// QByteArray output;
-	 //   if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-	 //       continue;
-	 //   }
-
-	 //   QDataStream in(&file);
-	 //   int bytesRead;
-	 //   int totalBytes = 0;
-	 //   char *dataStore = (char *)calloc(8000, 1);
-
-	 //   do {
-	 //   	bytesRead = in.readRawData(dataStore, 8000);
-	 //   	QByteArray hashVal = QCA::Hash("sha1").hash(dataStore).toByteArray();
-
-	 //   	// add hash and block to the fileHash table
-	 //   	if(fileHash.contains(hashVal)) {
-	 //   		QVariantList hashValList;
-	 //   		hashValList.append(fileHash[hashVal].toByteArray());
-	 //   		hashValList.append(dataStore);
-	 //   		fileHash[hashVal] = hashValList;
-	 //   	}
-	 //   	else {
-	 //   		fileHash[hashVal] = dataStore;
-	 //   	}
+		QVariantList fileItems = filePayloads[QString::number(fileID)].toList();
+		fileItems.append(fileMap);
+		filePayloads.insert(QString::number(fileID), fileItems);
+
+		// Hash the file into blocks so it can be served and found by keyword search
+		QFile file(fileList[i]);
+		if (!file.open(QIODevice::ReadOnly)) {
+			qDebug() << "Could not open " << fileList[i] << endl;
+			continue;
+		}
 
-	 //   	qDebug() << "Hashing " << hashVal.toHex() << endl << "TO" << fileHash[hashVal].toByteArray() << endl;
+		QByteArray output;
+		qint64 totalBytes = 0;
+		while (!file.atEnd()) {
+			QByteArray block = file.read(blockSize);
+			QByteArray hashVal = QCA::Hash("sha1").hash(block).toByteArray();
 
-	 //   	// Append to hash metafile
- 	//     	output.append(hashVal);
-	 //   	totalBytes += bytesRead;
-		// }
-		// while(bytesRead == 8000);
+			// add hash and block to the fileHash table
+			storeBlock(hashVal, block);
 
-		// QByteArray hashedMetafile = QCA::Hash("sha1").hash(output).toByteArray();
-		// qDebug() << hashedMetafile.toHex() << endl;
+			// Append to hash metafile
+			output.append(hashVal);
+			totalBytes += block.size();
+		}
 
-		// // Insert the metadata into the fileMetadata table
-		// QVariantMap metadataMap;
-		// metadataMap.insert("fileName", fileList[i]);
-		// metadataMap.insert("fileSize", totalBytes);
-		// metadataMap.insert("metaFile", output);
-		// fileMetadata.insert(hashedMetafile, metadataMap);
+		QByteArray hashedMetafile = QCA::Hash("sha1").hash(output).toByteArray();
+		qDebug() << "Metafile hash " << hashedMetafile.toHex() << endl;
+
+		// Insert the metadata into the fileMetadata table and the keyword index
+		QVariantMap metadataMap;
+		metadataMap.insert("fileName", tokens.at(tokens.size() - 1));
+		metadataMap.insert("fileSize", totalBytes);
+		metadataMap.insert("metaFile", output);
+		metadataMap.insert("path", QFileInfo(fileList[i]).absoluteFilePath());
+		fileMetadata.insert(hashedMetafile, metadataMap);
+		indexFile(hashedMetafile, tokens.at(tokens.size() - 1));
+		publishKeywords(hashedMetafile, tokens.at(tokens.size() - 1), keywordPayloads);
 	}
+
+	bulkLookup("files", filePayloads);
+	bulkLookup("keywords", keywordPayloads);
 }
 
 
@@ -1661,7 +5339,8 @@ TableDialog::TableDialog()
 
 	// Finger Table Demo
 	// Create and don't show visual table
-	visualTable = new QTableWidget(7, 5, this);
+	// One row per finger
+	visualTable = new QTableWidget(RING_BITS, 5, this);
 	visualTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
 
 	// Layout for table
@@ -1676,11 +5355,14 @@ QTableWidget* TableDialog::getVisualTable() {
 }
 
 
+#ifndef PEERSTER_NO_MAIN
 int main(int argc, char **argv)
 {
 	// Initialize Qt toolkit
 	QApplication app(argc,argv);
 
+	Tracer::configure(app.arguments());
+
 	// Create an instance of messageSender (super class containing chatDialog & socket)
 	MessageSender msgSend;
 
@@ -1688,5 +5370,8 @@ int main(int argc, char **argv)
 	QCA::Initializer qcainit;
 
 	// Enter the Qt main loop; everything else is event driven
-	return app.exec();
+	int status = app.exec();
+	Tracer::dumpToFile();
+	return status;
 }
+#endif // PEERSTER_NO_MAIN
@@ -5,6 +5,8 @@
 #include <QTextEdit>
 #include <QLineEdit>
 #include <QUdpSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
 #include <QKeyEvent>
 #include <QVariant>
 #include <QByteArray>
@@ -30,6 +32,56 @@
 #include <QDataStream>
 #include <QTableWidget>
 #include <QTableWidgetItem>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QQueue>
+#include <QElapsedTimer>
+#include <QCache>
+#include <QAtomicInt>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <qmath.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// recvmmsg/sendmmsg batching of the node's socket on Linux. Build with
+// DEFINES+=PEERSTER_NO_MMSG to use the plain QUdpSocket calls everywhere
+#if defined(Q_OS_LINUX) && !defined(PEERSTER_NO_MMSG)
+#define PEERSTER_MMSG 1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+// Width of chord IDs. Peerster nodes use 8 bits; the simulator builds with a wider ring
+#ifndef RING_BITS
+#define RING_BITS 8
+#endif
+#define RING_SIZE (1 << RING_BITS)
+// Stands for "no node" wherever a ring ID is expected. 257 on the default ring
+#define RING_NONE (RING_SIZE + 1)
+
+// Most verbose trace level compiled in. Build with DEFINES+=TRACE_MAX_LEVEL=1 to drop the
+// per message events from the binary altogether
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL 3
+#endif
+// Events kept in the trace ring buffer. A power of two
+#ifndef TRACE_BUFFER_EVENTS
+#define TRACE_BUFFER_EVENTS (1 << 16)
+#endif
+
+// Record a trace event if its level is compiled in and enabled at runtime. Disabled events
+// cost one integer compare, and nothing at all above TRACE_MAX_LEVEL
+#define TRACE(traceLevel, event, node, a, b, c) \
+	do { \
+		if ((traceLevel) <= TRACE_MAX_LEVEL && (traceLevel) <= Tracer::level) Tracer::record(traceLevel, event, node, a, b, c); \
+	} while (0)
 
 
 
@@ -98,6 +150,8 @@ public:
 
 	// Bind this socket to a Peerster-specific default port.
 	bool bind();
+	// Bind this socket to any free port, for virtual nodes
+	bool bindAny();
 	int getMyPortMin();
 	int getMyPortMax();
 	int getMyPortVal();
@@ -109,6 +163,314 @@ private:
 
 
 
+// Where a node's outgoing messages go. DatagramBatcher puts them on the UDP socket; the
+// simulator hands them to other nodes in the same process
+class Transport : public QObject
+{
+public:
+	Transport(QObject *parent = 0) : QObject(parent), datagramsSent(0), datagramBytesSent(0) {}
+
+	// May be held back briefly and combined with other messages to the same destination
+	virtual void send(QByteArray data, QHostAddress address, quint16 port) = 0;
+	// Goes out now, on its own
+	virtual void sendDatagram(QByteArray data, QHostAddress address, quint16 port) = 0;
+
+	// What actually went on the wire, after batching. Left at 0 by transports without a wire
+	qint64 datagramsSent;
+	qint64 datagramBytesSent;
+};
+
+
+class ProtocolTimer;
+
+// Clock and timeouts for protocol timers. Unless one is set, timers run on a TimerWheel
+class TimerScheduler
+{
+public:
+	virtual ~TimerScheduler() {}
+	virtual qint64 now() = 0;
+	// Call timer->fire(token) at time due, unless it was restarted or stopped since
+	virtual void schedule(ProtocolTimer *timer, qint64 due, quint64 token) = 0;
+	// The timer was stopped. Schedulers that rely on the token check can ignore this
+	virtual void cancel(ProtocolTimer *) {}
+	virtual void timerDestroyed(ProtocolTimer *timer) = 0;
+};
+
+
+// A timer's deadline in a TimerWheel, in one of its slots' lists
+class TimerWheelEntry
+{
+public:
+	ProtocolTimer *timer;
+	quint64 token;
+	quint64 due;
+	TimerWheelEntry *prev;
+	TimerWheelEntry *next;
+	TimerWheelEntry **head;
+};
+
+
+// Wall clock scheduler. Every armed timer sits in a hierarchical timing wheel of four levels
+// of 256 slots, advanced by a single QTimer, so arming, restarting and stopping a timer take
+// constant time however many are armed. The QTimer sleeps until the next tick with work, so
+// an idle node isn't woken every tick. Lives on the main thread
+class TimerWheel : public QObject, public TimerScheduler
+{
+	Q_OBJECT
+
+public:
+	TimerWheel();
+	~TimerWheel();
+	qint64 now();
+	void schedule(ProtocolTimer *timer, qint64 due, quint64 token);
+	void cancel(ProtocolTimer *timer);
+	void timerDestroyed(ProtocolTimer *timer);
+	int armed();
+
+private slots:
+	void tick();
+
+private:
+	static const int levelBits = 8;
+	static const int levelSlots = 1 << levelBits;
+	static const int levels = 4;
+
+	void insert(TimerWheelEntry *entry);
+	void unlink(TimerWheelEntry *entry);
+	void cascade(int level, int slot);
+	quint64 nextWork();
+	void arm();
+
+	QTimer *tickTimer;
+	QElapsedTimer clock;
+	// Last tick processed, in ticks since clock started, and the tick tickTimer is set for
+	quint64 current;
+	quint64 wakeTick;
+	TimerWheelEntry *wheel[levels][levelSlots];
+	QHash<ProtocolTimer *, TimerWheelEntry *> entries;
+};
+
+
+// QTimer stand in for the protocol's timeouts. Deadlines go to the scheduler: a TimerWheel
+// normally, or a discrete event simulator running many nodes on virtual time
+class ProtocolTimer : public QObject
+{
+	Q_OBJECT
+
+public:
+	ProtocolTimer(QObject *parent = 0);
+	~ProtocolTimer();
+	void start(int msec);
+	void start();
+	void stop();
+	bool isActive();
+	void setSingleShot(bool singleShot);
+	void fire(quint64 token);
+
+	// Current time in ms, virtual under a simulator
+	static qint64 now();
+	static void setScheduler(TimerScheduler *scheduler);
+
+signals:
+	void timeout();
+
+private:
+	bool singleShot;
+	bool active;
+	int interval;
+	// When the timer is due next. Periodic timers step it by interval
+	qint64 deadline;
+	quint64 token;
+
+	static TimerScheduler *scheduler;
+	static quint64 nextToken;
+};
+
+
+// Owns a node's UDP socket, on the I/O thread when the node has one. Datagrams are read and
+// decoded there and each message in them handed to the node; writes the node's
+// DatagramBatcher queues go out from there too. On Linux both directions are batched into
+// recvmmsg and sendmmsg calls
+class DatagramIo : public QObject
+{
+	Q_OBJECT
+
+public:
+	DatagramIo(QUdpSocket *socket);
+	void setBatchedSyscalls(bool enabled);
+
+	qint64 datagramsRead;
+
+public slots:
+	void readPending();
+	void write(QByteArray data, uint address, int port);
+	void flushWrites();
+
+signals:
+	void received(QVariantMap map, uint address, int port, int messageBytes, int datagramBytes);
+
+private:
+	void deliver(QByteArray datagram, quint32 address, quint16 port);
+	int readBatch();
+	int writeBatch(int first);
+
+	QUdpSocket *socket;
+	bool batchedSyscalls;
+	bool flushPosted;
+	QByteArray readBuffer;
+	QList<QByteArray> outData;
+	QList<QPair<quint32, quint16>> outDest;
+};
+
+
+// Collects the small messages sent to each destination during one pass of the event loop
+// and sends them together in one datagram
+class DatagramBatcher : public Transport
+{
+	Q_OBJECT
+
+public:
+	DatagramBatcher(QUdpSocket *socket, QObject *parent = 0);
+	void send(QByteArray data, QHostAddress address, quint16 port);
+	void sendDatagram(QByteArray data, QHostAddress address, quint16 port);
+	void setIo(DatagramIo *io);
+
+public slots:
+	void flush();
+
+private:
+	void flushDestination(QPair<quint32, quint16> dest);
+	void write(QByteArray data, QHostAddress address, quint16 port);
+
+	QUdpSocket *socket;
+	DatagramIo *io;
+	QTimer *flushTimer;
+	QHash<QPair<quint32, quint16>, QList<QByteArray>> pending;
+	QHash<QPair<quint32, quint16>, int> pendingBytes;
+	// When the oldest message still queued, for any destination, was queued
+	qint64 firstPendingSince;
+};
+
+
+// Recent gaps between heartbeats from one neighbor, with running sums for their mean and
+// variance
+class HeartbeatHistory
+{
+public:
+	HeartbeatHistory();
+
+	qint64 last;
+	QQueue<qint64> intervals;
+	double sum;
+	double squares;
+};
+
+
+// Phi accrual failure detector. Turns the time since a neighbor's last heartbeat, against
+// the distribution of its recent gaps, into a suspicion level phi: the neighbor is up but
+// slow with probability 10^-phi. Neighbors are keyed by address
+class FailureDetector
+{
+public:
+	void watch(QPair<quint32, quint16> node, qint64 now, qint64 expectedInterval);
+	void heartbeat(QPair<quint32, quint16> node, qint64 now);
+	double phi(QPair<quint32, quint16> node, qint64 now);
+	void forget(QPair<quint32, quint16> node);
+	void retain(QSet<QPair<quint32, quint16>> watched);
+
+private:
+	void addInterval(HeartbeatHistory &history, qint64 interval);
+
+	QHash<QPair<quint32, quint16>, HeartbeatHistory> nodes;
+};
+
+
+// A segment of the reliable transport that has been sent but not acknowledged
+class ReliableSegment
+{
+public:
+	ReliableSegment();
+	ReliableSegment(QPair<QByteArray, bool> fragment, qint64 sentAt);
+
+	QByteArray data;
+	// More fragments of the same message follow this one
+	bool more;
+	qint64 sentAt;
+	int transmissions;
+	// Acknowledgements for later segments seen since this one was sent
+	int sackSkips;
+	// The peer holds it out of order. Kept until the cumulative ack covers it, since the
+	// peer may still drop it
+	bool sacked;
+};
+
+
+// Reliable transport state for one peer, both directions
+class ReliablePeer
+{
+public:
+	ReliablePeer();
+
+	// Sending side. A new session starts when the peer stops answering
+	quint32 session;
+	quint32 nextSeq;
+	QQueue<QPair<QByteArray, bool>> waiting;
+	QMap<quint32, ReliableSegment> inFlight;
+	// In flight segments the peer has sacked. They don't count against the window
+	int sacked;
+	double cwnd;
+	double ssthresh;
+	double srtt;
+	double rttvar;
+	qint64 rto;
+	quint32 recoverySeq;
+
+	// Receiving side
+	quint32 peerSession;
+	quint32 expectedSeq;
+	QMap<quint32, QVariantMap> outOfOrder;
+	// Fragments of the message being reassembled
+	QByteArray partial;
+	bool discarding;
+	qint64 lastProgress;
+};
+
+
+// Reliable, in-order, congestion controlled delivery of block traffic on top of the node's
+// transport: sequence numbers, selective acks, RTT based retransmission and AIMD windows.
+// Messages are cut into MTU sized fragments, one per segment, so a lost piece of a large
+// block is resent on its own
+class BlockTransport : public QObject
+{
+	Q_OBJECT
+
+public:
+	BlockTransport(Transport *transport, const quint32 *node, QObject *parent = 0);
+	void send(QByteArray message, QHostAddress address, quint16 port);
+	void receiveSegment(QVariantMap map, QHostAddress address, quint16 port);
+	void receiveAck(QVariantMap map, QHostAddress address, quint16 port);
+
+signals:
+	void messageReceived(QByteArray message, QHostAddress address, quint16 port);
+	void sendFailed(QHostAddress address, quint16 port, int messages);
+
+public slots:
+	void checkTimeouts();
+
+private:
+	void pump(QPair<quint32, quint16> dest);
+	void transmit(QPair<quint32, quint16> dest, quint32 seq);
+	void sampleRtt(ReliablePeer &peer, qint64 rtt);
+	void deliverFragment(ReliablePeer &peer, QVariantMap segmentMap, QHostAddress address, quint16 port);
+
+	Transport *transport;
+	// ID of the owning node, for trace events
+	const quint32 *node;
+	ProtocolTimer *retransmitTimer;
+	QHash<QPair<quint32, quint16>, ReliablePeer> peers;
+};
+
+
 class Peer
 {
 
@@ -129,6 +491,121 @@ private:
 	quint16 port;
 };
 
+// Rumors seen from one origin: every SeqNo up to contiguous, plus the few beyond it that
+// arrived early
+class RumorOrigin
+{
+public:
+	RumorOrigin();
+
+	quint32 contiguous;
+	QSet<quint32> window;
+};
+
+
+// Next hop towards a named node. Direct entries were learned from the node itself (a reply
+// or a lookup carrying its address); the rest point back along the path a message came in on
+class RouteEntry
+{
+public:
+	RouteEntry();
+
+	QPair<QHostAddress, quint16> nextHop;
+	qint64 expires;
+	bool direct;
+};
+
+
+// Byte and CPU totals of one file download, to report what block compression bought
+class TransferStats
+{
+public:
+	TransferStats();
+
+	int blocks;
+	qint64 rawBytes;
+	qint64 wireBytes;
+	// Compression time at the sender plus decompression time here
+	qint64 codecNanos;
+};
+
+// Observations counted into buckets by upper bound. The last bucket has no bound
+class Histogram
+{
+public:
+	Histogram();
+	Histogram(const double *bounds, int boundCount);
+	void observe(double value);
+
+	QList<double> bounds;
+	QList<qint64> counts;
+	double sum;
+	qint64 count;
+};
+
+
+// Counters, gauges and histograms of one node, rendered in the Prometheus text format.
+// Names may carry labels, e.g. peerster_messages_received_total{type="rumor"}
+class Metrics
+{
+public:
+	void count(QString name, qint64 amount = 1);
+	void setGauge(QString name, double value);
+	void observe(QString name, double value, const double *bounds, int boundCount);
+	static QString render(QList<QPair<QString, Metrics *>> nodes);
+
+	QMap<QString, qint64> counters;
+	QMap<QString, double> gauges;
+	QMap<QString, Histogram> histograms;
+};
+
+enum TraceLevel { TraceError, TraceWarn, TraceInfo, TraceDebug };
+
+// Trace event IDs. Their names and argument names are in traceEventNames and
+// traceEventArgs in main.cc, and are written into every dump
+enum TraceEventId {
+	TraceReceive, TraceMessage, TraceSend, TraceBlockReply, TraceBlockRequest,
+	TraceClosestPredecessor, TraceFindSuccessor, TraceLookupDone, TraceSuccessorFailover,
+	TraceStabilizeRound, TraceKeyMigration, TraceLookupHop, TraceNeighborSuspected,
+	TraceBlockCacheHit, TraceLookupCacheHit, TraceBlockReplyDropped, TraceRetransmitTimeout,
+	TraceEventCount
+};
+
+
+// One binary trace record. Plain data so the ring buffer needs no construction
+struct TraceEvent
+{
+	qint64 time;
+	quint32 seq;
+	quint32 node;
+	quint16 id;
+	quint16 level;
+	qint64 args[3];
+};
+
+
+// Process wide trace ring buffer. Writers claim a slot with one atomic add and never
+// block; the oldest events are overwritten. -trace-level turns it on, -trace-sample N keeps
+// one in N debug events and -trace-file names the dump written at exit
+class Tracer
+{
+public:
+	static void configure(QStringList args);
+	static void record(int level, int id, quint32 node, qint64 a, qint64 b, qint64 c);
+	static QByteArray dump();
+	static void dumpToFile();
+
+	static int level;
+
+private:
+	static int sampleEvery;
+	static quint32 sampleCount;
+	static QString file;
+	static QAtomicInt head;
+	static TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+
 class TableDialog : public QDialog
 {
   Q_OBJECT
@@ -142,20 +619,71 @@ private:
 };
 
 
-// Main window class containing a ChatDialog and NetSocket
-class MessageSender : public QMainWindow
+// How often one key was asked for lately, as a count decaying over hotKeyWindow
+class HotKey
+{
+public:
+	HotKey();
+
+	double rate;
+	qint64 updated;
+	qint64 lastPush;
+};
+
+
+// Shared files and their blocks. One per process, used by all its virtual nodes
+class BlockStore
+{
+public:
+	QVariantMap fileHash;
+	QVariantMap fileMetadata;
+	QHash<QString, QSet<QByteArray>> keywordIndex;
+};
+
+
+// What a virtual node held, kept in its host's snapshot so a restart can give the keys back
+class VirtualNodeState
+{
+public:
+	QString originID;
+	quint32 nodeID;
+	QHash<QByteArray, QList<QByteArray>> fileTable;
+	QHash<QString, QHash<QByteArray, QVariantMap>> keywordPostings;
+};
+
+
+class StatsServer;
+
+// One chord node: its ring state, the protocol handlers and, for the node a user runs, the
+// ChatDialog window
+class MessageSender : public QObject
 {
 	Q_OBJECT
 
+	// Microbenchmarks set up ring and store state directly
+	friend class Benchmark;
+
 public:
-	MessageSender();
+	MessageSender(MessageSender *host = 0, Transport *externalTransport = 0);
+	~MessageSender();
 
 	QByteArray getSerialized(QVariantMap map);
+	static QByteArray serialize(QVariantMap map);
+	void handleMessage(QVariantMap receivedMap, QHostAddress *senderAddress, quint16 *senderPort);
+	void sendRouted(QVariantMap map, QPair<QHostAddress, quint16> nextHop);
 	QString getOriginID();
 	int getNeighbor(int val);
 	Peer getNeighbor();
+	QList<Peer> getNeighbors(int count);
 	void addPeer(QString input);
-	QVariantMap createBlockReply(QString dest, QString origin, QByteArray dataHash, QByteArray data);
+	static QVariantMap createBlockReply(QString dest, QString origin, QByteArray dataHash, QByteArray data, QStringList acceptCodecs);
+	static QVariantMap buildBlockReply(QString dest, QString origin, QByteArray hashVal, QVariantList candidates, QStringList acceptCodecs, QVariantMap extra, int &dataBytes);
+	static QVariantMap verifyBlockReply(QVariantMap map);
+	static int lookupHops(QVariantMap result);
+	void storeBlock(QByteArray hashVal, QByteArray block);
+	QByteArray expectedBlock();
+	void beginDownload(QByteArray metaHash);
+	void serveBlock(QString dest, QByteArray hashVal, QVariantList candidates, QStringList acceptCodecs, QVariantMap extra);
 	QVariantMap createBlockRequest(QString dest, QString origin);
 	QVariantMap createBlockRequest(QString dest, QString origin, QByteArray dataHash);
 	QVariantMap createSearchRequest();
@@ -163,25 +691,86 @@ public:
 	void sendToPeers(QByteArray data);
 	void handleStatusMessage(QVariantMap receivedMap, QHostAddress *senderAddress, quint16 *senderPort);
 	void handleRumorMessage(QVariantMap receivedMap, QHostAddress *senderAddress, quint16 *senderPort);
+	bool recordRumor(QString origin, quint32 seqNo);
+	QVariantMap createStatusMessage();
+	void learnRoutes(QVariantMap map, QHostAddress *senderAddress, quint16 *senderPort);
+	void learnRoute(QString name, QHostAddress address, quint16 port, bool direct);
+	bool lookupRoute(QString dest, QPair<QHostAddress, quint16> &nextHop);
+	quint32 nextRandom();
 	void handleBlockReplyMessage(QVariantMap receivedMap, QString senderOrigin);
 	void handleBlockRequestMessage(QVariantMap receivedMap, QString senderOrigin);
 	void handleSearchReplyMessage(QVariantMap receivedMap);
 	void localFileSearch(QString searchStr, QString dest);
+	static QStringList fileNameTokens(QString fileName);
+	void indexFile(QByteArray metaHash, QString fileName);
+	QList<QByteArray> searchKeywordIndex(QStringList keywords);
+	static quint32 hashToRing(QByteArray value);
+	bool isResponsibleFor(quint32 id);
+	void routeToOwner(quint32 id, QVariantMap map);
+	void publishKeywords(QByteArray metaHash, QString fileName, QVariantMap &payloads);
+	void handleKeywordPublish(QVariantMap map);
+	void handleKeywordQuery(QVariantMap map);
+	void handleKeywordResults(QVariantMap map);
+	void transferKeywords();
+	void bulkLookup(QString purpose, QVariantMap payloads);
+	void handleBulkLookup(QVariantMap map);
+	void handleBulkLookupReply(QVariantMap map, QHostAddress senderAddress, quint16 senderPort);
+	void expireBulkLookups(qint64 now);
+	void expireHotKeys(qint64 now);
+	void handleBulkStore(QVariantMap map, QHostAddress senderAddress, quint16 senderPort);
 	void sendPointToPoint(QVariantMap map);
 	bool createFingerTable();
 	void stabilizePredecessor(QVariantMap map);
 	QByteArray findClosestPredecessor(quint32 newNode);
+	QByteArray findSearchInterval(quint32 id);
 	void joinChord(QString input);
+	void createVirtualNodes();
+	void showRing();
+	void searchFile(quint32 fileID, QVariantMap tags);
+	void finishLookupTrace(quint32 lookupID, QVariantMap result);
+	quint32 getNodeID();
+	int getSuccessorID();
+	int getPredecessorID();
+	QList<quint32> storedFileIDs();
+	void requestJoin(QHostAddress address, quint16 port);
+	void handleLoadProbe(QVariantMap map);
+	void handleLoadReport(QVariantMap map);
+	void adoptNodeID(quint32 id);
+	void recordRequest();
+	bool answerFromLookupCache(QVariantMap map);
+	bool answerFromBlockCache(QVariantMap map);
+	void cacheRelayedBlock(QVariantMap map);
+	void pushHotKey(quint32 key, QVariantMap map);
 	void handleFindSuccessor(QVariantMap receivedMap);
+	void addJoinBootstrap(QVariantMap &reply);
+	void bootstrapFromJoin(QVariantMap reply);
 	void makeStoredFileGui();
+	bool loadState();
+	QVariantMap sharedFileMetadata();
+	bool reloadSharedFile(QVariantMap metaMap);
+	void restoreVirtualNode(VirtualNodeState state);
+	void addRestoredKeys(VirtualNodeState state);
+	void publishRestoredKeys();
+	void verifyRestoredState();
+	void sendStatePing(int id, QHostAddress address, quint16 port);
+	bool suspected(QPair<int, QPair<QHostAddress, quint16>> node, int role, const QHash<QPair<quint32, quint16>, double> &suspects);
+	QList<QPair<int, QPair<QHostAddress, quint16>>> livenessNeighbors();
+	void recordReceived(QVariantMap map, int bytes);
+	void updateGauges();
+	QString renderMetrics();
 
 
 public slots:
-	void onReceive();
+	void onDecodedMessage(QVariantMap receivedMap, uint address, int port, int messageBytes, int datagramBytes);
+	void sendServedBlock(QString dest, QByteArray message, int dataBytes);
+	void finishBlockReply(QVariantMap receivedMap, QString senderOrigin);
+	void onReliableMessage(QByteArray message, QHostAddress address, quint16 port);
+	void blockSendFailed(QHostAddress address, quint16 port, int messages);
 	void peerLookup(QHostInfo host);
 	void chordLookup(QHostInfo host);
 	void joinGuiChord();
 	void searchChordFile();
+	void searchKeywords();
 	void startFileDownload(QListWidgetItem * listItem);
 	void openFileDialog();
 	void getFileMetadata(const QStringList &fileList);
@@ -192,23 +781,54 @@ public slots:
 	void updateTable();
 	void failureProtocol();
 	void displayTable();
+	void antiEntropy();
+	void expireRoutes();
+	void finishBalancedJoin();
+	void saveState();
+	void finishStateCheck();
+	void checkLiveness();
 	
 
 private:
 	ChatDialog *chat;
 	NetSocket *socket;
+	DatagramIo *io;
+	Transport *transport;
+	BlockTransport *blockTransport;
 	QFileDialog *fileDialog;
 	QString originID;
 	quint32 nodeID;
-	QVariantMap msgMap;
-	QVariantMap fileHash;
-	QVariantMap fileMetadata;
-	QTimer *searchRequestTimer;
+	QHash<QString, RumorOrigin> rumorOrigins;
+	QCache<QString, QVariantMap> rumorBodies;
+	QCache<QByteArray, QByteArray> blockCache;
+	QCache<QByteArray, int> blockRequestCounts;
+	ProtocolTimer *gossipTimer;
+	int gossipFanout;
+	quint64 rngState;
+
+	// Virtual nodes share the host's block store. Only the host has a visible window
+	MessageSender *host;
+	QList<MessageSender *> virtualNodes;
+	BlockStore *store;
+	QVariantMap &fileHash;
+	QVariantMap &fileMetadata;
+	QHash<QString, QSet<QByteArray>> &keywordIndex;
+	QHash<QString, QHash<QByteArray, QVariantMap>> keywordPostings;
+	QHash<QString, QVariantMap> pendingBulkLookups;
+	int bulkLookupCount;
+	ProtocolTimer *searchRequestTimer;
 	QVector<Peer> peerLst;
 	QVariantMap portMap;
 	QSet<QString> peerCheck;
-	QHash<QString, QPair<QHostAddress, quint16>> routeTable;
+	QHash<QString, RouteEntry> routeTable;
+	ProtocolTimer *routeTimer;
 	QByteArray fileReceiving;
+	// Hash and next hop of the last block request we sent for our own download, and a
+	// count of downloads started that block replies are tagged with
+	QByteArray pendingBlockRequest;
+	QPair<QHostAddress, quint16> pendingBlockHop;
+	quint32 downloadTransfer;
+	TransferStats downloadStats;
 	QByteArray fileBuilder;
 	QString currentSearch;
 	QVariantMap searchResultsMap;
@@ -222,15 +842,117 @@ private:
 	QHash<QByteArray, QList<QByteArray>>* fingerTable;
 	QHash<QByteArray, QList<QByteArray>>* fileTable;
 
-	QTimer *stabilizeTimer;
-	QTimer *checkPredTimer;
-	QTimer *predResponseTimer;
-
-	QTimer *fingerTableTimer;
-	QTimer *successorFailTimer;
+	ProtocolTimer *stabilizeTimer;
+	ProtocolTimer *checkPredTimer;
+	ProtocolTimer *fingerTableTimer;
+
+	// Heartbeats to the predecessor, successor list and fingers, and the detector their
+	// replies feed. A neighbor is dropped once its phi passes phiThreshold
+	ProtocolTimer *livenessTimer;
+	FailureDetector detector;
+	double phiThreshold;
+
+	// Load-aware join: candidate owners' reports gathered before picking our ID
+	int joinSamples;
+	QHostAddress joinAddress;
+	quint16 joinPort;
+	QList<QVariantMap> loadReports;
+	ProtocolTimer *joinProbeTimer;
+	double requestRate;
+	qint64 requestRateUpdated;
+
+	// Hot key caching: per key request counts, and owners of hot keys pushed to us
+	QHash<quint32, HotKey> keyHeat;
+	QHash<quint32, QPair<int, qint64>> lookupCache;
+
+	// Hop reports for our own lookups, by lookup ID, while -lookup-trace is on. Lookups
+	// that never finish fall out of the cache
+	bool traceLookups;
+	QCache<quint32, QMap<int, quint32>> lookupTraces;
+
+	// Persistent node snapshot for warm restarts
+	QString stateFile;
+	// What the last save wrote, so an unchanged snapshot isn't written again
+	QByteArray savedSnapshot;
+	// Saved virtual nodes not yet created again, on the host. A restored virtual node keeps
+	// the payloads of its saved keys until it has joined and can hand them to their owners
+	QList<VirtualNodeState> savedVirtualNodes;
+	QVariantMap restoredFiles;
+	QVariantMap restoredKeywords;
+	ProtocolTimer *saveStateTimer;
+	ProtocolTimer *stateCheckTimer;
+	QSet<int> confirmedNodes;
+
+	// Block serving and hashing run on workers; the socket lives on ioThread. Both belong
+	// to the host. Everything else, including all table updates, stays on the main thread
+	QThreadPool *workers;
+	QThread *ioThread;
+	bool batchedSyscalls;
+
+	// Runtime metrics, served over HTTP by the host when -stats-port is given. Messages and
+	// bytes per message type are indexed by messageTypeIndex and copied in by updateGauges
+	Metrics metrics;
+	QVector<qint64> messagesSent;
+	QVector<qint64> messageBytesSent;
+	QVector<qint64> messagesReceived;
+	QVector<qint64> messageBytesReceived;
+	qint64 stabilizeStarted;
+	StatsServer *statsServer;
 	
 	TableDialog *tableDialog;
 
 };
 
+
+// Worker job serving one block request: picks the matching block, compresses and serializes
+// the reply, then hands it to the node's thread to send
+class BlockServeTask : public QRunnable
+{
+public:
+	BlockServeTask(MessageSender *node, QString dest, QString origin, QByteArray hashVal, QVariantList candidates, QStringList acceptCodecs, QVariantMap extra);
+	void run();
+
+private:
+	MessageSender *node;
+	QString dest;
+	QString origin;
+	QByteArray hashVal;
+	QVariantList candidates;
+	QStringList acceptCodecs;
+	QVariantMap extra;
+};
+
+
+// Worker job decompressing and hashing a received block before the node stores it
+class BlockVerifyTask : public QRunnable
+{
+public:
+	BlockVerifyTask(MessageSender *node, QVariantMap map, QString senderOrigin);
+	void run();
+
+private:
+	MessageSender *node;
+	QVariantMap map;
+	QString senderOrigin;
+};
+
+
+// Answers every HTTP request on a localhost port with the metrics of a node and its virtual
+// nodes, then closes the connection
+class StatsServer : public QObject
+{
+	Q_OBJECT
+
+public:
+	StatsServer(MessageSender *node, quint16 port);
+
+public slots:
+	void acceptClient();
+	void respond();
+
+private:
+	MessageSender *node;
+	QTcpServer *server;
+};
+
 #endif // PEERSTER_MAIN_HH
@@ -0,0 +1,430 @@
+#include <stdio.h>
+
+#include "sim.hh"
+
+// Defaults for an experiment. All of them can be changed on the command line
+static const int defaultNodeCount = 10000;
+static const int defaultMinLatency = 10;
+static const int defaultMaxLatency = 150;
+static const int defaultJoinInterval = 50;
+static const int defaultKeyCount = 2000;
+static const int defaultLookupCount = 2000;
+static const double defaultFailFraction = 0.1;
+static const double defaultChurnRate = 1.0;
+static const int defaultChurnSeconds = 120;
+static const int defaultSettleSeconds = 600;
+
+// Simulated nodes live at 10.x.x.x, all on the same port
+static const quint32 firstAddress = 0x0a000001;
+static const quint16 nodePort = 5000;
+
+// How often phases issue lookups and churn, and how often convergence is checked, in ms
+static const int phaseTick = 10;
+static const int convergenceTick = 1000;
+
+
+SimTransport::SimTransport(Simulator *sim, QPair<quint32, quint16> address) : Transport()
+{
+	this->sim = sim;
+	this->address = address;
+}
+
+
+void SimTransport::send(QByteArray data, QHostAddress address, quint16 port)
+{
+	sim->send(this->address, data, QPair<quint32, quint16>(address.toIPv4Address(), port));
+}
+
+
+void SimTransport::sendDatagram(QByteArray data, QHostAddress address, quint16 port)
+{
+	send(data, address, port);
+}
+
+
+SimEvent::SimEvent() {
+	kind = Deliver;
+	timer = 0;
+	token = 0;
+}
+
+
+SimLookup::SimLookup() {
+	key = 0;
+	issued = 0;
+	answered = false;
+	correct = false;
+	hops = 0;
+	latency = 0;
+}
+
+
+// Simulator constructor. Reads the experiment parameters and takes over all protocol timers
+Simulator::Simulator(QStringList args) : out(stdout)
+{
+	clock = 0;
+	sequence = 0;
+	nextAddress = firstAddress;
+	messagesSent = 0;
+	messagesLost = 0;
+
+	nodeCount = defaultNodeCount;
+	minLatency = defaultMinLatency;
+	maxLatency = defaultMaxLatency;
+	loss = 0;
+	joinInterval = defaultJoinInterval;
+	keyCount = defaultKeyCount;
+	lookupCount = defaultLookupCount;
+	failFraction = defaultFailFraction;
+	churnRate = defaultChurnRate;
+	churnTime = defaultChurnSeconds * 1000;
+	settleLimit = defaultSettleSeconds * 1000;
+	uint seed = 1;
+
+	for (int i = 1; i < args.size() - 1; i++) {
+		if (args[i] == "-nodes") nodeCount = qMax(1, args[i + 1].toInt());
+		if (args[i] == "-seed") seed = args[i + 1].toUInt();
+		if (args[i] == "-min-latency") minLatency = qMax(0, args[i + 1].toInt());
+		if (args[i] == "-max-latency") maxLatency = qMax(0, args[i + 1].toInt());
+		if (args[i] == "-loss") loss = qBound(0.0, args[i + 1].toDouble(), 1.0);
+		if (args[i] == "-join-interval") joinInterval = qMax(1, args[i + 1].toInt());
+		if (args[i] == "-keys") keyCount = qMax(1, args[i + 1].toInt());
+		if (args[i] == "-lookups") lookupCount = qMax(0, args[i + 1].toInt());
+		if (args[i] == "-fail") failFraction = qBound(0.0, args[i + 1].toDouble(), 0.9);
+		if (args[i] == "-churn") churnRate = qMax(0.0, args[i + 1].toDouble());
+		if (args[i] == "-churn-time") churnTime = qMax(0, args[i + 1].toInt()) * 1000;
+		if (args[i] == "-settle") settleLimit = qMax(1, args[i + 1].toInt()) * 1000;
+	}
+	maxLatency = qMax(minLatency, maxLatency);
+
+	qsrand(seed);
+	ProtocolTimer::setScheduler(this);
+}
+
+
+qint64 Simulator::now() {
+	return clock;
+}
+
+
+void Simulator::schedule(ProtocolTimer *timer, qint64 due, quint64 token) {
+	timers.insert(timer);
+	SimEvent event;
+	event.kind = SimEvent::Timeout;
+	event.timer = timer;
+	event.token = token;
+	push(due, event);
+}
+
+
+// A deleted timer's pending timeouts must not fire
+void Simulator::timerDestroyed(ProtocolTimer *timer) {
+	timers.remove(timer);
+}
+
+
+// Deliver data after a random latency, unless the network loses it
+void Simulator::send(QPair<quint32, quint16> from, QByteArray data, QPair<quint32, quint16> to) {
+	messagesSent++;
+	if (loss > 0 && qrand() < loss * RAND_MAX) {
+		messagesLost++;
+		return;
+	}
+	SimEvent event;
+	event.kind = SimEvent::Deliver;
+	event.from = from;
+	event.to = to;
+	event.data = data;
+	push(clock + minLatency + qrand() % (maxLatency - minLatency + 1), event);
+}
+
+
+// Events at the same time run in the order they were scheduled
+void Simulator::push(qint64 due, SimEvent event) {
+	events.insert(QPair<qint64, quint64>(due, sequence++), event);
+}
+
+
+// Process every event due by end, then move the clock to end
+void Simulator::runUntil(qint64 end) {
+	while (!events.isEmpty() && events.firstKey().first <= end) {
+		clock = events.firstKey().first;
+		SimEvent event = events.take(events.firstKey());
+		if (event.kind == SimEvent::Timeout) {
+			if (timers.contains(event.timer)) event.timer->fire(event.token);
+		}
+		else {
+			deliver(event);
+		}
+	}
+	clock = end;
+}
+
+
+// Hand a message to its destination node. Answers to our lookups are recorded on the way
+void Simulator::deliver(SimEvent &event) {
+	MessageSender *node = nodes.value(event.to);
+	if (!node) return;
+
+	QVariantMap map;
+	QDataStream stream(&event.data, QIODevice::ReadOnly);
+	stream >> map;
+
+	if (map.contains("simLookup") && map["fileSearch"].toUInt() == node->getNodeID()
+		&& (map.contains("success") || map.contains("empty"))) {
+		SimLookup &lookup = lookups[map["simLookup"].toInt()];
+		if (!lookup.answered) {
+			lookup.answered = true;
+			lookup.hops = MessageSender::lookupHops(map);
+			lookup.latency = clock - lookup.issued;
+			if (map.contains("success")) {
+				quint32 holder = map["success"].toUInt();
+				for (auto candidate: nodes) {
+					if (candidate->getNodeID() == holder && candidate->storedFileIDs().contains(lookup.key)) {
+						lookup.correct = true;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	QHostAddress fromAddress(event.from.first);
+	quint16 fromPort = event.from.second;
+	node->handleMessage(map, &fromAddress, &fromPort);
+}
+
+
+// Start a new node and have it join the ring through a random live node
+MessageSender *Simulator::addNode() {
+	bool alone = nodes.isEmpty();
+	QPair<quint32, quint16> bootstrap = randomAddress();
+	QPair<quint32, quint16> address(nextAddress++, nodePort);
+	SimTransport *transport = new SimTransport(this, address);
+	MessageSender *node = new MessageSender(0, transport);
+	transport->setParent(node);
+	nodes.insert(address, node);
+
+	if (!alone) {
+		node->joinChord(QHostAddress(bootstrap.first).toString() + ":" + QString::number(bootstrap.second));
+	}
+	return node;
+}
+
+
+// Crash a random node. It stops answering without telling anyone
+void Simulator::failRandomNode() {
+	if (nodes.size() < 2) return;
+	delete nodes.take(randomAddress());
+}
+
+
+QPair<quint32, quint16> Simulator::randomAddress() {
+	if (nodes.isEmpty()) return QPair<quint32, quint16>(0, 0);
+	auto i = nodes.begin();
+	i += qrand() % nodes.size();
+	return i.key();
+}
+
+
+// Fraction of live nodes whose successor and predecessor are the live nodes next to them
+double Simulator::ringCorrectness() {
+	if (nodes.isEmpty()) return 1;
+	QMap<quint32, MessageSender *> ring;
+	for (auto node: nodes) {
+		ring.insert(node->getNodeID(), node);
+	}
+	QList<quint32> ids = ring.keys();
+	int correct = 0;
+	for (int i = 0; i < ids.size(); i++) {
+		MessageSender *node = ring[ids[i]];
+		if (ids.size() == 1) {
+			correct++;
+			continue;
+		}
+		quint32 next = ids[(i + 1) % ids.size()];
+		quint32 prev = ids[(i + ids.size() - 1) % ids.size()];
+		if ((quint32)node->getSuccessorID() == next && (quint32)node->getPredecessorID() == prev) {
+			correct++;
+		}
+	}
+	return (double)correct / nodes.size();
+}
+
+
+// Run until every node has the right neighbors, or settleLimit passes. Returns the time it
+// took, or -1
+qint64 Simulator::waitForConvergence(QString phase) {
+	qint64 start = clock;
+	double correctness = ringCorrectness();
+	while (correctness < 1 && clock - start < settleLimit) {
+		runUntil(clock + convergenceTick);
+		correctness = ringCorrectness();
+	}
+	qint64 took = clock - start;
+	if (correctness < 1) {
+		out << "[" << phase << "] ring not converged after " << took / 1000.0 << " s ("
+			<< correctness * 100 << "% of nodes have correct neighbors)" << endl;
+		return -1;
+	}
+	out << "[" << phase << "] ring converged after " << took / 1000.0 << " s" << endl;
+	return took;
+}
+
+
+// Put keyCount random file IDs on the nodes responsible for them
+void Simulator::storeKeys() {
+	QMap<quint32, QPair<quint32, quint16>> ring;
+	for (auto i = nodes.begin(); i != nodes.end(); i++) {
+		ring.insert(i.value()->getNodeID(), i.key());
+	}
+	for (int i = 0; i < keyCount; i++) {
+		quint32 key = ((quint32)qrand() * 7919u + (quint32)qrand()) % RING_SIZE;
+		keys.append(key);
+
+		auto owner = ring.lowerBound(key);
+		if (owner == ring.end()) owner = ring.begin();
+		QVariantMap storeMap;
+		storeMap.insert("store", 1);
+		storeMap.insert("fileID", key);
+		storeMap.insert("fileName", "sim-" + QString::number(key));
+
+		QByteArray data;
+		QDataStream stream(&data, QIODevice::WriteOnly);
+		stream << storeMap;
+		SimEvent event;
+		event.from = owner.value();
+		event.to = owner.value();
+		event.data = data;
+		push(clock, event);
+	}
+	runUntil(clock);
+}
+
+
+// Run for duration ms, issuing lookups for stored keys from random nodes and replacing
+// random nodes by new ones at the given rates
+void Simulator::runPhase(QString phase, qint64 duration, double lookupsPerSecond, double churnPerSecond) {
+	qint64 end = clock + duration;
+	double lookupCredit = 0;
+	double churnCredit = 0;
+	while (clock < end) {
+		runUntil(clock + phaseTick);
+		lookupCredit += lookupsPerSecond * phaseTick / 1000.0;
+		churnCredit += churnPerSecond * phaseTick / 1000.0;
+
+		for (; churnCredit >= 1; churnCredit -= 1) {
+			failRandomNode();
+			addNode();
+		}
+		for (; lookupCredit >= 1 && !keys.isEmpty(); lookupCredit -= 1) {
+			MessageSender *origin = nodes.value(randomAddress());
+			SimLookup lookup;
+			lookup.phase = phase;
+			lookup.key = keys[qrand() % keys.size()];
+			lookup.issued = clock;
+			int id = lookups.size();
+			lookups.insert(id, lookup);
+
+			QVariantMap tags;
+			tags.insert("simLookup", id);
+			origin->searchFile(lookup.key, tags);
+		}
+	}
+}
+
+
+// Hop counts and latencies of the lookups of one phase
+void Simulator::report(QString phase) {
+	int issued = 0;
+	int answered = 0;
+	int correct = 0;
+	QList<qint64> hops;
+	QList<qint64> latencies;
+	for (auto lookup: lookups) {
+		if (lookup.phase != phase) continue;
+		issued++;
+		if (!lookup.answered) continue;
+		answered++;
+		if (lookup.correct) correct++;
+		hops.append(lookup.hops);
+		latencies.append(lookup.latency);
+	}
+	if (issued == 0) return;
+
+	double hopSum = 0;
+	for (auto hop: hops) hopSum += hop;
+	out << "[" << phase << "] " << nodes.size() << " nodes, " << issued << " lookups, "
+		<< answered * 100.0 / issued << "% answered, " << correct * 100.0 / issued << "% found the key" << endl;
+	if (hops.isEmpty()) return;
+	out << "[" << phase << "] hops mean " << hopSum / hops.size() << " p50 " << percentile(hops, 0.5)
+		<< " p90 " << percentile(hops, 0.9) << " p99 " << percentile(hops, 0.99)
+		<< " max " << percentile(hops, 1) << endl;
+	out << "[" << phase << "] latency ms p50 " << percentile(latencies, 0.5) << " p90 " << percentile(latencies, 0.9)
+		<< " p99 " << percentile(latencies, 0.99) << " max " << percentile(latencies, 1) << endl;
+}
+
+
+qint64 Simulator::percentile(QList<qint64> values, double fraction) {
+	qSort(values);
+	int index = qBound(0, (int)(fraction * values.size() + 0.5) - 1, values.size() - 1);
+	return values[index];
+}
+
+
+// The experiment: grow the ring one join at a time, store keys, look them up, crash a
+// fraction of the nodes at once, look them up again, then run under churn
+int Simulator::run() {
+	out << "Simulating " << nodeCount << " nodes on a " << RING_BITS << " bit ring, latency "
+		<< minLatency << "-" << maxLatency << " ms, loss " << loss * 100 << "%" << endl;
+
+	for (int i = 0; i < nodeCount; i++) {
+		addNode();
+		runUntil(clock + joinInterval);
+	}
+	out << "[grow] all nodes joined after " << clock / 1000.0 << " s" << endl;
+	waitForConvergence("grow");
+
+	storeKeys();
+	double lookupRate = 100.0;
+	runPhase("stable", lookupCount * 1000 / lookupRate, lookupRate, 0);
+	runUntil(clock + 10 * maxLatency * RING_BITS);
+	report("stable");
+
+	int failures = nodes.size() * failFraction;
+	for (int i = 0; i < failures; i++) {
+		failRandomNode();
+	}
+	out << "[fail] crashed " << failures << " nodes" << endl;
+	waitForConvergence("fail");
+	runPhase("fail", lookupCount * 1000 / lookupRate, lookupRate, 0);
+	runUntil(clock + 10 * maxLatency * RING_BITS);
+	report("fail");
+
+	if (churnRate > 0 && churnTime > 0) {
+		runPhase("churn", churnTime, lookupRate, churnRate);
+		runUntil(clock + 10 * maxLatency * RING_BITS);
+		report("churn");
+		waitForConvergence("churn");
+	}
+
+	out << "Sent " << messagesSent << " messages, lost " << messagesLost << ", virtual time "
+		<< clock / 1000.0 << " s" << endl;
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+
+	// Init Crypto
+	QCA::Initializer qcainit;
+
+	Tracer::configure(app.arguments());
+
+	Simulator sim(app.arguments());
+	int status = sim.run();
+	Tracer::dumpToFile();
+	return status;
+}
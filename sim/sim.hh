@@ -0,0 +1,115 @@
+#ifndef PEERSTER_SIM_HH
+#define PEERSTER_SIM_HH
+
+#include <QTextStream>
+
+#include "main.hh"
+
+class Simulator;
+
+
+// A simulated node's transport. Messages go to the simulator, which delivers them to the
+// destination node after a simulated delay
+class SimTransport : public Transport
+{
+public:
+	SimTransport(Simulator *sim, QPair<quint32, quint16> address);
+	void send(QByteArray data, QHostAddress address, quint16 port);
+	void sendDatagram(QByteArray data, QHostAddress address, quint16 port);
+
+private:
+	Simulator *sim;
+	QPair<quint32, quint16> address;
+};
+
+
+// Something that happens at a point of virtual time: a message arrives or a timer goes off
+class SimEvent
+{
+public:
+	SimEvent();
+
+	enum Kind { Deliver, Timeout };
+	int kind;
+
+	// Deliver
+	QPair<quint32, quint16> from;
+	QPair<quint32, quint16> to;
+	QByteArray data;
+
+	// Timeout
+	ProtocolTimer *timer;
+	quint64 token;
+};
+
+
+// One file lookup issued by the simulator and its outcome
+class SimLookup
+{
+public:
+	SimLookup();
+
+	QString phase;
+	quint32 key;
+	qint64 issued;
+	bool answered;
+	bool correct;
+	int hops;
+	qint64 latency;
+};
+
+
+// Discrete event simulator running many chord nodes in one process on virtual time, with
+// random per message latency, message loss, joins, failures and churn
+class Simulator : public TimerScheduler
+{
+public:
+	Simulator(QStringList args);
+
+	qint64 now();
+	void schedule(ProtocolTimer *timer, qint64 due, quint64 token);
+	void timerDestroyed(ProtocolTimer *timer);
+	void send(QPair<quint32, quint16> from, QByteArray data, QPair<quint32, quint16> to);
+	int run();
+
+private:
+	void push(qint64 due, SimEvent event);
+	void runUntil(qint64 end);
+	void deliver(SimEvent &event);
+	MessageSender *addNode();
+	void failRandomNode();
+	QPair<quint32, quint16> randomAddress();
+	double ringCorrectness();
+	qint64 waitForConvergence(QString phase);
+	void storeKeys();
+	void runPhase(QString phase, qint64 duration, double lookupsPerSecond, double churnPerSecond);
+	void report(QString phase);
+	static qint64 percentile(QList<qint64> values, double fraction);
+
+	qint64 clock;
+	quint64 sequence;
+	QMap<QPair<qint64, quint64>, SimEvent> events;
+	QSet<ProtocolTimer *> timers;
+	QHash<QPair<quint32, quint16>, MessageSender *> nodes;
+	quint32 nextAddress;
+	QList<quint32> keys;
+	QHash<int, SimLookup> lookups;
+	qint64 messagesSent;
+	qint64 messagesLost;
+	QTextStream out;
+
+	// Experiment parameters
+	int nodeCount;
+	int minLatency;
+	int maxLatency;
+	double loss;
+	int joinInterval;
+	int keyCount;
+	int lookupCount;
+	double failFraction;
+	double churnRate;
+	qint64 churnTime;
+	qint64 settleLimit;
+};
+
+#endif // PEERSTER_SIM_HH
@@ -0,0 +1,15 @@
+######################################################################
+# Discrete event simulator running many chord nodes in one process
+######################################################################
+
+TEMPLATE = app
+TARGET = chordsim
+DEPENDPATH += . ..
+INCLUDEPATH += . ..
+QT += network
+CONFIG += crypto console
+DEFINES += PEERSTER_NO_MAIN RING_BITS=24 QT_NO_DEBUG_OUTPUT
+
+# Input
+HEADERS += ../main.hh sim.hh
+SOURCES += ../main.cc sim.cc
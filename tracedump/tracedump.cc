@@ -0,0 +1,111 @@
+#include <stdio.h>
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QDataStream>
+#include <QFile>
+#include <QMap>
+#include <QHostAddress>
+#include <QTextStream>
+
+// Must match the header Tracer::dump writes
+static const quint32 traceMagic = 0x43545243;
+static const quint32 traceVersion = 1;
+
+static const char *levelNames[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+
+// Print the events of a trace dump written by -trace-file or fetched from a node's
+// /trace endpoint, one per line, or with -summary a count per event
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	QTextStream out(stdout);
+	QTextStream err(stderr);
+
+	QString path;
+	int maxLevel = 3;
+	QString eventFilter;
+	qint64 nodeFilter = -1;
+	bool summary = false;
+	QStringList args = app.arguments();
+	for (int i = 1; i < args.size(); i++) {
+		if (args[i] == "-summary") summary = true;
+		else if (args[i] == "-level" && i + 1 < args.size()) maxLevel = args[++i].toInt();
+		else if (args[i] == "-event" && i + 1 < args.size()) eventFilter = args[++i];
+		else if (args[i] == "-node" && i + 1 < args.size()) nodeFilter = args[++i].toLongLong();
+		else path = args[i];
+	}
+	if (path.isEmpty()) {
+		err << "usage: tracedump [-summary] [-level N] [-event name] [-node id] trace.bin" << endl;
+		return 2;
+	}
+
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly)) {
+		err << "Could not open " << path << endl;
+		return 1;
+	}
+	QDataStream in(&file);
+
+	quint32 magic;
+	quint32 version;
+	in >> magic >> version;
+	if (magic != traceMagic || version != traceVersion) {
+		err << path << " is not a version " << traceVersion << " trace dump" << endl;
+		return 1;
+	}
+	QStringList names;
+	QStringList argNames;
+	QStringList types;
+	quint32 count;
+	in >> names >> argNames >> types >> count;
+
+	QMap<QString, qint64> eventCounts;
+	qint64 torn = 0;
+	quint32 expectedSeq = 0;
+	for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+		qint64 time;
+		quint32 seq;
+		quint32 node;
+		quint16 id;
+		quint16 level;
+		qint64 values[3];
+		in >> time >> seq >> node >> id >> level >> values[0] >> values[1] >> values[2];
+
+		// Events are dumped in seq order. One that was being written during the dump is not
+		if (i == 0) expectedSeq = seq;
+		if (seq != expectedSeq) torn++;
+		expectedSeq++;
+
+		if (level > maxLevel) continue;
+		if (nodeFilter >= 0 && node != nodeFilter) continue;
+		QString name = id < names.size() ? names[id] : QString("event%1").arg(id);
+		if (!eventFilter.isEmpty() && name != eventFilter) continue;
+
+		if (summary) {
+			eventCounts[name]++;
+			continue;
+		}
+
+		QString line = QString("%1 %2 %3 %4 %5").arg(time).arg(seq).arg(node)
+			.arg(level < 4 ? levelNames[level] : "?").arg(name);
+		QStringList fields = id < argNames.size() ? argNames[id].split(',', QString::SkipEmptyParts) : QStringList();
+		for (int a = 0; a < fields.size() && a < 3; a++) {
+			QString value = QString::number(values[a]);
+			if (fields[a] == "type" && values[a] >= 0 && values[a] < types.size()) value = types[values[a]];
+			if (fields[a] == "address") value = QHostAddress((quint32)values[a]).toString();
+			line += " " + fields[a] + "=" + value;
+		}
+		out << line << endl;
+	}
+
+	if (summary) {
+		for (auto i = eventCounts.begin(); i != eventCounts.end(); i++) {
+			out << i.key() << " " << i.value() << endl;
+		}
+	}
+	if (in.status() != QDataStream::Ok) err << "Trace dump is truncated" << endl;
+	if (torn) err << torn << " events were being written during the dump" << endl;
+	return 0;
+}
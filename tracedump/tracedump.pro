@@ -0,0 +1,14 @@
+######################################################################
+# Offline reader for the binary trace dumps nodes write
+######################################################################
+
+TEMPLATE = app
+TARGET = tracedump
+DEPENDPATH += .
+INCLUDEPATH += .
+QT += network
+QT -= gui
+CONFIG += console
+
+# Input
+SOURCES += tracedump.cc